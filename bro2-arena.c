@@ -0,0 +1,39 @@
+#include <stdlib.h>
+
+#include "bro2-arena.h"
+
+int bro2_arena_reset(struct bro2_arena *a, size_t sz)
+{
+	a->used = 0;
+	if (sz <= a->sz)
+		return 0;
+
+	/* nothing in it is worth keeping */
+	free(a->base);
+	a->sz = 0;
+	if (posix_memalign((void **)&a->base, BRO2_ARENA_ALIGN, sz)) {
+		a->base = NULL;
+		return -1;
+	}
+	a->sz = sz;
+	return 0;
+}
+
+void *bro2_arena_take(struct bro2_arena *a, size_t sz)
+{
+	void *p;
+
+	sz = BRO2_ARENA_SZ(sz);
+	if (sz > a->sz - a->used)
+		return NULL;
+	p = a->base + a->used;
+	a->used += sz;
+	return p;
+}
+
+void bro2_arena_free(struct bro2_arena *a)
+{
+	free(a->base);
+	a->base = NULL;
+	a->sz = a->used = 0;
+}
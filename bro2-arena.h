@@ -0,0 +1,34 @@
+#ifndef BRO2_ARENA_H_
+#define BRO2_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A device's scan buffers (the frame ring, assembled lines, color planes)
+ * carved out of one block. The layout is redone for every scan, since the
+ * sizes follow the negotiated geometry, but the block is only reallocated
+ * when a scan needs more than any before it. Scanning page after page at
+ * the same settings allocates nothing.
+ */
+
+/* pieces start on cache lines */
+#define BRO2_ARENA_ALIGN 64
+#define BRO2_ARENA_SZ(sz) \
+	(((sz) + BRO2_ARENA_ALIGN - 1) & ~(size_t)(BRO2_ARENA_ALIGN - 1))
+
+struct bro2_arena {
+	uint8_t *base;
+	size_t sz, used;
+};
+
+/* Drop all pieces and make sure there's room for @sz bytes of them (add up
+ * BRO2_ARENA_SZ() of each). Returns -1 if out of memory. */
+int bro2_arena_reset(struct bro2_arena *a, size_t sz);
+
+/* The next @sz bytes, NULL if the reset didn't leave room */
+void *bro2_arena_take(struct bro2_arena *a, size_t sz);
+
+void bro2_arena_free(struct bro2_arena *a);
+
+#endif
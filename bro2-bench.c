@@ -0,0 +1,417 @@
+/*
+ * Throughput and latency of the backend's data path, scanning from a local
+ * bro2-serv (or a given device) through the SANE API.
+ *
+ * Prints a header and then one tab separated line per case, so runs can be
+ * compared mechanically.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <sane/sane.h>
+#include <sane/saneopts.h>
+
+#include <ccan/net/net.h>
+#include <ccan/array_size/array_size.h>
+
+#include "bro2.h"
+
+static struct {
+	SANE_Status (*init)(SANE_Int *, SANE_Auth_Callback);
+	void (*exit)(void);
+	SANE_Status (*open)(SANE_String_Const, SANE_Handle *);
+	void (*close)(SANE_Handle);
+	const SANE_Option_Descriptor *(*get_option_descriptor)(SANE_Handle,
+			SANE_Int);
+	SANE_Status (*control_option)(SANE_Handle, SANE_Int, SANE_Action,
+			void *, SANE_Int *);
+	SANE_Status (*get_parameters)(SANE_Handle, SANE_Parameters *);
+	SANE_Status (*start)(SANE_Handle);
+	SANE_Status (*read)(SANE_Handle, SANE_Byte *, SANE_Int, SANE_Int *);
+	void (*cancel)(SANE_Handle);
+	SANE_String_Const (*strstatus)(SANE_Status);
+} be;
+
+/* The backend is loaded with dlopen() after us, so these (exported with
+ * -rdynamic) are what its calls bind to. It's every socket, pipe and wait
+ * call the data path makes, which is close enough to a syscall count without
+ * needing ptrace or perf. */
+static unsigned long sys_ct;
+
+#define COUNTED(ret, name, params, args)				\
+ret name params								\
+{									\
+	static ret (*real) params;					\
+	if (!real)							\
+		real = dlsym(RTLD_NEXT, #name);				\
+	__atomic_add_fetch(&sys_ct, 1, __ATOMIC_RELAXED);		\
+	return real args;						\
+}
+
+COUNTED(ssize_t, read, (int fd, void *buf, size_t len), (fd, buf, len))
+COUNTED(ssize_t, write, (int fd, const void *buf, size_t len), (fd, buf, len))
+COUNTED(ssize_t, recv, (int fd, void *buf, size_t len, int flags),
+		(fd, buf, len, flags))
+COUNTED(ssize_t, send, (int fd, const void *buf, size_t len, int flags),
+		(fd, buf, len, flags))
+COUNTED(ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags),
+		(fd, msg, flags))
+COUNTED(ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags),
+		(fd, msg, flags))
+COUNTED(int, poll, (struct pollfd *fds, nfds_t ct, int timeout),
+		(fds, ct, timeout))
+COUNTED(int, epoll_wait, (int fd, struct epoll_event *ev, int max, int timeout),
+		(fd, ev, max, timeout))
+
+static int load_backend(const char *path)
+{
+	void *dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!dl) {
+		fprintf(stderr, "%s\n", dlerror());
+		return -1;
+	}
+
+	static const struct {
+		const char *name;
+		size_t off;
+	} syms[] = {
+#define SYM(n) { #n, offsetof(typeof(be), n) }
+		SYM(init), SYM(exit), SYM(open), SYM(close),
+		SYM(get_option_descriptor), SYM(control_option),
+		SYM(get_parameters), SYM(start), SYM(read), SYM(cancel),
+#undef SYM
+	};
+	size_t i;
+
+	/* built with SANE_DLL the entry points are sane_bro2_*, otherwise
+	 * plain sane_* */
+	for (i = 0; i < ARRAY_SIZE(syms); i++) {
+		char name[64];
+		void *f;
+		snprintf(name, sizeof(name), "sane_bro2_%s", syms[i].name);
+		f = dlsym(dl, name);
+		if (!f) {
+			snprintf(name, sizeof(name), "sane_%s", syms[i].name);
+			f = dlsym(dl, name);
+		}
+		if (!f) {
+			fprintf(stderr, "%s: no %s\n", path, name);
+			return -1;
+		}
+		memcpy((char *)&be + syms[i].off, &f, sizeof(f));
+	}
+
+	be.strstatus = dlsym(dl, "sane_strstatus");
+	return 0;
+}
+
+static const char *status_str(SANE_Status s)
+{
+	static char buf[16];
+	if (be.strstatus)
+		return be.strstatus(s);
+	snprintf(buf, sizeof(buf), "status %d", s);
+	return buf;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_now(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Start bro2-serv on @addr and wait for it to take connections */
+static pid_t serv_start(const char *serv, const char *addr, unsigned pages)
+{
+	char pages_str[16];
+	pid_t pid;
+	int i;
+
+	snprintf(pages_str, sizeof(pages_str), "%u", pages);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		execl(serv, serv, "-l", "-c", "0", "-a", addr, "-n", pages_str,
+				(char *)NULL);
+		fprintf(stderr, "%s: %s\n", serv, strerror(errno));
+		_exit(127);
+	}
+
+	for (i = 0; i < 100; i++) {
+		struct addrinfo *res = net_client_lookup(addr, BRO2_PORT_STR,
+				AF_UNSPEC, SOCK_STREAM);
+		int fd = res ? net_connect(res) : -1;
+		if (res)
+			freeaddrinfo(res);
+		if (fd != -1) {
+			close(fd);
+			return pid;
+		}
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return -1;
+		usleep(20000);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static SANE_Int find_option(SANE_Handle h, const char *name)
+{
+	const SANE_Option_Descriptor *d;
+	SANE_Int i;
+
+	for (i = 1; (d = be.get_option_descriptor(h, i)); i++)
+		if (d->name && !strcmp(d->name, name))
+			return i;
+	return -1;
+}
+
+static int set_option(SANE_Handle h, const char *name, void *v)
+{
+	SANE_Int n = find_option(h, name);
+	if (n == -1 || be.control_option(h, n, SANE_ACTION_SET_VALUE, v, NULL)) {
+		fprintf(stderr, "can't set %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+struct bench_case {
+	const char *mode, *compress;
+	SANE_Int res;
+};
+
+/* Scan @pages pages in one go and print the line for it */
+static int bench_run(SANE_Handle h, const struct bench_case *c, unsigned pages,
+		size_t read_sz)
+{
+	static SANE_Byte *buf;
+	SANE_Int res = c->res;
+	SANE_Parameters p = { 0 };
+	SANE_Status s = SANE_STATUS_GOOD;
+	size_t bytes = 0, lines = 0;
+	double t0, t_first = -1, c0;
+	unsigned long sys0;
+	unsigned pg;
+
+	if (!buf && !(buf = malloc(read_sz)))
+		return -1;
+
+	if (set_option(h, SANE_NAME_SCAN_MODE, (void *)c->mode)
+			|| set_option(h, "compession", (void *)c->compress)
+			|| set_option(h, SANE_NAME_SCAN_X_RESOLUTION, &res)
+			|| set_option(h, SANE_NAME_SCAN_Y_RESOLUTION, &res))
+		return -1;
+
+	c0 = cpu_now();
+	sys0 = __atomic_load_n(&sys_ct, __ATOMIC_RELAXED);
+	t0 = now();
+	for (pg = 0; pg < pages && !s; pg++) {
+		size_t page_bytes = 0;
+		SANE_Int len;
+
+		s = be.start(h);
+		if (s)
+			break;
+		be.get_parameters(h, &p);
+
+		while (!(s = be.read(h, buf, read_sz, &len))) {
+			if (len && t_first < 0)
+				t_first = now() - t0;
+			page_bytes += len;
+		}
+		if (s == SANE_STATUS_EOF)
+			s = SANE_STATUS_GOOD;
+
+		bytes += page_bytes;
+		if (p.bytes_per_line > 0)
+			lines += page_bytes / p.bytes_per_line;
+	}
+	double secs = now() - t0;
+	double cpu = cpu_now() - c0;
+	unsigned long sys = __atomic_load_n(&sys_ct, __ATOMIC_RELAXED) - sys0;
+
+	/* a batch ends with the scanner saying the feeder is empty */
+	be.cancel(h);
+
+	printf("%s\t%s\t%d\t%u\t%zu\t%zu\t%.3f\t%.2f\t%.0f\t%.2f\t%.1f\t%.2f\t%s\n",
+			c->mode, c->compress, res, pg, bytes, lines, secs,
+			bytes / secs / 1e6, lines / secs,
+			t_first < 0 ? -1 : t_first * 1e3,
+			pg ? (double)sys / pg : 0, pg ? cpu * 1e3 / pg : 0,
+			s ? status_str(s) : "ok");
+	fflush(stdout);
+	return s ? -1 : 0;
+}
+
+/* Split a comma separated list in place */
+static size_t split(char *s, char **v, size_t max)
+{
+	size_t n = 0;
+	char *tok;
+
+	for (tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ","))
+		v[n++] = tok;
+	return n;
+}
+
+static void usage(const char *prgm)
+{
+	fprintf(stderr,
+		"usage: %s [-b backend.so] [-s bro2-serv] [-a addr] [-d device]\n"
+		"          [-n pages] [-m mode,...] [-r dpi,...] [-c compress,...]\n"
+		"          [-z read_size] [-A]\n"
+		"\n"
+		"Scan every combination of mode, resolution and compression with\n"
+		"the backend (default ./libsane-bro2.so) from a bro2-serv started\n"
+		"on addr (default 127.0.29.21), or from an existing device with\n"
+		"-d. Each case is a batch of -n pages. Prints, tab separated:\n"
+		"mode, compression, dpi, pages, bytes, lines, seconds, MB/s,\n"
+		"lines/s, ms to the first data (-1 if none), syscalls per page (the socket, pipe\n"
+		"and poll calls the backend makes), CPU ms per page and status.\n"
+		"-A scans with auto-area, the preview included in the time.\n",
+		prgm);
+}
+
+int main(int argc, char **argv)
+{
+	const char *backend = "./libsane-bro2.so", *serv = "./bro2-serv";
+	const char *addr = "127.0.29.21", *device = NULL;
+	char modes_arg[] = "GRAY64,CGRAY,TEXT,C256";
+	char res_arg[] = "100,200,300,600,1200";
+	char comp_arg[] = "NONE,RLENGTH";
+	char *mode_s = modes_arg, *res_s = res_arg, *comp_s = comp_arg;
+	char *modes[16], *ress[16], *comps[4];
+	size_t mode_ct, res_ct, comp_ct, i, j, k;
+	size_t read_sz = 1 << 16;
+	unsigned pages = 1;
+	SANE_Bool auto_area = SANE_FALSE;
+	pid_t pid = 0;
+	SANE_Handle h;
+	SANE_Status s;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "b:s:a:d:n:m:r:c:z:A")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 's':
+			serv = optarg;
+			break;
+		case 'a':
+			addr = optarg;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mode_s = optarg;
+			break;
+		case 'r':
+			res_s = optarg;
+			break;
+		case 'c':
+			comp_s = optarg;
+			break;
+		case 'z':
+			read_sz = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			auto_area = SANE_TRUE;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	mode_ct = split(mode_s, modes, ARRAY_SIZE(modes));
+	res_ct = split(res_s, ress, ARRAY_SIZE(ress));
+	comp_ct = split(comp_s, comps, ARRAY_SIZE(comps));
+	if (optind != argc || !pages || !read_sz || read_sz > INT32_MAX
+			|| !mode_ct || !res_ct || !comp_ct) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (load_backend(backend))
+		return 1;
+
+	if (!device) {
+		pid = serv_start(serv, addr, pages);
+		if (pid < 0) {
+			fprintf(stderr, "%s didn't start\n", serv);
+			return 1;
+		}
+		device = addr;
+	}
+
+	be.init(NULL, NULL);
+	s = be.open(device, &h);
+	if (s) {
+		fprintf(stderr, "%s: open: %s\n", device, status_str(s));
+		ret = 1;
+		goto out;
+	}
+	if (auto_area && set_option(h, "auto-area", &auto_area)) {
+		ret = 1;
+		goto close;
+	}
+
+	printf("mode\tcompress\tdpi\tpages\tbytes\tlines\tsecs\tmb_s\tlines_s"
+			"\tfirst_ms\tsyscalls_page\tcpu_ms_page\tstatus\n");
+	for (i = 0; i < mode_ct; i++)
+		for (j = 0; j < res_ct; j++)
+			for (k = 0; k < comp_ct; k++) {
+				struct bench_case c = {
+					.mode = modes[i],
+					.compress = comps[k],
+					.res = strtol(ress[j], NULL, 0),
+				};
+				if (bench_run(h, &c, pages, read_sz))
+					ret = 1;
+			}
+
+close:
+	be.close(h);
+out:
+	be.exit();
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	return ret;
+}
@@ -0,0 +1,222 @@
+#include <string.h>
+#include <endian.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bro2-blank.h"
+
+/* 8 bit samples are looked at this many at a time: 48 gray or 16 RGB
+ * pixels, so a block never splits a pixel */
+#define BLOCK 48
+
+struct line_st {
+	uint8_t min;
+	uint64_t sum, ink;
+	long first, last;	/* ink pixels, first -1 while none */
+};
+
+void bro2_blank_init(struct bro2_blank *b, size_t width, unsigned channels,
+		unsigned depth, uint8_t white, uint8_t *carry)
+{
+	*b = (typeof(*b)) {
+		.width = width,
+		.bpl = depth == 1 ? (width + 7) / 8 : width * channels,
+		.channels = channels,
+		.depth = depth,
+		/* at 0 nothing could be ink, which the kernels can't say */
+		.white = white ? white : 1,
+		.carry = carry,
+	};
+	bro2_blank_reset(b);
+}
+
+void bro2_blank_reset(struct bro2_blank *b)
+{
+	b->carry_fill = 0;
+	b->rows = 0;
+	b->min = 0xff;
+	b->sum = b->ink = 0;
+	b->x0 = b->y0 = b->x1 = b->y1 = -1;
+}
+
+/* Add a block's ink, @m a bit per sample from pixel @px on */
+static void block_ink(struct line_st *s, uint64_t m, size_t px,
+		unsigned channels)
+{
+	/* down to a bit per pixel, at each pixel's first sample */
+	if (channels == 3)
+		m = (m | m >> 1 | m >> 2) & 0x249249249249ull;
+	if (!m)
+		return;
+
+	s->ink += __builtin_popcountll(m);
+	if (s->first < 0)
+		s->first = px + __builtin_ctzll(m) / channels;
+	s->last = px + (63 - __builtin_clzll(m)) / channels;
+}
+
+/* The line's 8 bit samples from @i on */
+static void line8_scalar(const struct bro2_blank *b, const uint8_t *p,
+		size_t i, struct line_st *s)
+{
+	for (; i < b->bpl; i += BLOCK) {
+		size_t n = b->bpl - i < BLOCK ? b->bpl - i : BLOCK, j;
+		uint64_t m = 0;
+
+		for (j = 0; j < n; j++) {
+			uint8_t v = p[i + j];
+			if (v < s->min)
+				s->min = v;
+			s->sum += v;
+			m |= (uint64_t)(v < b->white) << j;
+		}
+		block_ink(s, m, i / b->channels, b->channels);
+	}
+}
+
+#ifdef __SSE2__
+/* Whole blocks, 16 samples a vector. Returns where it stopped. */
+static size_t line8_sse2(const struct bro2_blank *b, const uint8_t *p,
+		struct line_st *s)
+{
+	const __m128i below = _mm_set1_epi8((char)(b->white - 1));
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vmin = _mm_set1_epi8(-1), vsum = zero;
+	uint64_t sum[2];
+	size_t i;
+
+	for (i = 0; i + BLOCK <= b->bpl; i += BLOCK) {
+		uint64_t m = 0;
+		int k;
+
+		for (k = 0; k < BLOCK / 16; k++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i + 16 * k));
+			vmin = _mm_min_epu8(vmin, v);
+			vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+			/* v < white: it's unchanged by min(v, white - 1) */
+			m |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+						_mm_min_epu8(v, below), v)) << 16 * k;
+		}
+		block_ink(s, m, i / b->channels, b->channels);
+	}
+
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 8));
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 4));
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 2));
+	vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 1));
+	uint8_t min = _mm_cvtsi128_si32(vmin);
+	if (min < s->min)
+		s->min = min;
+	_mm_storeu_si128((__m128i *)sum, vsum);
+	s->sum += sum[0] + sum[1];
+	return i;
+}
+#endif
+
+/* 1 bit, set for black, first pixel in the top bit. The padding is clear. */
+static void line1(const struct bro2_blank *b, const uint8_t *p,
+		struct line_st *s)
+{
+	size_t i;
+
+	for (i = 0; i < b->bpl; i += 8) {
+		uint64_t w = 0;
+		memcpy(&w, p + i, b->bpl - i < 8 ? b->bpl - i : 8);
+		w = be64toh(w);
+		if (!w)
+			continue;
+
+		s->ink += __builtin_popcountll(w);
+		if (s->first < 0)
+			s->first = i * 8 + __builtin_clzll(w);
+		s->last = i * 8 + 63 - __builtin_ctzll(w);
+	}
+	if (s->ink)
+		s->min = 0;
+	s->sum = (b->width - s->ink) * 0xff;
+}
+
+static void blank_line(struct bro2_blank *b, const uint8_t *p)
+{
+	struct line_st s = { .min = 0xff, .first = -1 };
+
+	if (b->depth == 1) {
+		line1(b, p, &s);
+	} else {
+		size_t i = 0;
+#ifdef __SSE2__
+		i = line8_sse2(b, p, &s);
+#endif
+		line8_scalar(b, p, i, &s);
+	}
+
+	if (s.min < b->min)
+		b->min = s.min;
+	b->sum += s.sum;
+	b->ink += s.ink;
+	if (s.ink) {
+		if (b->y0 < 0) {
+			b->y0 = b->rows;
+			b->x0 = s.first;
+			b->x1 = s.last;
+		} else {
+			if (s.first < b->x0)
+				b->x0 = s.first;
+			if (s.last > b->x1)
+				b->x1 = s.last;
+		}
+		b->y1 = b->rows;
+	}
+	b->rows++;
+}
+
+void bro2_blank_feed(struct bro2_blank *b, const uint8_t *p, size_t n)
+{
+	if (!b->depth)
+		return;
+
+	while (n) {
+		if (b->carry_fill || n < b->bpl) {
+			size_t c = b->bpl - b->carry_fill;
+			if (c > n)
+				c = n;
+			memcpy(b->carry + b->carry_fill, p, c);
+			b->carry_fill += c;
+			p += c;
+			n -= c;
+			if (b->carry_fill == b->bpl) {
+				blank_line(b, b->carry);
+				b->carry_fill = 0;
+			}
+			continue;
+		}
+
+		blank_line(b, p);
+		p += b->bpl;
+		n -= b->bpl;
+	}
+}
+
+void bro2_blank_page(const struct bro2_blank *b, unsigned ppm,
+		struct bro2_blank_page *pg)
+{
+	uint64_t px = (uint64_t)b->rows * b->width;
+
+	*pg = (typeof(*pg)) {
+		.min = -1,
+		.mean = -1,
+		.tl_x = b->x0,
+		.tl_y = b->y0,
+		.br_x = b->x1,
+		.br_y = b->y1,
+	};
+	if (!b->depth)
+		return;
+
+	pg->ink = b->ink;
+	pg->blank = b->ink * 1000000 <= px * ppm;
+	pg->min = b->min;
+	pg->mean = px ? b->sum / (px * (b->depth == 1 ? 1 : b->channels)) : 0xff;
+}
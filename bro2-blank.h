@@ -0,0 +1,66 @@
+#ifndef BRO2_BLANK_H_
+#define BRO2_BLANK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * What's on a page, worked out from the lines as they're handed out: the
+ * darkest and mean sample, how many pixels are darker than the paper (ink)
+ * and the box they fit in. Enough to drop blank pages and crop the rest
+ * without going over the image again.
+ *
+ * A pixel is ink if any of its samples is below the white level, or for
+ * 1 bit images if it's black. Lines are taken whole; one split across
+ * reads is put back together in a carry buffer first.
+ */
+
+/* samples at or above this are paper. The scanner's white is 0xfd-0xff,
+ * with some noise below it near the edges. */
+#define BRO2_BLANK_WHITE 0xe0
+
+/* ink pixels per million that still count as blank, for specks of dust */
+#define BRO2_BLANK_PPM 200
+
+struct bro2_blank {
+	size_t width, bpl;
+	unsigned channels, depth;	/* depth 0 when there are no pixels */
+	uint8_t white;
+
+	uint8_t *carry;		/* bpl bytes, not ours */
+	size_t carry_fill;
+
+	/* the page so far */
+	unsigned rows;
+	uint8_t min;
+	uint64_t sum;		/* of samples */
+	uint64_t ink;
+	long x0, y0, x1, y1;	/* box around the ink, y0 -1 while none */
+};
+
+struct bro2_blank_page {
+	bool blank;
+	int min, mean;
+	uint64_t ink;
+	int tl_x, tl_y, br_x, br_y;	/* inclusive, -1 if no ink */
+};
+
+/* Lines of @width pixels of @channels samples of @depth (1 or 8) bits. A
+ * depth of 0 leaves it looking at nothing (the page isn't in pixels).
+ * @carry is a line's worth of bytes that stay the caller's. */
+void bro2_blank_init(struct bro2_blank *b, size_t width, unsigned channels,
+		unsigned depth, uint8_t white, uint8_t *carry);
+
+/* Start over for the next page */
+void bro2_blank_reset(struct bro2_blank *b);
+
+/* The next @n bytes of the image */
+void bro2_blank_feed(struct bro2_blank *b, const uint8_t *p, size_t n);
+
+/* The page as seen so far, blank if at most @ppm in a million pixels are
+ * ink. Without pixels to go by nothing is blank and the box is unknown. */
+void bro2_blank_page(const struct bro2_blank *b, unsigned ppm,
+		struct bro2_blank_page *pg);
+
+#endif
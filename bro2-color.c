@@ -0,0 +1,234 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSSE3_KERNEL 1
+#define HAVE_AVX2_KERNEL 1
+#endif
+
+#include "bro2.h"
+#include "bro2-color.h"
+
+int bro2_color_plane(int type)
+{
+	switch (type) {
+	case BRO2_LINE_TYPE_RED:
+		return 0;
+	case BRO2_LINE_TYPE_GREEN:
+		return 1;
+	case BRO2_LINE_TYPE_BLUE:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+void bro2_color_init(struct bro2_color *c, size_t width, uint8_t *rows)
+{
+	*c = (typeof(*c)) {
+		.width = width,
+		.rows = rows,
+	};
+}
+
+void bro2_color_reset(struct bro2_color *c)
+{
+	bro2_color_init(c, c->width, c->rows);
+}
+
+static uint8_t *plane_ptr(struct bro2_color *c, unsigned line, int plane)
+{
+	return c->rows + ((line % BRO2_COLOR_WINDOW) * 3 + plane) * c->width;
+}
+
+uint8_t *bro2_color_dst(struct bro2_color *c, int plane, size_t *room)
+{
+	unsigned line = c->next[plane];
+	if (line - c->base >= BRO2_COLOR_WINDOW)
+		return NULL;
+
+	*room = c->width - c->fill[plane];
+	return plane_ptr(c, line, plane) + c->fill[plane];
+}
+
+void bro2_color_commit(struct bro2_color *c, int plane, size_t n)
+{
+	c->fill[plane] += n;
+	if (c->fill[plane] < c->width)
+		return;
+
+	c->have[c->next[plane] % BRO2_COLOR_WINDOW] |= 1 << plane;
+	c->next[plane]++;
+	c->fill[plane] = 0;
+}
+
+bool bro2_color_ready(const struct bro2_color *c)
+{
+	return c->have[c->base % BRO2_COLOR_WINDOW] == 7;
+}
+
+void bro2_color_emit(struct bro2_color *c, uint8_t *dst)
+{
+	unsigned line = c->base;
+	bro2_interleave_rgb(dst,
+			plane_ptr(c, line, 0),
+			plane_ptr(c, line, 1),
+			plane_ptr(c, line, 2),
+			c->width);
+	c->have[line % BRO2_COLOR_WINDOW] = 0;
+	c->base++;
+}
+
+static void interleave_scalar(uint8_t *dst, const uint8_t *r,
+		const uint8_t *g, const uint8_t *b, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		dst[3 * i + 0] = r[i];
+		dst[3 * i + 1] = g[i];
+		dst[3 * i + 2] = b[i];
+	}
+}
+
+#ifdef HAVE_SSSE3_KERNEL
+/* 16 pixels at a time: each of the 3 output vectors is the OR of one pshufb
+ * per plane, the masks put plane p's byte i at output byte 3 * i + p. */
+__attribute__((target("ssse3")))
+static void interleave_ssse3(uint8_t *dst, const uint8_t *r,
+		const uint8_t *g, const uint8_t *b, size_t n)
+{
+	const __m128i m0r = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+	const __m128i m0g = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+	const __m128i m0b = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+	const __m128i m1r = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+	const __m128i m1g = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+	const __m128i m1b = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+	const __m128i m2r = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+	const __m128i m2g = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+	const __m128i m2b = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i vr = _mm_loadu_si128((const __m128i *)(r + i));
+		__m128i vg = _mm_loadu_si128((const __m128i *)(g + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i o0 = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(vr, m0r),
+					_mm_shuffle_epi8(vg, m0g)),
+					_mm_shuffle_epi8(vb, m0b));
+		__m128i o1 = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(vr, m1r),
+					_mm_shuffle_epi8(vg, m1g)),
+					_mm_shuffle_epi8(vb, m1b));
+		__m128i o2 = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(vr, m2r),
+					_mm_shuffle_epi8(vg, m2g)),
+					_mm_shuffle_epi8(vb, m2b));
+		_mm_storeu_si128((__m128i *)(dst + 3 * i), o0);
+		_mm_storeu_si128((__m128i *)(dst + 3 * i + 16), o1);
+		_mm_storeu_si128((__m128i *)(dst + 3 * i + 32), o2);
+	}
+
+	interleave_scalar(dst + 3 * i, r + i, g + i, b + i, n - i);
+}
+#endif
+
+void bro2_interleave_rgb(uint8_t *dst, const uint8_t *r, const uint8_t *g,
+		const uint8_t *b, size_t n)
+{
+#ifdef HAVE_SSSE3_KERNEL
+	static int have_ssse3 = -1;
+	if (have_ssse3 < 0)
+		have_ssse3 = __builtin_cpu_supports("ssse3");
+	if (have_ssse3) {
+		interleave_ssse3(dst, r, g, b, n);
+		return;
+	}
+#endif
+	interleave_scalar(dst, r, g, b, n);
+}
+
+static uint32_t lut_entry(uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t e[4] = { r, g, b, 0 };
+	uint32_t v;
+	memcpy(&v, e, sizeof(v));
+	return v;
+}
+
+void bro2_palette_default(uint32_t lut[BRO2_PALETTE_SZ])
+{
+	unsigned i;
+	for (i = 0; i < BRO2_PALETTE_SZ; i++)
+		lut[i] = lut_entry((i >> 5) * 255 / 7,
+				((i >> 2) & 7) * 255 / 7,
+				(i & 3) * 255 / 3);
+}
+
+int bro2_palette_parse(uint32_t lut[BRO2_PALETTE_SZ], const uint8_t *p,
+		size_t len)
+{
+	size_t i;
+
+	if (!len || len % 3 || len > BRO2_PALETTE_SZ * 3)
+		return -1;
+
+	for (i = 0; i < len / 3; i++, p += 3)
+		lut[i] = lut_entry(p[0], p[1], p[2]);
+	return 0;
+}
+
+/* Each pixel's entry is stored whole, the next pixel overwrites its pad */
+static void expand_scalar(uint8_t *dst, const uint8_t *idx, size_t n,
+		const uint32_t *lut)
+{
+	size_t i;
+
+	if (!n)
+		return;
+	for (i = 0; i < n - 1; i++)
+		memcpy(dst + 3 * i, &lut[idx[i]], 4);
+	memcpy(dst + 3 * i, &lut[idx[i]], 3);
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/* 8 pixels at a time: gather their entries, squeeze out the pad bytes
+ * within each lane, then move the two lanes' 12 bytes together. Each store
+ * is 32 bytes for 24 of output, so stop while there's room for the rest. */
+__attribute__((target("avx2")))
+static void expand_avx2(uint8_t *dst, const uint8_t *idx, size_t n,
+		const uint32_t *lut)
+{
+	const __m256i pack = _mm256_setr_epi8(
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	size_t i;
+
+	for (i = 0; i + 11 <= n; i += 8) {
+		__m128i ix = _mm_loadl_epi64((const __m128i *)(idx + i));
+		__m256i v = _mm256_i32gather_epi32((const int *)lut,
+				_mm256_cvtepu8_epi32(ix), 4);
+		v = _mm256_shuffle_epi8(v, pack);
+		v = _mm256_permutevar8x32_epi32(v, join);
+		_mm256_storeu_si256((__m256i *)(dst + 3 * i), v);
+	}
+
+	expand_scalar(dst + 3 * i, idx + i, n - i, lut);
+}
+#endif
+
+void bro2_c256_expand(uint8_t *dst, const uint8_t *idx, size_t n,
+		const uint32_t lut[BRO2_PALETTE_SZ])
+{
+#ifdef HAVE_AVX2_KERNEL
+	static int have_avx2 = -1;
+	if (have_avx2 < 0)
+		have_avx2 = __builtin_cpu_supports("avx2");
+	if (have_avx2) {
+		expand_avx2(dst, idx, n, lut);
+		return;
+	}
+#endif
+	expand_scalar(dst, idx, n, lut);
+}
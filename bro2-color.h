@@ -0,0 +1,79 @@
+#ifndef BRO2_COLOR_H_
+#define BRO2_COLOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Assembles CGRAY scans, which arrive as one record per color plane per line
+ * (BRO2_LINE_TYPE_RED, _GREEN, _BLUE), into interleaved RGB lines.
+ *
+ * The n-th record of a plane belongs to line n. Planes are kept for a small
+ * window of lines so that a plane running ahead of the others (or records
+ * being reordered within a line) doesn't matter; a line is emitted once all
+ * 3 of its planes are complete.
+ */
+
+#define BRO2_COLOR_WINDOW 4
+
+/* bytes of line storage bro2_color_init() needs for @width pixels */
+#define BRO2_COLOR_ROWS_SZ(width) ((size_t)(width) * 3 * BRO2_COLOR_WINDOW)
+
+struct bro2_color {
+	size_t width;
+	uint8_t *rows;	/* BRO2_COLOR_WINDOW lines of 3 planes, not ours */
+
+	uint8_t have[BRO2_COLOR_WINDOW]; /* bitmask of complete planes */
+	unsigned base;	/* line held in the oldest slot */
+	unsigned next[3]; /* line the next record of each plane belongs to */
+	size_t fill[3];	/* bytes of that line's plane already received */
+};
+
+/* Assemble lines of @width pixels in @rows, BRO2_COLOR_ROWS_SZ(width) bytes
+ * that stay the caller's */
+void bro2_color_init(struct bro2_color *c, size_t width, uint8_t *rows);
+
+/* Forget any partial lines, for the next page */
+void bro2_color_reset(struct bro2_color *c);
+
+/* Plane index (0 = red) for a line type, -1 if it isn't a color plane */
+int bro2_color_plane(int type);
+
+/* Where the next bytes of @plane go. Returns NULL if that plane has run
+ * further ahead of the oldest incomplete line than the window allows. */
+uint8_t *bro2_color_dst(struct bro2_color *c, int plane, size_t *room);
+void bro2_color_commit(struct bro2_color *c, int plane, size_t n);
+
+/* The oldest line has all of its planes */
+bool bro2_color_ready(const struct bro2_color *c);
+
+/* Interleave the oldest line into @dst (width * 3 bytes) and retire it */
+void bro2_color_emit(struct bro2_color *c, uint8_t *dst);
+
+void bro2_interleave_rgb(uint8_t *dst, const uint8_t *r, const uint8_t *g,
+		const uint8_t *b, size_t n);
+
+/*
+ * C256 scans send a record of palette indices per line instead, expanded
+ * through the palette from a P request. Palette entries are kept as a LUT of
+ * 32 bit words holding red, green and blue (and a pad byte) in memory order,
+ * so a pixel is expanded with a single load and store.
+ */
+#define BRO2_PALETTE_SZ 256
+
+/* The palette to fall back on: 3-3-2 RGB, which has 0xff as white like the
+ * scanner does */
+void bro2_palette_default(uint32_t lut[BRO2_PALETTE_SZ]);
+
+/* The body of a P response: up to BRO2_PALETTE_SZ red, green, blue triples,
+ * or so we assume, it hasn't been seen from a scanner (see PROTO). Entries it
+ * doesn't cover are left alone. Returns -1 if it isn't that. */
+int bro2_palette_parse(uint32_t lut[BRO2_PALETTE_SZ], const uint8_t *p,
+		size_t len);
+
+/* Expand @n indices from @idx to RGB in @dst (n * 3 bytes) */
+void bro2_c256_expand(uint8_t *dst, const uint8_t *idx, size_t n,
+		const uint32_t lut[BRO2_PALETTE_SZ]);
+
+#endif
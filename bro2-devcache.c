@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bro2-devcache.h"
+
+int bro2_devcache_path(char *buf, size_t buf_sz)
+{
+	const char *env = getenv("BRO2_DEVICE_CACHE");
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int l;
+
+	if (env && *env)
+		l = snprintf(buf, buf_sz, "%s", env);
+	else if (xdg && *xdg)
+		l = snprintf(buf, buf_sz, "%s/sane-bro2.devices", xdg);
+	else if (home && *home)
+		l = snprintf(buf, buf_sz, "%s/.cache/sane-bro2.devices", home);
+	else
+		return -1;
+
+	if (l < 0 || (size_t)l >= buf_sz)
+		return -1;
+	return 0;
+}
+
+int bro2_devcache_open(struct bro2_devcache *c, const char *path)
+{
+	struct stat st;
+	const struct bro2_devcache_hdr *hdr;
+
+	*c = (typeof(*c)) { 0 };
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(hdr->magic, BRO2_DEVCACHE_MAGIC, sizeof(hdr->magic))
+			|| hdr->version != BRO2_DEVCACHE_VERSION
+			|| hdr->rec_size != sizeof(struct bro2_devcache_rec)
+			|| hdr->count > (st.st_size - sizeof(*hdr)) / hdr->rec_size) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	c->map = map;
+	c->map_len = st.st_size;
+	c->recs = (const void *)(hdr + 1);
+	c->count = hdr->count;
+	return 0;
+}
+
+void bro2_devcache_close(struct bro2_devcache *c)
+{
+	if (c->map)
+		munmap(c->map, c->map_len);
+	*c = (typeof(*c)) { 0 };
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int bro2_devcache_save(const char *path, const struct bro2_devcache_rec *recs,
+		size_t count)
+{
+	struct bro2_devcache_hdr hdr = {
+		.magic = BRO2_DEVCACHE_MAGIC,
+		.version = BRO2_DEVCACHE_VERSION,
+		.rec_size = sizeof(*recs),
+		.count = count,
+	};
+	char tmp[4096];
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >= (int)sizeof(tmp))
+		return -1;
+
+	/* ~/.cache may not exist yet */
+	char *slash = strrchr(tmp, '/');
+	if (slash) {
+		*slash = '\0';
+		mkdir(tmp, 0700);
+		*slash = '/';
+	}
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	int r = write_all(fd, &hdr, sizeof(hdr));
+	if (!r)
+		r = write_all(fd, recs, sizeof(*recs) * count);
+	if (close(fd))
+		r = -1;
+	if (r) {
+		unlink(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
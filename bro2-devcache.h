@@ -0,0 +1,55 @@
+#ifndef BRO2_DEVCACHE_H_
+#define BRO2_DEVCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On disk cache of discovered scanners, so a freshly started frontend can
+ * list devices before a network probe completes.
+ *
+ * The file is a header followed by an array of fixed size records, all in host
+ * byte order, so it can be mapped and used in place.
+ */
+
+#define BRO2_DEVCACHE_MAGIC   "BRO2DEV"
+#define BRO2_DEVCACHE_VERSION 1
+
+struct bro2_devcache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct bro2_devcache_rec {
+	int64_t seen;		/* time() of the last response */
+	uint8_t mac[6];
+	uint8_t have_mac;
+	uint8_t reserved;
+	char host[128];
+	char model[128];
+	char sys_name[64];
+};
+
+struct bro2_devcache {
+	void *map;
+	size_t map_len;
+	const struct bro2_devcache_rec *recs;
+	size_t count;
+};
+
+/* Default location: $BRO2_DEVICE_CACHE, else under $XDG_CACHE_HOME or
+ * ~/.cache. Returns 0, or -1 if no location could be determined. */
+int bro2_devcache_path(char *buf, size_t buf_sz);
+
+/* Map the cache at @path. Returns 0, or -1 if it is missing or invalid. */
+int bro2_devcache_open(struct bro2_devcache *c, const char *path);
+void bro2_devcache_close(struct bro2_devcache *c);
+
+/* Atomically replace the cache at @path with @recs */
+int bro2_devcache_save(const char *path, const struct bro2_devcache_rec *recs,
+		size_t count);
+
+#endif
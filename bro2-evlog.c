@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bro2-evlog.h"
+
+int bro2_evlog_init(struct bro2_evlog *l, size_t ct)
+{
+	size_t sz = 1;
+
+	*l = (typeof(*l)) { 0 };
+	if (!ct)
+		return 0;
+
+	while (sz < ct)
+		sz <<= 1;
+
+	l->ev = calloc(sz, sizeof(*l->ev));
+	if (!l->ev)
+		return -1;
+	l->mask = sz - 1;
+	return 0;
+}
+
+void bro2_evlog_free(struct bro2_evlog *l)
+{
+	free(l->ev);
+	l->ev = NULL;
+}
+
+void bro2_evlog_add_(struct bro2_evlog *l, int kind, int type, uint32_t len,
+		uint32_t arg)
+{
+	uint64_t n = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	struct bro2_evlog_ev *e = &l->ev[n & l->mask];
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->t_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	e->len = len;
+	e->arg = arg;
+	e->kind = kind;
+	e->type = type;
+	__atomic_store_n(&e->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+static const char *const kind_names[] = {
+	[BRO2_EV_RECV] = "recv",
+	[BRO2_EV_RECV_DIRECT] = "recv-direct",
+	[BRO2_EV_WOULDBLOCK] = "wouldblock",
+	[BRO2_EV_ERROR] = "error",
+	[BRO2_EV_RECORD] = "record",
+	[BRO2_EV_DROP] = "drop",
+	[BRO2_EV_PAGE_END] = "page-end",
+	[BRO2_EV_READ] = "read",
+};
+
+/* snprintf() isn't async signal safe */
+static char *put_str(char *p, const char *s, size_t max)
+{
+	while (*s && max--)
+		*p++ = *s++;
+	return p;
+}
+
+static char *put_num(char *p, uint64_t v, unsigned base, unsigned width)
+{
+	char tmp[20];
+	unsigned n = 0;
+
+	do {
+		tmp[n++] = "0123456789abcdef"[v % base];
+		v /= base;
+	} while (v);
+	while (n < width--)
+		*p++ = '0';
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return;
+		buf += r;
+		len -= r;
+	}
+}
+
+void bro2_evlog_dump(struct bro2_evlog *l, const char *tag, int fd)
+{
+	uint64_t end, n;
+	int saved = errno;
+
+	if (!l->ev)
+		return;
+
+	end = __atomic_load_n(&l->next, __ATOMIC_ACQUIRE);
+	n = end > l->mask + 1 ? end - (l->mask + 1) : 0;
+	for (; n < end; n++) {
+		const struct bro2_evlog_ev *e = &l->ev[n & l->mask];
+		struct bro2_evlog_ev c;
+		char line[160], *p = line;
+
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != n + 1)
+			continue;
+		memcpy(&c, e, sizeof(c));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != n + 1)
+			continue;
+
+		p = put_str(p, tag, 64);
+		*p++ = ' ';
+		p = put_num(p, c.t_ns / 1000000000, 10, 1);
+		*p++ = '.';
+		p = put_num(p, c.t_ns % 1000000000 / 1000, 10, 6);
+		*p++ = ' ';
+		p = put_str(p, c.kind < sizeof(kind_names) / sizeof(kind_names[0])
+				&& kind_names[c.kind] ? kind_names[c.kind] : "?", 16);
+		p = put_str(p, " type=0x", 8);
+		p = put_num(p, c.type, 16, 2);
+		p = put_str(p, " len=", 8);
+		p = put_num(p, c.len, 10, 1);
+		p = put_str(p, " arg=", 8);
+		p = put_num(p, c.arg, 10, 1);
+		*p++ = '\n';
+		write_all(fd, line, p - line);
+	}
+
+	errno = saved;
+}
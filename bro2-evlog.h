@@ -0,0 +1,63 @@
+#ifndef BRO2_EVLOG_H_
+#define BRO2_EVLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A trace of what a device's data path did: a ring of fixed size binary
+ * events, kept per device and cheap enough to always be compiled in. While
+ * disabled logging an event is a single branch.
+ *
+ * Slots are claimed with an atomic increment and nothing takes a lock, so
+ * any thread may log and the ring can be dumped from a signal handler in the
+ * middle of a scan. Each slot's sequence number is written last, which lets
+ * the dump skip an event that is being overwritten.
+ */
+
+enum bro2_evlog_kind {
+	BRO2_EV_RECV,		/* into the frame ring: len received, arg room,
+				   type the record in flight (0xff for none) */
+	BRO2_EV_RECV_DIRECT,	/* into the destination: len received, arg room */
+	BRO2_EV_WOULDBLOCK,	/* nothing to receive: arg bytes handed out so far */
+	BRO2_EV_ERROR,		/* receive failed: arg errno, 0 if disconnected */
+	BRO2_EV_RECORD,		/* header parsed: type, len, arg 1 if RLE */
+	BRO2_EV_DROP,		/* record skipped: type, len */
+	BRO2_EV_PAGE_END,	/* type: the terminator */
+	BRO2_EV_READ,		/* sane_read() returned: type status, len, arg maxlen */
+};
+
+struct bro2_evlog_ev {
+	uint64_t seq;		/* index + 1 once complete, 0 while written */
+	uint64_t t_ns;		/* CLOCK_MONOTONIC */
+	uint32_t len, arg;
+	uint8_t kind, type;
+};
+
+struct bro2_evlog {
+	struct bro2_evlog_ev *ev;	/* NULL when disabled */
+	size_t mask;
+	uint64_t next;			/* slots claimed, free running */
+};
+
+/* Room for @ct events (rounded up to a power of 2), 0 leaves it disabled.
+ * Returns -1 if out of memory. */
+int bro2_evlog_init(struct bro2_evlog *l, size_t ct);
+void bro2_evlog_free(struct bro2_evlog *l);
+
+void bro2_evlog_add_(struct bro2_evlog *l, int kind, int type, uint32_t len,
+		uint32_t arg);
+
+static inline void bro2_evlog_add(struct bro2_evlog *l, int kind, int type,
+		uint32_t len, uint32_t arg)
+{
+	if (__builtin_expect(!l->ev, 1))
+		return;
+	bro2_evlog_add_(l, kind, type, len, arg);
+}
+
+/* Write the events still in the ring to @fd as text, oldest first, each line
+ * prefixed with @tag. Only async signal safe calls are made. */
+void bro2_evlog_dump(struct bro2_evlog *l, const char *tag, int fd);
+
+#endif
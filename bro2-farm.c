@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include <sane/sane.h>
+#include <sane/saneopts.h>
+#include <jpeglib.h>
+
+#include "bro2-farm.h"
+
+/* a finished page, waiting for a worker */
+struct farm_page {
+	struct farm_page *next;
+	const char *tag;
+	unsigned seq;
+	SANE_Parameters p;
+	uint8_t *data;
+	size_t len, sz;
+};
+
+struct farm_dev {
+	ev_io io;	/* on the select fd while scanning */
+	ev_timer timer;	/* to (re)start scanning */
+	ev_async started;	/* the starter is through */
+	struct ev_loop *loop;
+	const struct bro2_farm_opts *o;
+	const char *name;
+	char tag[64];	/* @name, safe for a file name */
+
+	SANE_Handle h;
+	bool open;
+	unsigned seq;
+	struct farm_page *page;	/* being filled */
+
+	/* sane_open() and sane_start() wait on the scanner, so they're done
+	 * by a thread of their own while the loop gets on with the others */
+	pthread_t starter;
+	bool starting;
+	SANE_Status start_status;
+	SANE_Int fd;
+	SANE_Parameters p;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct farm_page *head, **tail;
+	bool stop;
+	pthread_t *threads;
+	unsigned thread_ct;
+	const struct bro2_farm_opts *o;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static time_t farm_epoch;
+
+static void page_free(struct farm_page *pg)
+{
+	if (!pg)
+		return;
+	free(pg->data);
+	free(pg);
+}
+
+static int write_pnm(FILE *f, const struct farm_page *pg, size_t lines)
+{
+	const SANE_Parameters *p = &pg->p;
+	char kind = p->depth == 1 ? '4'
+		: p->format == SANE_FRAME_RGB ? '6' : '5';
+
+	fprintf(f, "P%c\n%d %zu\n", kind, p->pixels_per_line, lines);
+	if (p->depth != 1)
+		fprintf(f, "%d\n", (1 << p->depth) - 1);
+	return fwrite(pg->data, p->bytes_per_line, lines, f) == lines ? 0 : -1;
+}
+
+/* libjpeg's own error_exit would exit() the whole farm */
+struct jpeg_err {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+static void jpeg_err_exit(j_common_ptr cinfo)
+{
+	struct jpeg_err *e = (struct jpeg_err *)cinfo->err;
+	cinfo->err->output_message(cinfo);
+	longjmp(e->jmp, 1);
+}
+
+static int write_jpeg(FILE *f, const struct farm_page *pg, size_t lines)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_err jerr;
+	const SANE_Parameters *p = &pg->p;
+	size_t i;
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = jpeg_err_exit;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_compress(&cinfo);
+		return -1;
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, f);
+
+	cinfo.image_width = p->pixels_per_line;
+	cinfo.image_height = lines;
+	cinfo.input_components = p->format == SANE_FRAME_RGB ? 3 : 1;
+	cinfo.in_color_space = p->format == SANE_FRAME_RGB ? JCS_RGB : JCS_GRAYSCALE;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, pool.o->quality, TRUE);
+
+	jpeg_start_compress(&cinfo, TRUE);
+	for (i = 0; i < lines; i++) {
+		JSAMPROW row = pg->data + i * p->bytes_per_line;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return 0;
+}
+
+/* Write to a hidden temporary and rename it into place, so whatever picks
+ * pages up from the directory never sees half of one */
+static void page_write(struct farm_page *pg)
+{
+	const struct bro2_farm_opts *o = pool.o;
+	bool jpeg = o->quality > 0 && pg->p.depth == 8;
+	size_t lines = pg->p.bytes_per_line ? pg->len / pg->p.bytes_per_line : 0;
+	char tmp[4096], path[4096];
+	int r;
+
+	if (!lines) {
+		fprintf(stderr, "%s: page %u is empty, dropping it\n", pg->tag, pg->seq);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s-%lld-%04u.%s", o->out_dir, pg->tag,
+			(long long)farm_epoch, pg->seq, jpeg ? "jpg" : "pnm");
+	snprintf(tmp, sizeof(tmp), "%s/.%s-%lld-%04u.tmp", o->out_dir, pg->tag,
+			(long long)farm_epoch, pg->seq);
+
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		fprintf(stderr, "could not create %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	r = jpeg ? write_jpeg(f, pg, lines) : write_pnm(f, pg, lines);
+	if (fclose(f) || r) {
+		fprintf(stderr, "could not write %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, path)) {
+		fprintf(stderr, "could not rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	fprintf(stderr, "%s: wrote %s\n", pg->tag, path);
+}
+
+static void *worker(void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.head && !pool.stop)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+
+		struct farm_page *pg = pool.head;
+		if (!pg) {
+			/* stopping, and nothing left to write */
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+
+		pool.head = pg->next;
+		if (!pool.head)
+			pool.tail = &pool.head;
+		pthread_mutex_unlock(&pool.lock);
+
+		page_write(pg);
+		page_free(pg);
+	}
+}
+
+static void pool_push(struct farm_page *pg)
+{
+	pg->next = NULL;
+	pthread_mutex_lock(&pool.lock);
+	*pool.tail = pg;
+	pool.tail = &pg->next;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static int pool_start(const struct bro2_farm_opts *o)
+{
+	unsigned i;
+
+	pool.o = o;
+	pool.head = NULL;
+	pool.tail = &pool.head;
+	pool.stop = false;
+	pool.threads = calloc(o->workers, sizeof(*pool.threads));
+	if (!pool.threads)
+		return -1;
+
+	for (i = 0; i < o->workers; i++) {
+		if (pthread_create(&pool.threads[i], NULL, worker, NULL))
+			break;
+	}
+
+	pool.thread_ct = i;
+	return i ? 0 : -1;
+}
+
+/* Let the workers finish what is queued, then wait for them */
+static void pool_stop(void)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.thread_ct; i++)
+		pthread_join(pool.threads[i], NULL);
+	free(pool.threads);
+}
+
+static SANE_Int find_option(SANE_Handle h, const char *name)
+{
+	const SANE_Option_Descriptor *d;
+	SANE_Int i;
+
+	for (i = 1; (d = sane_get_option_descriptor(h, i)); i++)
+		if (d->name && !strcmp(d->name, name))
+			return i;
+	return -1;
+}
+
+static void set_int_option(struct farm_dev *d, const char *name, SANE_Int v)
+{
+	SANE_Int n = find_option(d->h, name);
+	if (n != -1)
+		sane_control_option(d->h, n, SANE_ACTION_SET_VALUE, &v, NULL);
+}
+
+static void dev_configure(struct farm_dev *d)
+{
+	const struct bro2_farm_opts *o = d->o;
+
+	if (o->mode) {
+		SANE_Int n = find_option(d->h, SANE_NAME_SCAN_MODE);
+		if (n != -1)
+			sane_control_option(d->h, n, SANE_ACTION_SET_VALUE,
+					(void *)o->mode, NULL);
+	}
+
+	if (o->resolution) {
+		set_int_option(d, SANE_NAME_SCAN_RESOLUTION, o->resolution);
+		set_int_option(d, SANE_NAME_SCAN_X_RESOLUTION, o->resolution);
+		set_int_option(d, SANE_NAME_SCAN_Y_RESOLUTION, o->resolution);
+	}
+}
+
+static void dev_later(struct ev_loop *loop, struct farm_dev *d, double secs)
+{
+	ev_io_stop(loop, &d->io);
+	ev_timer_stop(loop, &d->timer);
+	ev_timer_set(&d->timer, secs, 0);
+	ev_timer_start(loop, &d->timer);
+}
+
+/* Something went wrong: drop the page and the connection and try again once
+ * the scanner has had some time */
+static void dev_fail(struct ev_loop *loop, struct farm_dev *d, SANE_Status s)
+{
+	fprintf(stderr, "%s: %s\n", d->name, sane_strstatus(s));
+	page_free(d->page);
+	d->page = NULL;
+	sane_cancel(d->h);
+	dev_later(loop, d, d->o->idle_secs);
+}
+
+static int page_append(struct farm_page *pg, const void *buf, size_t len)
+{
+	if (pg->len + len > pg->sz) {
+		size_t sz = pg->sz ? pg->sz : 1 << 20;
+		while (sz < pg->len + len)
+			sz *= 2;
+		uint8_t *data = realloc(pg->data, sz);
+		if (!data)
+			return -1;
+		pg->data = data;
+		pg->sz = sz;
+	}
+
+	memcpy(pg->data + pg->len, buf, len);
+	pg->len += len;
+	return 0;
+}
+
+/* Pull in whatever the backend can give us without waiting */
+static void dev_read(struct ev_loop *loop, struct farm_dev *d)
+{
+	static SANE_Byte buf[1 << 16];
+	SANE_Status s;
+	SANE_Int len;
+
+	for (;;) {
+		s = sane_read(d->h, buf, sizeof(buf), &len);
+		if (s != SANE_STATUS_GOOD)
+			break;
+		if (!len)
+			return;
+		if (page_append(d->page, buf, len)) {
+			dev_fail(loop, d, SANE_STATUS_NO_MEM);
+			return;
+		}
+	}
+
+	switch (s) {
+	case SANE_STATUS_EOF:
+		pool_push(d->page);
+		d->page = NULL;
+		/* straight on to the next page of the batch, from the loop
+		 * so one busy scanner can't hold up the others */
+		dev_later(loop, d, 0);
+		break;
+	case SANE_STATUS_NO_DOCS:
+		page_free(d->page);
+		d->page = NULL;
+		sane_cancel(d->h);
+		dev_later(loop, d, d->o->idle_secs);
+		break;
+	default:
+		dev_fail(loop, d, s);
+		break;
+	}
+}
+
+/* Everything up to the first sane_read(), on the starter thread */
+static void *dev_starter(void *arg)
+{
+	struct farm_dev *d = arg;
+	SANE_Status s;
+
+	if (!d->open) {
+		s = sane_open(d->name, &d->h);
+		if (s) {
+			fprintf(stderr, "%s: open: %s\n", d->name, sane_strstatus(s));
+			d->start_status = s;
+			goto out;
+		}
+		d->open = true;
+		dev_configure(d);
+	}
+
+	s = sane_start(d->h);
+	if (!s && (sane_set_io_mode(d->h, SANE_TRUE)
+			|| sane_get_select_fd(d->h, &d->fd))) {
+		fprintf(stderr, "%s: backend can't do non-blocking I/O\n", d->name);
+		s = SANE_STATUS_UNSUPPORTED;
+	}
+	if (!s)
+		s = sane_get_parameters(d->h, &d->p);
+	d->start_status = s;
+
+out:
+	ev_async_send(d->loop, &d->started);
+	return NULL;
+}
+
+static void dev_start(struct ev_loop *loop, struct farm_dev *d)
+{
+	if (pthread_create(&d->starter, NULL, dev_starter, d)) {
+		fprintf(stderr, "%s: can't start a thread\n", d->name);
+		dev_later(loop, d, d->o->idle_secs);
+		return;
+	}
+	d->starting = true;
+}
+
+static void dev_started(struct ev_loop *loop, struct farm_dev *d)
+{
+	SANE_Status s;
+
+	pthread_join(d->starter, NULL);
+	d->starting = false;
+	s = d->start_status;
+
+	if (!d->open) {
+		dev_later(loop, d, d->o->idle_secs);
+		return;
+	} else if (s == SANE_STATUS_NO_DOCS) {
+		sane_cancel(d->h);
+		dev_later(loop, d, d->o->idle_secs);
+		return;
+	} else if (s) {
+		dev_fail(loop, d, s);
+		return;
+	}
+
+	d->page = calloc(1, sizeof(*d->page));
+	if (!d->page) {
+		dev_fail(loop, d, SANE_STATUS_NO_MEM);
+		return;
+	}
+	d->page->tag = d->tag;
+	d->page->seq = d->seq++;
+	d->page->p = d->p;
+
+	ev_io_stop(loop, &d->io);
+	ev_io_set(&d->io, d->fd, EV_READ);
+	ev_io_start(loop, &d->io);
+
+	/* some may already be buffered, don't wait to be told */
+	dev_read(loop, d);
+}
+
+static void dev_io_cb(EV_P_ ev_io *w, int revents)
+{
+	struct farm_dev *d = (struct farm_dev *)w;
+	dev_read(EV_A_ d);
+}
+
+static void dev_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct farm_dev *d = (struct farm_dev *)((char *)w - offsetof(struct farm_dev, timer));
+	dev_start(EV_A_ d);
+}
+
+static void dev_started_cb(EV_P_ ev_async *w, int revents)
+{
+	struct farm_dev *d = (struct farm_dev *)((char *)w - offsetof(struct farm_dev, started));
+	dev_started(EV_A_ d);
+}
+
+static void stop_cb(EV_P_ ev_signal *w, int revents)
+{
+	fprintf(stderr, "stopping\n");
+	ev_break(EV_A_ EVBREAK_ALL);
+}
+
+int bro2_farm_run(struct ev_loop *loop, const struct bro2_farm_opts *o)
+{
+	struct farm_dev *devs;
+	ev_signal sig_int, sig_term;
+	SANE_Int ver;
+	size_t i, j;
+
+	farm_epoch = time(NULL);
+
+	devs = calloc(o->scanner_ct, sizeof(*devs));
+	if (!devs)
+		return -1;
+
+	if (sane_init(&ver, NULL)) {
+		fprintf(stderr, "sane_init failed\n");
+		free(devs);
+		return -1;
+	}
+
+	if (pool_start(o)) {
+		fprintf(stderr, "could not start workers\n");
+		sane_exit();
+		free(devs);
+		return -1;
+	}
+
+	for (i = 0; i < o->scanner_ct; i++) {
+		struct farm_dev *d = &devs[i];
+		d->o = o;
+		d->name = o->scanners[i];
+		for (j = 0; d->name[j] && j < sizeof(d->tag) - 1; j++)
+			d->tag[j] = isalnum((unsigned char)d->name[j]) ? d->name[j] : '_';
+
+		d->loop = loop;
+		ev_init(&d->io, dev_io_cb);
+		ev_init(&d->timer, dev_timer_cb);
+		ev_async_init(&d->started, dev_started_cb);
+		ev_async_start(loop, &d->started);
+		/* spread out the initial connections a bit */
+		dev_later(loop, d, i * 0.05);
+	}
+
+	ev_signal_init(&sig_int, stop_cb, SIGINT);
+	ev_signal_init(&sig_term, stop_cb, SIGTERM);
+	ev_signal_start(loop, &sig_int);
+	ev_signal_start(loop, &sig_term);
+
+	ev_run(loop, 0);
+
+	for (i = 0; i < o->scanner_ct; i++) {
+		struct farm_dev *d = &devs[i];
+		ev_io_stop(loop, &d->io);
+		ev_timer_stop(loop, &d->timer);
+		ev_async_stop(loop, &d->started);
+		/* it's at most as long as a connect takes */
+		if (d->starting)
+			pthread_join(d->starter, NULL);
+		page_free(d->page);
+		if (d->open) {
+			sane_cancel(d->h);
+			sane_close(d->h);
+		}
+	}
+
+	ev_signal_stop(loop, &sig_int);
+	ev_signal_stop(loop, &sig_term);
+
+	pool_stop();
+	sane_exit();
+	free(devs);
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef BRO2_FARM_H_
+#define BRO2_FARM_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <ev.h>
+
+/*
+ * Scan farm: the client side of the protocol, driving many scanners from a
+ * single libev loop.
+ *
+ * Each scanner is opened through SANE and put in non-blocking mode, so its
+ * framing and decoding run as the backend's state machine whenever its
+ * select fd is ready. Opening and starting, which wait on the scanner, are
+ * done on a thread per scanner that hands back to the loop when through.
+ * Lines are collected into a page, and completed pages are handed to a pool
+ * of worker threads which compress and write them out.
+ */
+
+struct bro2_farm_opts {
+	const char **scanners;	/* SANE device names */
+	size_t scanner_ct;
+
+	const char *out_dir;
+	unsigned workers;
+	int quality;		/* JPEG quality, 0 writes PNM */
+	double idle_secs;	/* wait after the feeder empties or an error */
+
+	/* applied to every scanner when set */
+	const char *mode;
+	int resolution;
+};
+
+int bro2_farm_run(struct ev_loop *loop, const struct bro2_farm_opts *o);
+
+#endif
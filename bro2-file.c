@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "bro2-file.h"
+
+/* TIFF field types */
+#define TIFF_SHORT	3
+#define TIFF_LONG	4
+#define TIFF_RATIONAL	5
+
+#define TIFF_ENTRIES	12
+/* the IFD, then the 2 resolutions it points at */
+#define TIFF_IFD_SZ	(2 + TIFF_ENTRIES * 12 + 4 + 2 * 8)
+
+void bro2_file_init(struct bro2_file *f)
+{
+	*f = (typeof(*f)) { .fd = -1 };
+}
+
+void bro2_file_free(struct bro2_file *f)
+{
+	bro2_file_abort(f);
+	free(f->buf);
+	free(f->line);
+	free(f->ref);
+	bro2_file_init(f);
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t r = pwrite(fd, p, len, off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		off += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int flush(struct bro2_file *f)
+{
+	if (write_all(f->fd, f->buf, f->len, f->off))
+		return -1;
+	f->off += f->len;
+	f->len = 0;
+	return 0;
+}
+
+/* Make sure there's room for @n more bytes in buf */
+static int reserve(struct bro2_file *f, size_t n)
+{
+	return f->buf_sz - f->len < n ? flush(f) : 0;
+}
+
+/* The height is padded, so the header is the same size before it's known */
+static int pnm_header(const struct bro2_file *f, char *hdr, size_t sz,
+		unsigned lines)
+{
+	return snprintf(hdr, sz, "P%c\n%u %10u\n%s",
+			f->depth == 1 ? '4' : f->channels == 3 ? '6' : '5',
+			f->width, lines, f->depth == 1 ? "" : "255\n");
+}
+
+/* Grow *@p to @sz bytes, keeping nothing */
+static int grow(uint8_t **p, size_t *have, size_t sz)
+{
+	if (*have >= sz)
+		return 0;
+	free(*p);
+	*p = malloc(sz);
+	if (!*p) {
+		*have = 0;
+		return -1;
+	}
+	*have = sz;
+	return 0;
+}
+
+int bro2_file_begin(struct bro2_file *f, const char *path, int kind,
+		unsigned width, unsigned channels, unsigned depth,
+		unsigned x_res, unsigned y_res)
+{
+	size_t buf_sz = BRO2_FILE_BUF_SZ;
+	char hdr[64];
+
+	bro2_file_abort(f);
+	f->kind = kind;
+	f->width = width;
+	f->channels = channels;
+	f->depth = depth;
+	f->x_res = x_res;
+	f->y_res = y_res;
+	f->bpl = ((size_t)width * channels * depth + 7) / 8;
+	f->len = f->line_fill = 0;
+	f->off = 0;
+	f->bytes = 0;
+
+	if (kind == BRO2_FILE_TIFF) {
+		size_t line_sz = f->line_sz;
+		if (buf_sz < 2 * BRO2_G4_LINE_MAX(width))
+			buf_sz = 2 * BRO2_G4_LINE_MAX(width);
+		if (grow(&f->line, &f->line_sz, f->bpl)
+				|| grow(&f->ref, &line_sz, f->bpl))
+			return -1;
+		bro2_g4_init(&f->g4, width, f->ref);
+	}
+
+	if (f->buf_sz < buf_sz) {
+		free(f->buf);
+		f->buf_sz = 0;
+		if (posix_memalign((void **)&f->buf, 4096, buf_sz)) {
+			f->buf = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
+		f->buf_sz = buf_sz;
+	}
+
+	f->path = strdup(path);
+	if (!f->path)
+		return -1;
+	f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (f->fd == -1) {
+		free(f->path);
+		f->path = NULL;
+		return -1;
+	}
+
+	/* room for the header, written at the end */
+	if (kind == BRO2_FILE_PNM)
+		f->len = pnm_header(f, hdr, sizeof(hdr), 0);
+	else if (kind == BRO2_FILE_TIFF)
+		f->len = 8;
+	memset(f->buf, 0, f->len);
+	return 0;
+}
+
+size_t bro2_file_space(struct bro2_file *f, uint8_t **dst)
+{
+	if (f->kind == BRO2_FILE_TIFF) {
+		*dst = f->line + f->line_fill;
+		return f->bpl - f->line_fill;
+	}
+
+	*dst = f->buf + f->len;
+	return f->buf_sz - f->len;
+}
+
+int bro2_file_commit(struct bro2_file *f, size_t n)
+{
+	f->bytes += n;
+	if (f->kind != BRO2_FILE_TIFF) {
+		f->len += n;
+		return f->len == f->buf_sz ? flush(f) : 0;
+	}
+
+	f->line_fill += n;
+	if (f->line_fill < f->bpl)
+		return 0;
+	if (reserve(f, BRO2_G4_LINE_MAX(f->width)))
+		return -1;
+	f->len += bro2_g4_line(&f->g4, f->line, f->buf + f->len);
+	f->line_fill = 0;
+	return 0;
+}
+
+static void put16(uint8_t *p, unsigned v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+/* Append the IFD for a single strip of G4 data from offset 8 to here, and
+ * fill in the header */
+static int tiff_end(struct bro2_file *f, unsigned lines)
+{
+	static const struct { uint16_t tag, type; } ent[TIFF_ENTRIES] = {
+		{ 256, TIFF_LONG },	/* ImageWidth */
+		{ 257, TIFF_LONG },	/* ImageLength */
+		{ 258, TIFF_SHORT },	/* BitsPerSample */
+		{ 259, TIFF_SHORT },	/* Compression */
+		{ 262, TIFF_SHORT },	/* PhotometricInterpretation */
+		{ 273, TIFF_LONG },	/* StripOffsets */
+		{ 277, TIFF_SHORT },	/* SamplesPerPixel */
+		{ 278, TIFF_LONG },	/* RowsPerStrip */
+		{ 279, TIFF_LONG },	/* StripByteCounts */
+		{ 282, TIFF_RATIONAL },	/* XResolution */
+		{ 283, TIFF_RATIONAL },	/* YResolution */
+		{ 296, TIFF_SHORT },	/* ResolutionUnit */
+	};
+	uint8_t hdr[8] = { 'I', 'I', 42, 0 };
+	uint32_t ifd, strip, res;
+	unsigned i;
+
+	if (reserve(f, BRO2_G4_LINE_MAX(f->width)))
+		return -1;
+	f->len += bro2_g4_end(&f->g4, f->buf + f->len);
+	strip = f->off + f->len - 8;
+
+	/* the IFD starts on a word */
+	if (reserve(f, TIFF_IFD_SZ + 1))
+		return -1;
+	if ((f->off + f->len) & 1)
+		f->buf[f->len++] = 0;
+	ifd = f->off + f->len;
+	res = ifd + 2 + TIFF_ENTRIES * 12 + 4;
+
+	const uint32_t val[TIFF_ENTRIES] = {
+		f->width, lines, 1,
+		4,		/* T.6 */
+		0,		/* WhiteIsZero: a set bit is black */
+		8, 1, lines, strip, res, res + 8,
+		2,		/* inch */
+	};
+	uint8_t *p = f->buf + f->len;
+	put16(p, TIFF_ENTRIES);
+	p += 2;
+	for (i = 0; i < TIFF_ENTRIES; i++, p += 12) {
+		put16(p, ent[i].tag);
+		put16(p + 2, ent[i].type);
+		put32(p + 4, 1);
+		put32(p + 8, val[i]);
+	}
+	put32(p, 0);		/* no next IFD */
+	put32(p + 4, f->x_res);
+	put32(p + 8, 1);
+	put32(p + 12, f->y_res);
+	put32(p + 16, 1);
+	f->len += TIFF_IFD_SZ;
+
+	put32(hdr + 4, ifd);
+	if (flush(f))
+		return -1;
+	return write_all(f->fd, hdr, sizeof(hdr), 0);
+}
+
+int bro2_file_end(struct bro2_file *f)
+{
+	unsigned lines = f->bpl ? (f->bytes + f->bpl - 1) / f->bpl : 0;
+	char hdr[64];
+	int r = 0;
+
+	if (f->fd == -1)
+		return 0;
+
+	/* a line cut short is finished in white: 0xff for gray and RGB,
+	 * a clear bit for 1 bit, where a set one is black */
+	while (f->kind != BRO2_FILE_RAW && f->bpl && f->bytes % f->bpl && !r) {
+		uint8_t *dst;
+		size_t n = bro2_file_space(f, &dst);
+		if (n > f->bpl - f->bytes % f->bpl)
+			n = f->bpl - f->bytes % f->bpl;
+		memset(dst, f->depth == 8 ? 0xff : 0, n);
+		r = bro2_file_commit(f, n);
+	}
+
+	if (!r && f->kind == BRO2_FILE_TIFF)
+		r = tiff_end(f, lines);
+	else if (!r && !(r = flush(f)) && f->kind == BRO2_FILE_PNM)
+		r = write_all(f->fd, (uint8_t *)hdr,
+				pnm_header(f, hdr, sizeof(hdr), lines), 0);
+
+	if (!r) {
+		r = close(f->fd);
+		f->fd = -1;
+	}
+	if (r) {
+		int e = errno;
+		if (f->fd != -1)
+			close(f->fd);
+		unlink(f->path);
+		f->fd = -1;
+		errno = e;
+	}
+	free(f->path);
+	f->path = NULL;
+	return r;
+}
+
+void bro2_file_abort(struct bro2_file *f)
+{
+	if (f->fd == -1)
+		return;
+	close(f->fd);
+	unlink(f->path);
+	free(f->path);
+	f->path = NULL;
+	f->fd = -1;
+}
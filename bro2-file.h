@@ -0,0 +1,71 @@
+#ifndef BRO2_FILE_H_
+#define BRO2_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bro2-g4.h"
+
+/*
+ * Writes pages to files, for scanning straight to disk without the frontend
+ * in the way: PNM for gray and RGB, a CCITT G4 compressed TIFF for 1-bit,
+ * or the bytes as they are (a JPEG passed through).
+ *
+ * The caller decodes straight into the space the writer hands out. Output
+ * is gathered into a large page aligned buffer and written out whole, and
+ * the header (which needs the number of lines) is written last.
+ */
+
+enum {
+	BRO2_FILE_RAW,
+	BRO2_FILE_PNM,
+	BRO2_FILE_TIFF,
+};
+
+/* written in pieces of this much */
+#define BRO2_FILE_BUF_SZ (1 << 20)
+
+struct bro2_file {
+	int fd;			/* -1 while no page is being written */
+	char *path;
+	int kind;
+	unsigned width, channels, depth;
+	unsigned x_res, y_res;
+	size_t bpl;		/* bytes in a line */
+
+	uint8_t *buf;		/* at least BRO2_FILE_BUF_SZ */
+	size_t buf_sz, len;
+	off_t off;		/* where buf goes in the file */
+	uint64_t bytes;		/* image bytes taken */
+
+	/* BRO2_FILE_TIFF: a line being gathered, and its encoder */
+	uint8_t *line, *ref;
+	size_t line_sz, line_fill;
+	struct bro2_g4 g4;
+};
+
+void bro2_file_init(struct bro2_file *f);
+void bro2_file_free(struct bro2_file *f);
+
+/* Create @path (replacing it) for a page of @width pixel lines, with
+ * @channels of @depth bits each, and its resolution. @kind is
+ * BRO2_FILE_RAW for bytes that aren't lines. Returns -1 with errno set. */
+int bro2_file_begin(struct bro2_file *f, const char *path, int kind,
+		unsigned width, unsigned channels, unsigned depth,
+		unsigned x_res, unsigned y_res);
+
+/* Point @dst at the space for the next image bytes, returning its length */
+size_t bro2_file_space(struct bro2_file *f, uint8_t **dst);
+
+/* @n bytes were put there. Returns -1 with errno set if writing failed. */
+int bro2_file_commit(struct bro2_file *f, size_t n);
+
+/* Finish the page and close the file. Returns -1 with errno set if writing
+ * failed, the file is removed then. */
+int bro2_file_end(struct bro2_file *f);
+
+/* Give up on the page, removing the file */
+void bro2_file_abort(struct bro2_file *f);
+
+#endif
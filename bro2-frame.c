@@ -0,0 +1,154 @@
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "bro2-frame.h"
+
+void bro2_frame_reset(struct bro2_frame *f)
+{
+	f->head = f->tail = 0;
+	f->type = -1;
+	f->remain = 0;
+	f->fresh = false;
+}
+
+void bro2_frame_attach(struct bro2_frame *f, uint8_t *ring, size_t ring_sz)
+{
+	f->ring = ring;
+	f->ring_sz = ring_sz;
+	bro2_frame_reset(f);
+}
+
+static uint8_t ring_at(const struct bro2_frame *f, size_t i)
+{
+	return f->ring[(f->head + i) & (f->ring_sz - 1)];
+}
+
+static void ring_consume(struct bro2_frame *f, size_t n)
+{
+	f->head += n;
+	if (f->head == f->tail)
+		f->head = f->tail = 0;
+}
+
+ssize_t bro2_frame_fill(struct bro2_frame *f, int fd, int flags)
+{
+	size_t used = bro2_frame_buffered(f);
+	size_t space = f->ring_sz - used;
+	size_t start = f->tail & (f->ring_sz - 1);
+	size_t first = f->ring_sz - start;
+
+	if (!space) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	struct iovec iov[2] = {
+		{ .iov_base = f->ring + start, .iov_len = first < space ? first : space },
+		{ .iov_base = f->ring,         .iov_len = first < space ? space - first : 0 },
+	};
+
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iov[1].iov_len ? 2 : 1,
+	};
+
+	ssize_t r = recvmsg(fd, &msg, flags);
+	if (r > 0)
+		f->tail += r;
+	return r;
+}
+
+int bro2_frame_next(struct bro2_frame *f)
+{
+	for (;;) {
+		if (f->type != -1)
+			return f->type;
+
+		size_t avail = bro2_frame_buffered(f);
+		if (!avail)
+			return BRO2_FRAME_NEED_MORE;
+
+		int type = ring_at(f, 0);
+		switch (type) {
+		case BRO2_END_PAGE:
+		case BRO2_END_PAGE_MORE:
+			ring_consume(f, 1);
+			return type;
+		case BRO2_END_NO_DOCS:
+			if (avail < 2)
+				return BRO2_FRAME_NEED_MORE;
+			ring_consume(f, 2);
+			return type;
+		}
+
+		if (avail < 3)
+			return BRO2_FRAME_NEED_MORE;
+
+		f->len = f->remain = ring_at(f, 1) | (ring_at(f, 2) << 8);
+		ring_consume(f, 3);
+
+		/* empty records carry nothing, move along to the next one */
+		if (f->remain) {
+			f->type = type;
+			f->fresh = true;
+		}
+	}
+}
+
+size_t bro2_frame_peek(struct bro2_frame *f, const uint8_t **src)
+{
+	size_t start = f->head & (f->ring_sz - 1);
+	size_t n = bro2_frame_buffered(f);
+	if (n > f->remain)
+		n = f->remain;
+	if (n > f->ring_sz - start)
+		n = f->ring_sz - start;
+
+	*src = f->ring + start;
+	return n;
+}
+
+void bro2_frame_consume(struct bro2_frame *f, size_t n)
+{
+	ring_consume(f, n);
+	f->remain -= n;
+	if (!f->remain)
+		f->type = -1;
+}
+
+ssize_t bro2_frame_recv_payload(struct bro2_frame *f, int fd, void *dst,
+		size_t max, int flags)
+{
+	if (max > f->remain)
+		max = f->remain;
+
+	ssize_t r = recv(fd, dst, max, flags);
+	if (r > 0)
+		bro2_frame_payload_done(f, r);
+	return r;
+}
+
+void bro2_frame_payload_done(struct bro2_frame *f, size_t n)
+{
+	f->remain -= n;
+	if (!f->remain)
+		f->type = -1;
+}
+
+size_t bro2_frame_space(struct bro2_frame *f, uint8_t **dst)
+{
+	size_t space = f->ring_sz - bro2_frame_buffered(f);
+	size_t start = f->tail & (f->ring_sz - 1);
+	size_t first = f->ring_sz - start;
+
+	*dst = f->ring + start;
+	return first < space ? first : space;
+}
+
+void bro2_frame_commit(struct bro2_frame *f, size_t n)
+{
+	f->tail += n;
+}
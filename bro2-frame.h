@@ -0,0 +1,92 @@
+#ifndef BRO2_FRAME_H_
+#define BRO2_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "bro2.h"
+
+/*
+ * Record framer for the scan data stream.
+ *
+ * After an X request the scanner sends a sequence of records, each composed
+ * of a type byte, a 2 byte little endian payload length and the payload. The
+ * stream is ended by a terminator (see BRO2_END_*). Records are not aligned to
+ * read() boundaries: one read may return several records, and one record may
+ * span any number of reads.
+ *
+ * Bytes are read into a ring, headers are parsed out of it, and payload bytes
+ * are handed out either from the ring or (when nothing is buffered) received
+ * directly into the caller's buffer.
+ */
+
+/* returned by bro2_frame_next() when a complete header is not buffered */
+#define BRO2_FRAME_NEED_MORE (-1)
+
+/* Payloads with at least this many bytes outstanding are received directly
+ * into the destination rather than bouncing through the ring. Below this the
+ * extra syscalls cost more than the copy. */
+#define BRO2_FRAME_DIRECT_MIN 512
+
+struct bro2_frame {
+	uint8_t *ring;
+	size_t ring_sz;	/* power of 2 */
+	size_t head;	/* next byte to consume, free running */
+	size_t tail;	/* next byte to fill, free running */
+
+	int type;	/* type of the record in flight, or -1 */
+	size_t len;	/* payload length of the record in flight */
+	size_t remain;	/* payload bytes of the record in flight not yet taken */
+	bool fresh;	/* a new header was parsed, cleared by the user */
+};
+
+void bro2_frame_reset(struct bro2_frame *f);
+
+/* Use @ring (@ring_sz bytes, a power of 2), which stays the caller's, and
+ * reset */
+void bro2_frame_attach(struct bro2_frame *f, uint8_t *ring, size_t ring_sz);
+
+static inline size_t bro2_frame_buffered(const struct bro2_frame *f)
+{
+	return f->tail - f->head;
+}
+
+static inline bool bro2_frame_is_end(int type)
+{
+	return type == BRO2_END_PAGE
+		|| type == BRO2_END_PAGE_MORE
+		|| type == BRO2_END_NO_DOCS;
+}
+
+/* Receive as much as fits into the ring. @flags are passed to recvmsg().
+ * Returns the number of bytes received, 0 on eof, -1 on error (errno set). */
+ssize_t bro2_frame_fill(struct bro2_frame *f, int fd, int flags);
+
+/* Returns the type of the record in flight, parsing a new header if there
+ * isn't one. Terminators are consumed and returned with nothing left in
+ * flight. Returns BRO2_FRAME_NEED_MORE if the header is incomplete. */
+int bro2_frame_next(struct bro2_frame *f);
+
+/* Point @src at the contiguous buffered payload of the record in flight,
+ * returning its length. Follow with bro2_frame_consume(). */
+size_t bro2_frame_peek(struct bro2_frame *f, const uint8_t **src);
+void bro2_frame_consume(struct bro2_frame *f, size_t n);
+
+/* Receive payload of the record in flight directly into @dst, never reading
+ * past the end of the record. Only valid when nothing is buffered. */
+ssize_t bro2_frame_recv_payload(struct bro2_frame *f, int fd, void *dst,
+		size_t max, int flags);
+
+/* For bytes that come from elsewhere than a socket: point @dst at the
+ * contiguous free space in the ring, returning its length, then commit what
+ * was put there. */
+size_t bro2_frame_space(struct bro2_frame *f, uint8_t **dst);
+void bro2_frame_commit(struct bro2_frame *f, size_t n);
+
+/* @n payload bytes of the record in flight were taken directly, as
+ * bro2_frame_recv_payload() does */
+void bro2_frame_payload_done(struct bro2_frame *f, size_t n);
+
+#endif
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include "bro2-g4.h"
+
+struct g4_code {
+	uint16_t code;
+	uint8_t bits;
+};
+
+/* terminating codes, runs 0 to 63 */
+static const struct g4_code white_term[] = {
+	{ 0x035,  8 }, { 0x007,  6 }, { 0x007,  4 }, { 0x008,  4 },
+	{ 0x00b,  4 }, { 0x00c,  4 }, { 0x00e,  4 }, { 0x00f,  4 },
+	{ 0x013,  5 }, { 0x014,  5 }, { 0x007,  5 }, { 0x008,  5 },
+	{ 0x008,  6 }, { 0x003,  6 }, { 0x034,  6 }, { 0x035,  6 },
+	{ 0x02a,  6 }, { 0x02b,  6 }, { 0x027,  7 }, { 0x00c,  7 },
+	{ 0x008,  7 }, { 0x017,  7 }, { 0x003,  7 }, { 0x004,  7 },
+	{ 0x028,  7 }, { 0x02b,  7 }, { 0x013,  7 }, { 0x024,  7 },
+	{ 0x018,  7 }, { 0x002,  8 }, { 0x003,  8 }, { 0x01a,  8 },
+	{ 0x01b,  8 }, { 0x012,  8 }, { 0x013,  8 }, { 0x014,  8 },
+	{ 0x015,  8 }, { 0x016,  8 }, { 0x017,  8 }, { 0x028,  8 },
+	{ 0x029,  8 }, { 0x02a,  8 }, { 0x02b,  8 }, { 0x02c,  8 },
+	{ 0x02d,  8 }, { 0x004,  8 }, { 0x005,  8 }, { 0x00a,  8 },
+	{ 0x00b,  8 }, { 0x052,  8 }, { 0x053,  8 }, { 0x054,  8 },
+	{ 0x055,  8 }, { 0x024,  8 }, { 0x025,  8 }, { 0x058,  8 },
+	{ 0x059,  8 }, { 0x05a,  8 }, { 0x05b,  8 }, { 0x04a,  8 },
+	{ 0x04b,  8 }, { 0x032,  8 }, { 0x033,  8 }, { 0x034,  8 },
+};
+static const struct g4_code black_term[] = {
+	{ 0x037, 10 }, { 0x002,  3 }, { 0x003,  2 }, { 0x002,  2 },
+	{ 0x003,  3 }, { 0x003,  4 }, { 0x002,  4 }, { 0x003,  5 },
+	{ 0x005,  6 }, { 0x004,  6 }, { 0x004,  7 }, { 0x005,  7 },
+	{ 0x007,  7 }, { 0x004,  8 }, { 0x007,  8 }, { 0x018,  9 },
+	{ 0x017, 10 }, { 0x018, 10 }, { 0x008, 10 }, { 0x067, 11 },
+	{ 0x068, 11 }, { 0x06c, 11 }, { 0x037, 11 }, { 0x028, 11 },
+	{ 0x017, 11 }, { 0x018, 11 }, { 0x0ca, 12 }, { 0x0cb, 12 },
+	{ 0x0cc, 12 }, { 0x0cd, 12 }, { 0x068, 12 }, { 0x069, 12 },
+	{ 0x06a, 12 }, { 0x06b, 12 }, { 0x0d2, 12 }, { 0x0d3, 12 },
+	{ 0x0d4, 12 }, { 0x0d5, 12 }, { 0x0d6, 12 }, { 0x0d7, 12 },
+	{ 0x06c, 12 }, { 0x06d, 12 }, { 0x0da, 12 }, { 0x0db, 12 },
+	{ 0x054, 12 }, { 0x055, 12 }, { 0x056, 12 }, { 0x057, 12 },
+	{ 0x064, 12 }, { 0x065, 12 }, { 0x052, 12 }, { 0x053, 12 },
+	{ 0x024, 12 }, { 0x037, 12 }, { 0x038, 12 }, { 0x027, 12 },
+	{ 0x028, 12 }, { 0x058, 12 }, { 0x059, 12 }, { 0x02b, 12 },
+	{ 0x02c, 12 }, { 0x05a, 12 }, { 0x066, 12 }, { 0x067, 12 },
+};
+/* make up codes, runs 64 to 1728 in steps of 64 */
+static const struct g4_code white_makeup[] = {
+	{ 0x01b,  5 }, { 0x012,  5 }, { 0x017,  6 }, { 0x037,  7 },
+	{ 0x036,  8 }, { 0x037,  8 }, { 0x064,  8 }, { 0x065,  8 },
+	{ 0x068,  8 }, { 0x067,  8 }, { 0x0cc,  9 }, { 0x0cd,  9 },
+	{ 0x0d2,  9 }, { 0x0d3,  9 }, { 0x0d4,  9 }, { 0x0d5,  9 },
+	{ 0x0d6,  9 }, { 0x0d7,  9 }, { 0x0d8,  9 }, { 0x0d9,  9 },
+	{ 0x0da,  9 }, { 0x0db,  9 }, { 0x098,  9 }, { 0x099,  9 },
+	{ 0x09a,  9 }, { 0x018,  6 }, { 0x09b,  9 },
+};
+static const struct g4_code black_makeup[] = {
+	{ 0x00f, 10 }, { 0x0c8, 12 }, { 0x0c9, 12 }, { 0x05b, 12 },
+	{ 0x033, 12 }, { 0x034, 12 }, { 0x035, 12 }, { 0x06c, 13 },
+	{ 0x06d, 13 }, { 0x04a, 13 }, { 0x04b, 13 }, { 0x04c, 13 },
+	{ 0x04d, 13 }, { 0x072, 13 }, { 0x073, 13 }, { 0x074, 13 },
+	{ 0x075, 13 }, { 0x076, 13 }, { 0x077, 13 }, { 0x052, 13 },
+	{ 0x053, 13 }, { 0x054, 13 }, { 0x055, 13 }, { 0x05a, 13 },
+	{ 0x05b, 13 }, { 0x064, 13 }, { 0x065, 13 },
+};
+/* make up codes for both colors, 1792 to 2560 */
+static const struct g4_code ext_makeup[] = {
+	{ 0x008, 11 }, { 0x00c, 11 }, { 0x00d, 11 }, { 0x012, 12 },
+	{ 0x013, 12 }, { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 },
+	{ 0x017, 12 }, { 0x01c, 12 }, { 0x01d, 12 }, { 0x01e, 12 },
+	{ 0x01f, 12 },
+};
+
+/* Append @bits of @code, handing out whole bytes */
+static size_t put_bits(struct bro2_g4 *g, uint8_t *dst, unsigned code,
+		unsigned bits)
+{
+	size_t n = 0;
+
+	g->acc = (g->acc << bits) | code;
+	g->nbits += bits;
+	while (g->nbits >= 8) {
+		g->nbits -= 8;
+		dst[n++] = g->acc >> g->nbits;
+	}
+	return n;
+}
+
+static size_t put_code(struct bro2_g4 *g, uint8_t *dst, struct g4_code c)
+{
+	return put_bits(g, dst, c.code, c.bits);
+}
+
+/* A run of @len pixels of @black */
+static size_t put_run(struct bro2_g4 *g, uint8_t *dst, unsigned len, int black)
+{
+	const struct g4_code *term = black ? black_term : white_term;
+	const struct g4_code *makeup = black ? black_makeup : white_makeup;
+	size_t n = 0;
+
+	while (len > 2560) {
+		n += put_code(g, dst + n, ext_makeup[12]);
+		len -= 2560;
+	}
+	if (len >= 1792)
+		n += put_code(g, dst + n, ext_makeup[len / 64 - 28]);
+	else if (len >= 64)
+		n += put_code(g, dst + n, makeup[len / 64 - 1]);
+	return n + put_code(g, dst + n, term[len % 64]);
+}
+
+static int pixel(const uint8_t *row, unsigned x)
+{
+	return row[x / 8] >> (7 - x % 8) & 1;
+}
+
+/* The first pixel from @x on that is @black, or @w. Whole words of the
+ * other color are skipped at once. */
+static unsigned find(const uint8_t *row, unsigned w, unsigned x, int black)
+{
+	const uint64_t flip = black ? 0 : ~(uint64_t)0;
+
+	while (x < w) {
+		unsigned byte = x / 8;
+		uint8_t b = (row[byte] ^ (uint8_t)flip) & (0xff >> (x % 8));
+		if (b) {
+			x = byte * 8 + __builtin_clz(b) - 24;
+			return x < w ? x : w;
+		}
+
+		x = (byte + 1) * 8;
+		while (x + 64 <= w) {
+			uint64_t v;
+			memcpy(&v, row + x / 8, sizeof(v));
+			if (v ^ flip)
+				break;
+			x += 64;
+		}
+	}
+	return w;
+}
+
+void bro2_g4_init(struct bro2_g4 *g, unsigned width, uint8_t *ref)
+{
+	*g = (typeof(*g)) {
+		.width = width,
+		.ref = ref,
+	};
+	/* the line before the first is white */
+	memset(ref, 0, (width + 7) / 8);
+}
+
+size_t bro2_g4_line(struct bro2_g4 *g, const uint8_t *row, uint8_t *dst)
+{
+	static const struct g4_code vert[7] = {
+		{ 0x02, 7 }, { 0x02, 6 }, { 0x02, 3 },	/* VL3 .. VL1 */
+		{ 0x01, 1 },				/* V0 */
+		{ 0x03, 3 }, { 0x03, 6 }, { 0x03, 7 },	/* VR1 .. VR3 */
+	};
+	const uint8_t *ref = g->ref;
+	unsigned w = g->width;
+	int a0 = -1, black = 0;
+	size_t n = 0;
+
+	while (a0 < (int)w) {
+		unsigned start = a0 < 0 ? 0 : a0;
+		unsigned a1, b1, b2;
+
+		/* changing elements: a1 the next on this line, b1 the next
+		 * on the last line that changes to the color a1 does */
+		a1 = find(row, w, a0 < 0 ? 0 : a0 + 1, !black);
+		b1 = a0 < 0 || pixel(ref, a0) == black
+			? start + (a0 >= 0) : find(ref, w, a0 + 1, black);
+		b1 = find(ref, w, b1, !black);
+		b2 = find(ref, w, b1, black);
+
+		if (b2 < a1) {
+			n += put_bits(g, dst + n, 0x1, 4);	/* pass */
+			a0 = b2;
+		} else if (a1 + 3 >= b1 && a1 <= b1 + 3) {
+			n += put_code(g, dst + n, vert[a1 + 3 - b1]);
+			a0 = a1;
+			black = !black;
+		} else {
+			unsigned a2 = find(row, w, a1, black);
+			n += put_bits(g, dst + n, 0x1, 3);	/* horizontal */
+			n += put_run(g, dst + n, a1 - start, black);
+			n += put_run(g, dst + n, a2 - a1, !black);
+			a0 = a2;
+		}
+	}
+
+	memcpy(g->ref, row, (w + 7) / 8);
+	return n;
+}
+
+size_t bro2_g4_end(struct bro2_g4 *g, uint8_t *dst)
+{
+	size_t n = put_bits(g, dst, 0x001001, 24);	/* 2 EOLs */
+	if (g->nbits)
+		n += put_bits(g, dst + n, 0, 8 - g->nbits);
+	return n;
+}
@@ -0,0 +1,36 @@
+#ifndef BRO2_G4_H_
+#define BRO2_G4_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CCITT Group 4 (T.6) encoder for 1-bit lines, as they come from TEXT and
+ * ERRDIF scans: a set bit is black, MSB first, lines padded to a byte.
+ *
+ * Each line is coded against the one before it, so the encoder keeps a copy
+ * of the last line. Output is produced a line at a time, whole bytes only;
+ * bits that don't make a byte yet are held until the next line or the end.
+ */
+
+struct bro2_g4 {
+	unsigned width;
+	uint8_t *ref;		/* the last line, (width + 7) / 8 bytes */
+	uint64_t acc;		/* pending bits, the oldest highest */
+	unsigned nbits;
+};
+
+/* Most bytes bro2_g4_line() (or bro2_g4_end()) writes for @width pixels */
+#define BRO2_G4_LINE_MAX(width) (7 * ((size_t)(width) + 2) + 16)
+
+/* Start a page of @width pixel lines. @ref is (width + 7) / 8 bytes for the
+ * encoder to keep the last line in. */
+void bro2_g4_init(struct bro2_g4 *g, unsigned width, uint8_t *ref);
+
+/* Code @row into @dst, returning the number of bytes written */
+size_t bro2_g4_line(struct bro2_g4 *g, const uint8_t *row, uint8_t *dst);
+
+/* End the page: the end of facsimile block and padding to a byte */
+size_t bro2_g4_end(struct bro2_g4 *g, uint8_t *dst);
+
+#endif
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bro2-gen.h"
+#include "bro2-rle.h"
+
+enum {
+	GEN_GRAY,
+	GEN_RGB,
+	GEN_BW,
+	GEN_C256,
+};
+
+/* the synthetic page is laid out at this resolution */
+#define SYN_DPI 600
+
+/* PNM header fields are whitespace separated and may have comments between
+ * them */
+static int pnm_num(FILE *f, unsigned *v)
+{
+	int c;
+	for (;;) {
+		c = getc(f);
+		if (c == '#') {
+			while (c != '\n' && c != EOF)
+				c = getc(f);
+		} else if (!isspace(c)) {
+			break;
+		}
+	}
+
+	if (!isdigit(c))
+		return -1;
+	*v = 0;
+	while (isdigit(c)) {
+		*v = *v * 10 + c - '0';
+		c = getc(f);
+	}
+	/* exactly 1 whitespace byte ends the header */
+	return isspace(c) ? 0 : -1;
+}
+
+int bro2_gen_load_pnm(struct bro2_gen_img *img, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned maxval;
+	char magic[2];
+
+	if (!f)
+		return -1;
+
+	*img = (typeof(*img)) { 0 };
+	if (fread(magic, 1, 2, f) != 2 || magic[0] != 'P'
+			|| (magic[1] != '5' && magic[1] != '6'))
+		goto fail;
+	img->ch = magic[1] == '6' ? 3 : 1;
+
+	if (pnm_num(f, &img->w) || pnm_num(f, &img->h) || pnm_num(f, &maxval)
+			|| !img->w || !img->h || maxval != 255)
+		goto fail;
+
+	size_t sz = (size_t)img->w * img->h * img->ch;
+	img->px = malloc(sz);
+	if (!img->px || fread(img->px, 1, sz, f) != sz)
+		goto fail;
+
+	fclose(f);
+	return 0;
+
+fail:
+	free(img->px);
+	img->px = NULL;
+	fclose(f);
+	return -1;
+}
+
+void bro2_gen_img_free(struct bro2_gen_img *img)
+{
+	free(img->px);
+	img->px = NULL;
+}
+
+/* The ratio of the bed size to the resolution is fixed (see PROTO) */
+static unsigned bed_w(unsigned x_res)
+{
+	return x_res * 4960 / 600;
+}
+
+static unsigned bed_h(unsigned y_res)
+{
+	return y_res * 8173 / 600;
+}
+
+static unsigned clamp_res(unsigned res, unsigned max)
+{
+	res = res / 100 * 100;
+	if (res < 100)
+		return 100;
+	if (res > max)
+		return max;
+	return res;
+}
+
+void bro2_gen_info(unsigned *x_res, unsigned *y_res, int nums[BRO2_MSG_I_CT])
+{
+	/* asked for 9600x9600, a mfc-7820n says 600x2400 */
+	*x_res = clamp_res(*x_res, 600);
+	*y_res = clamp_res(*y_res, 2400);
+
+	nums[BRO2_MSG_I_XRES] = *x_res;
+	nums[BRO2_MSG_I_YRES] = *y_res;
+	nums[BRO2_MSG_I_UNK0] = 2;
+	nums[BRO2_MSG_I_UNK1] = 209;
+	nums[BRO2_MSG_I_MAX_X] = bed_w(*x_res);
+	nums[BRO2_MSG_I_UNK2] = 346;
+	nums[BRO2_MSG_I_MAX_Y] = bed_h(*y_res);
+}
+
+static uint32_t mix(uint32_t a)
+{
+	a ^= a >> 16;
+	a *= 0x7feb352d;
+	a ^= a >> 15;
+	a *= 0x846ca68b;
+	a ^= a >> 16;
+	return a;
+}
+
+static uint8_t luma(unsigned r, unsigned g, unsigned b)
+{
+	return (r * 77 + g * 150 + b * 29) >> 8;
+}
+
+/* A letter-ish page at SYN_DPI: 1 inch margins, lines of words 1/6 inch
+ * apart, a gradient box partway down, and a slightly noisy background.
+ * @plane is 0-2 for RGB, -1 for gray. */
+static uint8_t synth(unsigned u, unsigned v, int plane)
+{
+	if (u >= 600 && u < 4360 && v >= 3000 && v < 4200) {
+		unsigned gx = (u - 600) * 255 / 3760, gy = (v - 3000) * 255 / 1200;
+		switch (plane) {
+		case 0: return gx;
+		case 1: return 255 - gx;
+		case 2: return gy;
+		default: return luma(gx, 255 - gx, gy);
+		}
+	}
+
+	if (u >= 600 && u < 4360 && v >= 600 && v < 7572) {
+		unsigned row = v / 100, rv = v % 100;
+		unsigned word = (u - 600) / 240, wu = (u - 600) % 240;
+		if (rv < 60 && wu < 200 && (mix(row << 6 | word) & 3)) {
+			unsigned cu = wu % 40;
+			if (cu < 8 || (cu < 30 && rv >= 26 && rv < 34)
+					|| (cu < 30 && rv < 8
+					&& (mix(row << 12 | (u - 600) / 40) & 1)))
+				return 0x20;
+		}
+	}
+
+	return 0xff - (mix(u * 7919 + v) & 3);
+}
+
+/* One plane (or gray) of the current line into g->row */
+static void fill_row(struct bro2_gen *g, int plane)
+{
+	unsigned x;
+
+	if (g->src) {
+		const struct bro2_gen_img *img = g->src;
+		unsigned sy = (uint64_t)(g->y0 + g->line) * img->h / g->bed_h;
+		if (sy >= img->h)
+			sy = img->h - 1;
+		const uint8_t *s = img->px + (size_t)sy * img->w * img->ch;
+
+		for (x = 0; x < g->w; x++) {
+			const uint8_t *p = s + (size_t)g->col[x] * img->ch;
+			if (img->ch == 1)
+				g->row[x] = p[0];
+			else if (plane >= 0)
+				g->row[x] = p[plane];
+			else
+				g->row[x] = luma(p[0], p[1], p[2]);
+		}
+		return;
+	}
+
+	unsigned v = (g->y0 + g->line) * SYN_DPI / g->y_res;
+	for (x = 0; x < g->w; x++)
+		g->row[x] = synth(g->col[x], v, plane);
+}
+
+/* Dark pixels are set bits, MSB first. ERRDIF carries each pixel's error to
+ * the next, TEXT is a plain threshold. */
+static void pack_bits(struct bro2_gen *g)
+{
+	size_t bytes = (g->w + 7) / 8;
+	int err = 0;
+	unsigned x;
+
+	memset(g->bits, 0, bytes);
+	for (x = 0; x < g->w; x++) {
+		int v = g->row[x] + (g->dither ? err : 0);
+		if (v < 128) {
+			g->bits[x / 8] |= 0x80 >> (x % 8);
+			err = v;
+		} else {
+			err = v - 255;
+		}
+	}
+}
+
+/* 3-3-2 RGB, so 0xff is white as in the captures */
+static void c256_row(struct bro2_gen *g)
+{
+	uint8_t *r = g->row, *gb;
+	unsigned x;
+
+	gb = g->bits;
+	fill_row(g, 1);
+	memcpy(gb, g->row, g->w);
+	fill_row(g, 2);
+	for (x = 0; x < g->w; x++)
+		gb[x] = (gb[x] & 0xe0) >> 3 | g->row[x] >> 6;
+	fill_row(g, 0);
+	for (x = 0; x < g->w; x++)
+		r[x] = (r[x] & 0xe0) | gb[x];
+}
+
+void bro2_gen_palette(uint8_t pal[BRO2_GEN_PALETTE_SZ])
+{
+	unsigned i;
+	for (i = 0; i < 256; i++) {
+		pal[3 * i + 0] = (i >> 5) * 255 / 7;
+		pal[3 * i + 1] = ((i >> 2) & 7) * 255 / 7;
+		pal[3 * i + 2] = (i & 3) * 255 / 3;
+	}
+}
+
+static size_t put_rec(struct bro2_gen *g, uint8_t *dst, int type,
+		const uint8_t *src, size_t len)
+{
+	if (g->rle) {
+		size_t n = bro2_rle_encode(src, len, g->enc);
+		/* a record exactly a line long is taken as uncompressed */
+		if (n < len) {
+			src = g->enc;
+			len = n;
+		}
+	}
+
+	dst[0] = type;
+	dst[1] = len & 0xff;
+	dst[2] = len >> 8;
+	memcpy(dst + 3, src, len);
+	return len + 3;
+}
+
+int bro2_gen_start(struct bro2_gen *g, const struct bro2_gen_img *src,
+		const char *mode, const char *compress, unsigned x_res,
+		unsigned y_res, const unsigned area[4])
+{
+	int nums[BRO2_MSG_I_CT];
+	unsigned x;
+
+	bro2_gen_info(&x_res, &y_res, nums);
+
+	*g = (typeof(*g)) {
+		.src = src,
+		.rle = !strcmp(compress, "RLENGTH"),
+		.x_res = x_res,
+		.y_res = y_res,
+		.bed_w = nums[BRO2_MSG_I_MAX_X],
+		.bed_h = nums[BRO2_MSG_I_MAX_Y],
+	};
+
+	if (!strcmp(mode, "CGRAY"))
+		g->kind = GEN_RGB;
+	else if (!strcmp(mode, "TEXT"))
+		g->kind = GEN_BW;
+	else if (!strcmp(mode, "ERRDIF")) {
+		g->kind = GEN_BW;
+		g->dither = true;
+	} else if (!strcmp(mode, "C256"))
+		g->kind = GEN_C256;
+	else
+		g->kind = GEN_GRAY;
+
+	unsigned x1 = area[2] < g->bed_w ? area[2] : g->bed_w;
+	unsigned y1 = area[3] < g->bed_h ? area[3] : g->bed_h;
+	g->x0 = area[0] < x1 ? area[0] : x1;
+	g->y0 = area[1] < y1 ? area[1] : y1;
+	g->w = x1 - g->x0;
+	g->h = y1 - g->y0;
+
+	g->col = malloc(g->w * sizeof(*g->col) + 1);
+	g->row = malloc(g->w + 1);
+	g->bits = malloc(g->w + 1);
+	g->enc = malloc(BRO2_RLE_ENCODED_MAX(g->w) + 1);
+	if (!g->col || !g->row || !g->bits || !g->enc) {
+		bro2_gen_free(g);
+		return -1;
+	}
+
+	for (x = 0; x < g->w; x++) {
+		if (src) {
+			g->col[x] = (uint64_t)(g->x0 + x) * src->w / g->bed_w;
+			if (g->col[x] >= src->w)
+				g->col[x] = src->w - 1;
+		} else {
+			g->col[x] = (g->x0 + x) * SYN_DPI / x_res;
+		}
+	}
+
+	return 0;
+}
+
+void bro2_gen_free(struct bro2_gen *g)
+{
+	free(g->col);
+	free(g->row);
+	free(g->bits);
+	free(g->enc);
+	g->col = NULL;
+	g->row = g->bits = g->enc = NULL;
+}
+
+size_t bro2_gen_line_max(const struct bro2_gen *g)
+{
+	return (g->kind == GEN_RGB ? 3 : 1) * (3 + g->w);
+}
+
+size_t bro2_gen_line(struct bro2_gen *g, uint8_t *dst)
+{
+	size_t o = 0;
+	int p;
+
+	if (g->line >= g->h || !g->w)
+		return 0;
+
+	switch (g->kind) {
+	case GEN_RGB:
+		for (p = 0; p < 3; p++) {
+			static const int types[] = {
+				BRO2_LINE_TYPE_RED,
+				BRO2_LINE_TYPE_GREEN,
+				BRO2_LINE_TYPE_BLUE,
+			};
+			fill_row(g, p);
+			o += put_rec(g, dst + o, types[p], g->row, g->w);
+		}
+		break;
+	case GEN_BW:
+		fill_row(g, -1);
+		pack_bits(g);
+		o = put_rec(g, dst, BRO2_LINE_TYPE_BW, g->bits, (g->w + 7) / 8);
+		break;
+	case GEN_C256:
+		c256_row(g);
+		o = put_rec(g, dst, BRO2_LINE_TYPE_C256, g->row, g->w);
+		break;
+	default:
+		fill_row(g, -1);
+		o = put_rec(g, dst, BRO2_LINE_TYPE_GRAY, g->row, g->w);
+		break;
+	}
+
+	g->line++;
+	return o;
+}
@@ -0,0 +1,75 @@
+#ifndef BRO2_GEN_H_
+#define BRO2_GEN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bro2.h"
+
+/*
+ * Scan data generator for the emulator: produces what a scanner sends in
+ * response to an X request, one line of records at a time.
+ *
+ * Page content is either a synthetic page (lines of "text" on a noisy white
+ * background, with a color gradient box) or a PNM image stretched over the
+ * whole scan bed. Lines are sent as the mode calls for: 3 plane records for
+ * CGRAY, a packed bitmap for TEXT and ERRDIF, palette indices for C256, and
+ * gray otherwise. With C=RLENGTH a record is PackBits encoded when that makes
+ * it shorter, and sent as is otherwise (which is what the scanner does too).
+ */
+
+/* A P5 or P6 image with a maxval of 255 */
+struct bro2_gen_img {
+	unsigned w, h, ch;
+	uint8_t *px;
+};
+
+int bro2_gen_load_pnm(struct bro2_gen_img *img, const char *path);
+void bro2_gen_img_free(struct bro2_gen_img *img);
+
+/* Clamp the resolution to what the scanner does and fill in the reply to an
+ * I request */
+void bro2_gen_info(unsigned *x_res, unsigned *y_res, int nums[BRO2_MSG_I_CT]);
+
+/* The reply to a P request: red, green and blue of each C256 index */
+#define BRO2_GEN_PALETTE_SZ (256 * 3)
+void bro2_gen_palette(uint8_t pal[BRO2_GEN_PALETTE_SZ]);
+
+struct bro2_gen {
+	const struct bro2_gen_img *src;
+	int kind;
+	bool rle, dither;
+
+	unsigned x_res, y_res;
+	unsigned bed_w, bed_h;	/* scan bed, in pixels at this resolution */
+	unsigned x0, y0, w, h;	/* the area being scanned */
+	unsigned line;
+
+	uint32_t *col;		/* x of each pixel, on the source or at 600 dpi */
+	uint8_t *row;		/* a plane of the current line */
+	uint8_t *bits;		/* the line as a bitmap */
+	uint8_t *enc;		/* an encoded record */
+};
+
+/* Set up for an X request. @area is the A= field. Returns -1 if out of
+ * memory. */
+int bro2_gen_start(struct bro2_gen *g, const struct bro2_gen_img *src,
+		const char *mode, const char *compress, unsigned x_res,
+		unsigned y_res, const unsigned area[4]);
+void bro2_gen_free(struct bro2_gen *g);
+
+/* Back to the first line, for the next page of a batch */
+static inline void bro2_gen_rewind(struct bro2_gen *g)
+{
+	g->line = 0;
+}
+
+/* Most bytes a single bro2_gen_line() produces */
+size_t bro2_gen_line_max(const struct bro2_gen *g);
+
+/* Write the records for the next line to @dst. Returns the number of bytes
+ * written, 0 once all lines have been. */
+size_t bro2_gen_line(struct bro2_gen *g, uint8_t *dst);
+
+#endif
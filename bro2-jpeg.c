@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "bro2-jpeg.h"
+
+enum {
+	J_HEADER,
+	J_START,
+	J_SCAN,
+	J_DONE,
+};
+
+struct bro2_jpeg {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_source_mgr src;
+	jmp_buf err_jmp;
+
+	/* compressed bytes, libjpeg is working through them via src */
+	uint8_t *in;
+	size_t in_sz;
+	/* libjpeg asked to skip past what we had buffered */
+	size_t skip;
+
+	int state;
+
+	/* the scanline currently being handed out */
+	uint8_t *row;
+	size_t row_sz, row_len, row_pos;
+};
+
+static void src_init(j_decompress_ptr cinfo)
+{
+}
+
+/* We are a suspending source: never produce data here, the caller feeds us
+ * when it has some and then retries. */
+static boolean src_fill(j_decompress_ptr cinfo)
+{
+	return FALSE;
+}
+
+static void src_skip(j_decompress_ptr cinfo, long num)
+{
+	struct bro2_jpeg *j = cinfo->client_data;
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if (num <= 0)
+		return;
+
+	if ((size_t)num > src->bytes_in_buffer) {
+		j->skip += num - src->bytes_in_buffer;
+		src->next_input_byte += src->bytes_in_buffer;
+		src->bytes_in_buffer = 0;
+	} else {
+		src->next_input_byte += num;
+		src->bytes_in_buffer -= num;
+	}
+}
+
+static void src_term(j_decompress_ptr cinfo)
+{
+}
+
+static void err_exit(j_common_ptr cinfo)
+{
+	struct bro2_jpeg *j = cinfo->client_data;
+	longjmp(j->err_jmp, 1);
+}
+
+static void err_output(j_common_ptr cinfo)
+{
+	/* stay quiet, failures are reported by the caller */
+}
+
+struct bro2_jpeg *bro2_jpeg_new(void)
+{
+	struct bro2_jpeg *j = calloc(1, sizeof(*j));
+	if (!j)
+		return NULL;
+
+	j->cinfo.err = jpeg_std_error(&j->jerr);
+	j->jerr.error_exit = err_exit;
+	j->jerr.output_message = err_output;
+	j->cinfo.client_data = j;
+
+	if (setjmp(j->err_jmp)) {
+		free(j);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&j->cinfo);
+
+	j->src = (struct jpeg_source_mgr) {
+		.init_source = src_init,
+		.fill_input_buffer = src_fill,
+		.skip_input_data = src_skip,
+		.resync_to_restart = jpeg_resync_to_restart,
+		.term_source = src_term,
+	};
+	j->cinfo.src = &j->src;
+
+	return j;
+}
+
+void bro2_jpeg_free(struct bro2_jpeg *j)
+{
+	if (!j)
+		return;
+	jpeg_destroy_decompress(&j->cinfo);
+	free(j->in);
+	free(j->row);
+	free(j);
+}
+
+void bro2_jpeg_reset(struct bro2_jpeg *j)
+{
+	jpeg_abort_decompress(&j->cinfo);
+	j->src.next_input_byte = j->in;
+	j->src.bytes_in_buffer = 0;
+	j->skip = 0;
+	j->state = J_HEADER;
+	j->row_len = j->row_pos = 0;
+}
+
+int bro2_jpeg_feed(struct bro2_jpeg *j, const void *src, size_t len)
+{
+	size_t skip = j->skip < len ? j->skip : len;
+	src = (const uint8_t *)src + skip;
+	len -= skip;
+	j->skip -= skip;
+
+	/* move what libjpeg hasn't consumed yet to the front */
+	size_t keep = j->src.bytes_in_buffer;
+	if (keep)
+		memmove(j->in, j->src.next_input_byte, keep);
+
+	if (keep + len > j->in_sz) {
+		size_t sz = j->in_sz ? j->in_sz : 4096;
+		while (sz < keep + len)
+			sz *= 2;
+		uint8_t *in = realloc(j->in, sz);
+		if (!in)
+			return -1;
+		j->in = in;
+		j->in_sz = sz;
+	}
+
+	memcpy(j->in + keep, src, len);
+	j->src.next_input_byte = j->in;
+	j->src.bytes_in_buffer = keep + len;
+	return 0;
+}
+
+ssize_t bro2_jpeg_read(struct bro2_jpeg *j, void *dst, size_t max)
+{
+	struct jpeg_decompress_struct *cinfo = &j->cinfo;
+	uint8_t *out = dst;
+	size_t o = 0;
+
+	if (setjmp(j->err_jmp)) {
+		j->state = J_DONE;
+		return -1;
+	}
+
+	while (o < max) {
+		switch (j->state) {
+		case J_HEADER:
+			if (jpeg_read_header(cinfo, TRUE) == JPEG_SUSPENDED)
+				return o;
+			j->state = J_START;
+			break;
+
+		case J_START:
+			/* whatever the scanner encoded, lines go out as RGB */
+			cinfo->out_color_space = JCS_RGB;
+			if (!jpeg_start_decompress(cinfo))
+				return o;
+
+			size_t sz = (size_t)cinfo->output_width * cinfo->output_components;
+			if (sz > j->row_sz) {
+				uint8_t *row = realloc(j->row, sz);
+				if (!row)
+					return -1;
+				j->row = row;
+				j->row_sz = sz;
+			}
+			j->row_len = j->row_pos = 0;
+			j->state = J_SCAN;
+			break;
+
+		case J_SCAN:
+			if (j->row_pos < j->row_len) {
+				size_t n = j->row_len - j->row_pos;
+				if (n > max - o)
+					n = max - o;
+				memcpy(out + o, j->row + j->row_pos, n);
+				j->row_pos += n;
+				o += n;
+				break;
+			}
+
+			if (cinfo->output_scanline >= cinfo->output_height) {
+				j->state = J_DONE;
+				break;
+			}
+
+			JSAMPROW row = j->row;
+			if (jpeg_read_scanlines(cinfo, &row, 1) != 1)
+				return o;
+			j->row_len = (size_t)cinfo->output_width * cinfo->output_components;
+			j->row_pos = 0;
+			break;
+
+		case J_DONE:
+			return o;
+		}
+	}
+
+	return o;
+}
+
+bool bro2_jpeg_started(const struct bro2_jpeg *j)
+{
+	return j->state == J_SCAN || j->state == J_DONE;
+}
+
+int bro2_jpeg_components(const struct bro2_jpeg *j)
+{
+	return j->cinfo.output_components;
+}
+
+int bro2_jpeg_width(const struct bro2_jpeg *j)
+{
+	return j->cinfo.output_width;
+}
+
+int bro2_jpeg_height(const struct bro2_jpeg *j)
+{
+	return j->cinfo.output_height;
+}
+
+bool bro2_jpeg_done(const struct bro2_jpeg *j)
+{
+	return j->state == J_DONE;
+}
@@ -0,0 +1,42 @@
+#ifndef BRO2_JPEG_H_
+#define BRO2_JPEG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Incremental decoder for "C=JPEG" scan data.
+ *
+ * The payloads of the image records are concatenated into a single JPEG
+ * stream per page. Compressed bytes are fed in as they arrive and scanlines
+ * are handed out as soon as libjpeg can produce them (once each MCU row is
+ * complete), so only the not yet consumed part of the compressed stream and a
+ * single output row are ever held.
+ */
+
+struct bro2_jpeg;
+
+struct bro2_jpeg *bro2_jpeg_new(void);
+void bro2_jpeg_free(struct bro2_jpeg *j);
+void bro2_jpeg_reset(struct bro2_jpeg *j);
+
+/* Append compressed bytes. Returns 0 or -1 if out of memory. */
+int bro2_jpeg_feed(struct bro2_jpeg *j, const void *src, size_t len);
+
+/* Copy decoded pixels into @dst. Returns the number of bytes written (0 when
+ * more input is needed or the image is complete), or -1 on a decode error. */
+ssize_t bro2_jpeg_read(struct bro2_jpeg *j, void *dst, size_t max);
+
+/* What the scanlines handed out are, valid once decoding has started. They
+ * are always RGB, a page that can't be made that is a decode error. */
+bool bro2_jpeg_started(const struct bro2_jpeg *j);
+int bro2_jpeg_components(const struct bro2_jpeg *j);
+int bro2_jpeg_width(const struct bro2_jpeg *j);
+int bro2_jpeg_height(const struct bro2_jpeg *j);
+
+/* All scanlines have been handed out */
+bool bro2_jpeg_done(const struct bro2_jpeg *j);
+
+#endif
@@ -0,0 +1,228 @@
+#include <string.h>
+
+#include "bro2.h"
+#include "bro2-pipe.h"
+
+/* pieces of the memory block start on cache lines */
+#define PIECE(sz) (((sz) + 63) & ~(size_t)63)
+
+/* the steps every pipeline is made of, for the compiler to specialize */
+#define STEP static inline __attribute__((always_inline))
+
+size_t bro2_pipe_mem_sz(enum bro2_pipe_kind kind, size_t width)
+{
+	switch (kind) {
+	case BRO2_PIPE_RGB:
+		return PIECE(width * 3) + PIECE(BRO2_COLOR_ROWS_SZ(width));
+	case BRO2_PIPE_C256:
+		return PIECE(width * 3) + PIECE(width);
+	default:
+		return 0;
+	}
+}
+
+void bro2_pipe_reset(struct bro2_pipe *p)
+{
+	bro2_rle_reset(&p->rle);
+	if (p->kind == BRO2_PIPE_RGB)
+		bro2_color_reset(&p->planes);
+	p->idx_fill = 0;
+	p->bw_pos = 0;
+	p->out_len = p->out_pos = 0;
+}
+
+size_t bro2_pipe_rec_bytes(const struct bro2_pipe *p, int type)
+{
+	if (type == BRO2_LINE_TYPE_BW)
+		return (p->width + 7) / 8;
+	return p->width;
+}
+
+/* A line of indices is whole, expand it for handing out */
+static void c256_expand(struct bro2_pipe *p, size_t n)
+{
+	p->idx_fill += n;
+	if (p->idx_fill < p->width)
+		return;
+
+	bro2_c256_expand(p->out, p->idx, p->idx_fill, p->lut);
+	p->idx_fill = 0;
+	p->out_len = p->width * 3;
+	p->out_pos = 0;
+}
+
+/* Clear the padding of every line that ends within the @n bytes at @dst */
+static void bw_pad(struct bro2_pipe *p, uint8_t *dst, size_t n)
+{
+	size_t bpl = (p->width + 7) / 8;
+
+	while (n) {
+		size_t c = bpl - p->bw_pos < n ? bpl - p->bw_pos : n;
+		dst += c;
+		n -= c;
+		p->bw_pos += c;
+		if (p->bw_pos == bpl) {
+			dst[-1] &= p->bw_mask;
+			p->bw_pos = 0;
+		}
+	}
+}
+
+STEP uint8_t *step_dst(struct bro2_pipe *p, enum bro2_pipe_kind kind,
+		int type, uint8_t *buf, size_t *room)
+{
+	switch (kind) {
+	case BRO2_PIPE_RGB:
+		return bro2_color_dst(&p->planes, bro2_color_plane(type), room);
+	case BRO2_PIPE_C256:
+		*room = p->width - p->idx_fill;
+		return p->idx + p->idx_fill;
+	default:
+		return buf;
+	}
+}
+
+STEP size_t step_commit(struct bro2_pipe *p, enum bro2_pipe_kind kind,
+		int type, uint8_t *dst, size_t n)
+{
+	switch (kind) {
+	case BRO2_PIPE_RGB:
+		bro2_color_commit(&p->planes, bro2_color_plane(type), n);
+		return 0;
+	case BRO2_PIPE_C256:
+		c256_expand(p, n);
+		return 0;
+	case BRO2_PIPE_BW:
+		if (p->bw_mask)
+			bw_pad(p, dst, n);
+		return n;
+	default:
+		return n;
+	}
+}
+
+STEP ssize_t step_feed(struct bro2_pipe *p, enum bro2_pipe_kind kind,
+		bool rle, int type, const uint8_t *src, size_t len,
+		size_t *used, uint8_t *buf, size_t room)
+{
+	uint8_t *dst = step_dst(p, kind, type, buf, &room);
+	size_t n;
+
+	if (!dst)
+		return -1;
+	if (rle) {
+		n = bro2_rle_decode(&p->rle, src, len, used, dst, room);
+	} else {
+		n = len < room ? len : room;
+		memcpy(dst, src, n);
+		*used = n;
+	}
+	return step_commit(p, kind, type, dst, n);
+}
+
+#define PIPE(k, K)							\
+static ssize_t k##_feed(struct bro2_pipe *p, int type,			\
+		const uint8_t *src, size_t len, size_t *used,		\
+		uint8_t *buf, size_t room)				\
+{									\
+	return step_feed(p, BRO2_PIPE_##K, false, type, src, len, used,	\
+			buf, room);					\
+}									\
+static ssize_t k##_feed_rle(struct bro2_pipe *p, int type,		\
+		const uint8_t *src, size_t len, size_t *used,		\
+		uint8_t *buf, size_t room)				\
+{									\
+	return step_feed(p, BRO2_PIPE_##K, true, type, src, len, used,	\
+			buf, room);					\
+}									\
+static uint8_t *k##_dst(struct bro2_pipe *p, int type, uint8_t *buf,	\
+		size_t *room)						\
+{									\
+	return step_dst(p, BRO2_PIPE_##K, type, buf, room);		\
+}									\
+static size_t k##_commit(struct bro2_pipe *p, int type, uint8_t *dst,	\
+		size_t n)						\
+{									\
+	return step_commit(p, BRO2_PIPE_##K, type, dst, n);		\
+}
+
+PIPE(gray, GRAY)
+PIPE(bw, BW)
+PIPE(rgb, RGB)
+PIPE(c256, C256)
+
+static bool drop_none(int type)
+{
+	return false;
+}
+
+static bool rgb_drop(int type)
+{
+	return bro2_color_plane(type) < 0;
+}
+
+static bool c256_drop(int type)
+{
+	return type != BRO2_LINE_TYPE_C256;
+}
+
+/* lines other than RGB ones are whole as soon as their record is */
+static bool ready_never(const struct bro2_pipe *p)
+{
+	return false;
+}
+
+static bool rgb_ready(const struct bro2_pipe *p)
+{
+	return bro2_color_ready(&p->planes);
+}
+
+static void rgb_line(struct bro2_pipe *p)
+{
+	bro2_color_emit(&p->planes, p->out);
+	p->out_len = p->width * 3;
+	p->out_pos = 0;
+}
+
+static const struct bro2_pipe_ops pipes[BRO2_PIPE_KINDS] = {
+#define OPS(k, ...) .name = #k, .feed = { k##_feed, k##_feed_rle },	\
+	.dst = k##_dst, .commit = k##_commit, __VA_ARGS__
+	[BRO2_PIPE_GRAY] = { OPS(gray, .drop = drop_none, .ready = ready_never) },
+	[BRO2_PIPE_BW] = { OPS(bw, .drop = drop_none, .ready = ready_never) },
+	[BRO2_PIPE_RGB] = { OPS(rgb, .drop = rgb_drop, .ready = rgb_ready,
+			.line = rgb_line) },
+	[BRO2_PIPE_C256] = { OPS(c256, .drop = c256_drop, .ready = ready_never) },
+#undef OPS
+};
+
+void bro2_pipe_init(struct bro2_pipe *p, enum bro2_pipe_kind kind,
+		size_t width, const uint32_t *lut, void *mem)
+{
+	uint8_t *m = mem;
+
+	*p = (typeof(*p)) {
+		.ops = &pipes[kind],
+		.kind = kind,
+		.width = width,
+		.lut = lut,
+	};
+
+	if (kind == BRO2_PIPE_RGB || kind == BRO2_PIPE_C256) {
+		p->out = m;
+		m += PIECE(width * 3);
+	}
+	if (kind == BRO2_PIPE_RGB)
+		bro2_color_init(&p->planes, width, m);
+	if (kind == BRO2_PIPE_C256)
+		p->idx = m;
+	if (kind == BRO2_PIPE_BW && width % 8)
+		p->bw_mask = 0xff << (8 - width % 8);
+	bro2_pipe_reset(p);
+}
+
+ssize_t bro2_pipe_feed_generic(struct bro2_pipe *p, bool rle, int type,
+		const uint8_t *src, size_t len, size_t *used, uint8_t *buf,
+		size_t room)
+{
+	return step_feed(p, p->kind, rle, type, src, len, used, buf, room);
+}
@@ -0,0 +1,118 @@
+#ifndef BRO2_PIPE_H_
+#define BRO2_PIPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "bro2-color.h"
+#include "bro2-rle.h"
+
+/*
+ * Line assembly: what becomes of the payload of each record on its way to
+ * the lines handed out.
+ *
+ * What a scan's records hold is fixed when it starts (by M= and C=), so
+ * rather than work it out again for every piece of every record there's a
+ * pipeline per kind of line, with a feed for plain records and one for
+ * PackBits ones. They're all made from the same inline steps with the kind
+ * and the compression as constants, so each is straight-line code. The
+ * scan's pipeline is picked once, by bro2_pipe_init(). Which feed a record
+ * takes is still up to the caller: with C=RLENGTH the scanner sends some
+ * records plain anyway.
+ *
+ * Records come in whatever pieces the socket gives, so a partly assembled
+ * line (and a PackBits run) is kept here between calls. JPEG isn't lines
+ * and has a decoder of its own, see bro2-jpeg.
+ */
+
+enum bro2_pipe_kind {
+	BRO2_PIPE_GRAY,		/* as is: 8 bit gray, or JPEG passed through */
+	BRO2_PIPE_BW,		/* 1 bit, the padding of each line cleared */
+	BRO2_PIPE_RGB,		/* a record per color plane, interleaved */
+	BRO2_PIPE_C256,		/* palette indices, expanded to RGB */
+	BRO2_PIPE_KINDS,
+};
+
+struct bro2_pipe;
+
+struct bro2_pipe_ops {
+	const char *name;
+
+	/* records of @type aren't part of the image */
+	bool (*drop)(int type);
+
+	/*
+	 * The next @len bytes of a record's payload at @src, plain [0] or
+	 * PackBits [1], none to finish a run. Takes what fits, *@used of @src.
+	 * Lines that go out as they are go to @buf, @room bytes, the others
+	 * are assembled in out. Returns how much went to @buf, -1 if the color
+	 * planes are further apart than BRO2_COLOR_WINDOW lines.
+	 */
+	ssize_t (*feed[2])(struct bro2_pipe *p, int type, const uint8_t *src,
+			size_t len, size_t *used, uint8_t *buf, size_t room);
+
+	/* To receive a plain record straight into place: where its next bytes
+	 * go (NULL as for feed), then that @n went to @dst. commit returns how
+	 * much of it is at @buf. */
+	uint8_t *(*dst)(struct bro2_pipe *p, int type, uint8_t *buf,
+			size_t *room);
+	size_t (*commit)(struct bro2_pipe *p, int type, uint8_t *dst, size_t n);
+
+	/* A line can be assembled into out, and doing that */
+	bool (*ready)(const struct bro2_pipe *p);
+	void (*line)(struct bro2_pipe *p);
+};
+
+struct bro2_pipe {
+	const struct bro2_pipe_ops *ops;
+	enum bro2_pipe_kind kind;
+	size_t width;		/* pixels a line */
+
+	struct bro2_rle rle;	/* of the record in flight */
+
+	/* an assembled line, partially handed out */
+	uint8_t *out;
+	size_t out_len, out_pos;
+
+	struct bro2_color planes;
+
+	/* a line of indices, and the palette, not ours */
+	uint8_t *idx;
+	size_t idx_fill;
+	const uint32_t *lut;
+
+	/* the pixels of a line's last byte (0 if it's whole), and how far
+	 * into a line we are */
+	uint8_t bw_mask;
+	size_t bw_pos;
+};
+
+/* Bytes of memory bro2_pipe_init() needs */
+size_t bro2_pipe_mem_sz(enum bro2_pipe_kind kind, size_t width);
+
+/* Lines of @width pixels of @kind. @lut is the C256 palette, @mem is
+ * bro2_pipe_mem_sz() bytes. Both stay the caller's. */
+void bro2_pipe_init(struct bro2_pipe *p, enum bro2_pipe_kind kind,
+		size_t width, const uint32_t *lut, void *mem);
+
+/* Forget any partial lines, for the next page */
+void bro2_pipe_reset(struct bro2_pipe *p);
+
+/* Bytes of a whole record of @type, unencoded */
+size_t bro2_pipe_rec_bytes(const struct bro2_pipe *p, int type);
+
+/* Assembled lines that are still to be handed out */
+static inline bool bro2_pipe_have_output(const struct bro2_pipe *p)
+{
+	return p->out_pos < p->out_len || p->ops->ready(p);
+}
+
+/* ops->feed with the kind and compression looked at on each call, as it
+ * was before there were pipelines. For bro2-pipebench to measure against. */
+ssize_t bro2_pipe_feed_generic(struct bro2_pipe *p, bool rle, int type,
+		const uint8_t *src, size_t len, size_t *used, uint8_t *buf,
+		size_t room);
+
+#endif
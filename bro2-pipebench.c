@@ -0,0 +1,351 @@
+/*
+ * The line assembly pipelines on their own: a page from the emulator's
+ * generator, already in memory, through the specialized pipeline for its
+ * mode and through the same steps dispatched at run time.
+ *
+ * Prints a header and then one tab separated line per case, like
+ * bro2-bench.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ccan/array_size/array_size.h>
+
+#include "bro2.h"
+#include "bro2-gen.h"
+#include "bro2-pipe.h"
+
+/* what the frontend reads with */
+#define SINK_SZ (1 << 16)
+
+struct rec {
+	int type;
+	const uint8_t *p;
+	size_t len;
+};
+
+struct page {
+	uint8_t *stream;
+	struct rec *recs;
+	size_t rec_ct;
+	enum bro2_pipe_kind kind;
+	bool rlength;
+	size_t width;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static enum bro2_pipe_kind mode_kind(const char *mode)
+{
+	if (!strcmp(mode, "CGRAY"))
+		return BRO2_PIPE_RGB;
+	if (!strcmp(mode, "C256"))
+		return BRO2_PIPE_C256;
+	if (!strcmp(mode, "TEXT") || !strcmp(mode, "ERRDIF"))
+		return BRO2_PIPE_BW;
+	return BRO2_PIPE_GRAY;
+}
+
+/* The whole bed at @res, split into records */
+static int page_make(struct page *pg, const char *mode, const char *compress,
+		unsigned res)
+{
+	unsigned x_res = res, y_res = res, area[4] = { 0, 0 };
+	int nums[BRO2_MSG_I_CT];
+	struct bro2_gen g;
+	size_t len = 0, cap = 0, n, i;
+
+	bro2_gen_info(&x_res, &y_res, nums);
+	area[2] = nums[BRO2_MSG_I_MAX_X];
+	area[3] = nums[BRO2_MSG_I_MAX_Y];
+	if (bro2_gen_start(&g, NULL, mode, compress, x_res, y_res, area))
+		return -1;
+
+	*pg = (typeof(*pg)) {
+		.kind = mode_kind(mode),
+		.rlength = !strcmp(compress, "RLENGTH"),
+		.width = area[2],
+	};
+	do {
+		if (cap - len < bro2_gen_line_max(&g)) {
+			uint8_t *st;
+			cap = cap * 2 + bro2_gen_line_max(&g);
+			st = realloc(pg->stream, cap);
+			if (!st)
+				goto fail;
+			pg->stream = st;
+		}
+		n = bro2_gen_line(&g, pg->stream + len);
+		len += n;
+	} while (n);
+
+	/* a type byte, 2 bytes of length, the payload */
+	for (i = 0; i + 3 <= len; i += 3 + pg->recs[pg->rec_ct - 1].len) {
+		struct rec *r = realloc(pg->recs,
+				(pg->rec_ct + 1) * sizeof(*r));
+		if (!r)
+			goto fail;
+		pg->recs = r;
+		r[pg->rec_ct++] = (struct rec) {
+			.type = pg->stream[i],
+			.p = pg->stream + i + 3,
+			.len = pg->stream[i + 1] | pg->stream[i + 2] << 8,
+		};
+	}
+
+	bro2_gen_free(&g);
+	return 0;
+
+fail:
+	bro2_gen_free(&g);
+	free(pg->stream);
+	free(pg->recs);
+	return -1;
+}
+
+/* Pieces of hashed output, or just handed out */
+struct sink {
+	uint8_t buf[SINK_SZ];
+	size_t pos, total;
+	bool hash;
+	uint64_t h;
+};
+
+static void sink_flush(struct sink *s)
+{
+	size_t i;
+
+	if (s->hash)
+		for (i = 0; i < s->pos; i++)
+			s->h = (s->h ^ s->buf[i]) * 0x100000001b3ull;
+	s->total += s->pos;
+	s->pos = 0;
+}
+
+/* Lines the pipeline assembled itself */
+static void sink_lines(struct sink *s, struct bro2_pipe *p)
+{
+	for (;;) {
+		if (p->out_pos < p->out_len) {
+			size_t n = p->out_len - p->out_pos;
+			if (n > SINK_SZ - s->pos)
+				n = SINK_SZ - s->pos;
+			memcpy(s->buf + s->pos, p->out + p->out_pos, n);
+			p->out_pos += n;
+			s->pos += n;
+			if (s->pos == SINK_SZ)
+				sink_flush(s);
+		} else if (p->ops->ready(p)) {
+			p->ops->line(p);
+		} else {
+			return;
+		}
+	}
+}
+
+/* The page through @p in pieces of at most @chunk bytes, as they'd come out
+ * of the frame ring. Returns -1 if the pipeline got stuck. */
+static int page_run(const struct page *pg, struct bro2_pipe *p, bool generic,
+		size_t chunk, struct sink *s)
+{
+	size_t i;
+
+	bro2_pipe_reset(p);
+	for (i = 0; i < pg->rec_ct; i++) {
+		const struct rec *r = &pg->recs[i];
+		bool rle = pg->rlength
+			&& r->len != bro2_pipe_rec_bytes(p, r->type);
+		size_t off = 0;
+
+		if (p->ops->drop(r->type))
+			continue;
+
+		while (off < r->len || bro2_rle_pending(&p->rle)) {
+			size_t c = r->len - off < chunk ? r->len - off : chunk;
+			size_t used = 0;
+			ssize_t n;
+
+			if (s->pos == SINK_SZ)
+				sink_flush(s);
+			if (generic)
+				n = bro2_pipe_feed_generic(p, rle, r->type,
+						r->p + off, c, &used,
+						s->buf + s->pos, SINK_SZ - s->pos);
+			else
+				n = p->ops->feed[rle](p, r->type, r->p + off, c,
+						&used, s->buf + s->pos,
+						SINK_SZ - s->pos);
+			if (n < 0 || (!n && !used && !bro2_rle_pending(&p->rle)
+						&& !bro2_pipe_have_output(p)))
+				return -1;
+			s->pos += n;
+			off += used;
+			sink_lines(s, p);
+		}
+	}
+	sink_flush(s);
+	return 0;
+}
+
+/* Best of @reps runs, in seconds, and the output's hash */
+static double page_time(const struct page *pg, struct bro2_pipe *p,
+		bool generic, size_t chunk, unsigned reps, uint64_t *h,
+		size_t *bytes)
+{
+	static struct sink s;
+	double best = -1;
+	unsigned i;
+
+	s = (struct sink) { .hash = true, .h = 0xcbf29ce484222325ull };
+	if (page_run(pg, p, generic, chunk, &s))
+		return -1;
+	*h = s.h;
+	*bytes = s.total;
+
+	s.hash = false;
+	for (i = 0; i < reps; i++) {
+		double t0 = now(), t;
+		page_run(pg, p, generic, chunk, &s);
+		t = now() - t0;
+		if (best < 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static int bench_run(const char *mode, const char *compress, unsigned res,
+		size_t chunk, unsigned reps)
+{
+	static uint32_t lut[BRO2_PALETTE_SZ];
+	struct bro2_pipe p;
+	struct page pg;
+	uint64_t h_spec, h_gen;
+	size_t bytes, bytes_gen;
+	double spec, gen;
+	void *mem;
+
+	if (page_make(&pg, mode, compress, res))
+		return -1;
+	bro2_palette_default(lut);
+	/* gray and bw need none, but not NULL */
+	mem = malloc(bro2_pipe_mem_sz(pg.kind, pg.width) + 1);
+	if (!mem) {
+		free(pg.stream);
+		free(pg.recs);
+		return -1;
+	}
+	bro2_pipe_init(&p, pg.kind, pg.width, lut, mem);
+
+	spec = page_time(&pg, &p, false, chunk, reps, &h_spec, &bytes);
+	gen = page_time(&pg, &p, true, chunk, reps, &h_gen, &bytes_gen);
+
+	printf("%s\t%s\t%u\t%s\t%zu\t%zu\t%.2f\t%.2f\t%.3f\t%s\n",
+			mode, compress, res, p.ops->name, pg.rec_ct, bytes,
+			spec > 0 ? bytes / spec / 1e6 : 0,
+			gen > 0 ? bytes / gen / 1e6 : 0,
+			spec > 0 ? gen / spec : 0,
+			spec < 0 || gen < 0 ? "stuck"
+			: h_spec != h_gen || bytes != bytes_gen ? "differ" : "ok");
+	fflush(stdout);
+
+	free(mem);
+	free(pg.stream);
+	free(pg.recs);
+	return spec < 0 || gen < 0 || h_spec != h_gen ? -1 : 0;
+}
+
+/* Split a comma separated list in place */
+static size_t split(char *s, char **v, size_t max)
+{
+	size_t n = 0;
+	char *tok;
+
+	for (tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ","))
+		v[n++] = tok;
+	return n;
+}
+
+static void usage(const char *prgm)
+{
+	fprintf(stderr,
+		"usage: %s [-m mode,...] [-r dpi,...] [-c compress,...]\n"
+		"          [-z chunk] [-n reps]\n"
+		"\n"
+		"Generate a page of the whole bed for every combination of mode,\n"
+		"resolution and compression (JPEG isn't lines and has no\n"
+		"pipeline), and put it through line assembly -n times (default\n"
+		"20) in pieces of at most -z bytes (default 4096), once with the\n"
+		"mode's pipeline and once through the generic steps. Prints, tab\n"
+		"separated: mode, compression, dpi, pipeline, records, bytes out,\n"
+		"MB/s out specialized and generic (best run), how many times\n"
+		"faster the specialized one is, and whether the two agree.\n",
+		prgm);
+}
+
+int main(int argc, char **argv)
+{
+	char modes_arg[] = "GRAY64,CGRAY,TEXT,C256";
+	char res_arg[] = "300,600";
+	char comp_arg[] = "NONE,RLENGTH";
+	char *mode_s = modes_arg, *res_s = res_arg, *comp_s = comp_arg;
+	char *modes[16], *ress[16], *comps[4];
+	size_t mode_ct, res_ct, comp_ct, i, j, k;
+	size_t chunk = 4096;
+	unsigned reps = 20;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "m:r:c:z:n:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mode_s = optarg;
+			break;
+		case 'r':
+			res_s = optarg;
+			break;
+		case 'c':
+			comp_s = optarg;
+			break;
+		case 'z':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			reps = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	mode_ct = split(mode_s, modes, ARRAY_SIZE(modes));
+	res_ct = split(res_s, ress, ARRAY_SIZE(ress));
+	comp_ct = split(comp_s, comps, ARRAY_SIZE(comps));
+	if (optind != argc || !chunk || !reps || !mode_ct || !res_ct
+			|| !comp_ct) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("mode\tcompress\tdpi\tpipe\trecords\tbytes\tspec_mb_s"
+			"\tgeneric_mb_s\tspeedup\tcheck\n");
+	for (i = 0; i < mode_ct; i++)
+		for (j = 0; j < res_ct; j++)
+			for (k = 0; k < comp_ct; k++)
+				if (bench_run(modes[i], comps[k],
+						strtoul(ress[j], NULL, 0),
+						chunk, reps))
+					ret = 1;
+	return ret;
+}
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "bro2-readahead.h"
+
+struct bro2_ra *bro2_ra_new(unsigned depth, size_t buf_sz)
+{
+	struct bro2_ra *ra = calloc(1, sizeof(*ra));
+	unsigned i;
+
+	if (!ra)
+		return NULL;
+
+	ra->depth = depth;
+	ra->buf_sz = buf_sz;
+	ra->fd = -1;
+	ra->tail = &ra->head;
+	ra->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ra->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	if (ra->ready_fd == -1 || ra->stop_fd == -1)
+		goto fail;
+
+	for (i = 0; i < depth; i++) {
+		struct bro2_ra_buf *b = malloc(sizeof(*b) + buf_sz);
+		if (!b)
+			goto fail;
+		b->next = ra->pool;
+		ra->pool = b;
+	}
+
+	return ra;
+
+fail:
+	bro2_ra_free(ra);
+	return NULL;
+}
+
+void bro2_ra_free(struct bro2_ra *ra)
+{
+	struct bro2_ra_buf *b;
+
+	if (!ra)
+		return;
+
+	bro2_ra_stop(ra);
+	while ((b = ra->pool)) {
+		ra->pool = b->next;
+		free(b);
+	}
+	if (ra->ready_fd != -1)
+		close(ra->ready_fd);
+	if (ra->stop_fd != -1)
+		close(ra->stop_fd);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra);
+}
+
+/* Keep ready_fd in step with the queue, called with the lock held */
+static void ra_ready_update(struct bro2_ra *ra)
+{
+	bool ready = ra->head || ra->ended;
+	uint64_t v = 1;
+
+	if (ready == ra->ready)
+		return;
+	if (ready)
+		(void)!write(ra->ready_fd, &v, sizeof(v));
+	else
+		(void)!read(ra->ready_fd, &v, sizeof(v));
+	ra->ready = ready;
+}
+
+/* Receive into @b, waiting for data or to be stopped. Returns what recv()
+ * did, or -2 if stopped. */
+static ssize_t ra_recv(struct bro2_ra *ra, struct bro2_ra_buf *b)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = ra->fd, .events = POLLIN },
+		{ .fd = ra->stop_fd, .events = POLLIN },
+	};
+
+	for (;;) {
+		ssize_t r = recv(ra->fd, b->data, ra->buf_sz, MSG_DONTWAIT);
+		if (r >= 0)
+			return r;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			return -1;
+		if (pfd[1].revents)
+			return -2;
+	}
+}
+
+static void *ra_thread(void *arg)
+{
+	struct bro2_ra *ra = arg;
+	struct bro2_ra_buf *b;
+	ssize_t r;
+
+	do {
+		pthread_mutex_lock(&ra->lock);
+		while (!ra->pool && !ra->stop)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->stop) {
+			pthread_mutex_unlock(&ra->lock);
+			break;
+		}
+		b = ra->pool;
+		ra->pool = b->next;
+		pthread_mutex_unlock(&ra->lock);
+
+		r = ra_recv(ra, b);
+		int err = errno;
+
+		pthread_mutex_lock(&ra->lock);
+		if (r > 0) {
+			b->len = r;
+			b->pos = 0;
+			b->next = NULL;
+			*ra->tail = b;
+			ra->tail = &b->next;
+		} else {
+			b->next = ra->pool;
+			ra->pool = b;
+			if (r != -2) {
+				ra->ended = true;
+				ra->err = r ? err : 0;
+			}
+		}
+		ra_ready_update(ra);
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+	} while (r > 0);
+
+	return NULL;
+}
+
+int bro2_ra_start(struct bro2_ra *ra, int fd)
+{
+	bro2_ra_stop(ra);
+	ra->fd = fd;
+	if (pthread_create(&ra->thread, NULL, ra_thread, ra))
+		return -1;
+	ra->running = true;
+	return 0;
+}
+
+void bro2_ra_stop(struct bro2_ra *ra)
+{
+	struct bro2_ra_buf *b;
+	uint64_t v = 1;
+
+	if (!ra->running)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	(void)!write(ra->stop_fd, &v, sizeof(v));
+	pthread_join(ra->thread, NULL);
+	ra->running = false;
+	(void)!read(ra->stop_fd, &v, sizeof(v));
+
+	/* the thread is gone, nothing else touches these now */
+	while ((b = ra->head)) {
+		ra->head = b->next;
+		b->next = ra->pool;
+		ra->pool = b;
+	}
+	ra->tail = &ra->head;
+	ra->ended = ra->stop = false;
+	ra->err = 0;
+	ra_ready_update(ra);
+	ra->fd = -1;
+}
+
+ssize_t bro2_ra_read(struct bro2_ra *ra, void *dst, size_t max)
+{
+	struct bro2_ra_buf *b;
+	size_t n = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	while (n < max && (b = ra->head)) {
+		size_t c = b->len - b->pos;
+		if (c > max - n)
+			c = max - n;
+		memcpy((uint8_t *)dst + n, b->data + b->pos, c);
+		b->pos += c;
+		n += c;
+
+		if (b->pos == b->len) {
+			ra->head = b->next;
+			if (!ra->head)
+				ra->tail = &ra->head;
+			b->next = ra->pool;
+			ra->pool = b;
+			pthread_cond_broadcast(&ra->cond);
+		}
+	}
+
+	ssize_t r = n;
+	if (!n && ra->ended && ra->err) {
+		errno = ra->err;
+		r = -1;
+	} else if (!n && !ra->ended) {
+		errno = EAGAIN;
+		r = -1;
+	}
+	ra_ready_update(ra);
+	pthread_mutex_unlock(&ra->lock);
+	return r;
+}
+
+void bro2_ra_wait(struct bro2_ra *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->head && !ra->ended)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	pthread_mutex_unlock(&ra->lock);
+}
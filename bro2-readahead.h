@@ -0,0 +1,65 @@
+#ifndef BRO2_READAHEAD_H_
+#define BRO2_READAHEAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Keeps the scanner's data flowing while the frontend is busy elsewhere.
+ *
+ * A thread receives from the socket into a fixed pool of buffers and queues
+ * them in order. The consumer takes bytes back off the queue, and a buffer
+ * returns to the pool once it's empty. With every buffer queued the thread
+ * stops receiving, so the scanner is held back by TCP as it would be
+ * without readahead, just @depth buffers later.
+ */
+
+struct bro2_ra_buf {
+	struct bro2_ra_buf *next;
+	size_t len, pos;
+	uint8_t data[];
+};
+
+struct bro2_ra {
+	unsigned depth;
+	size_t buf_sz;
+	int fd;
+	int ready_fd;	/* eventfd, readable while bro2_ra_read() won't block */
+	int stop_fd;	/* eventfd, wakes the thread to exit */
+
+	pthread_t thread;
+	bool running;
+
+	/* the rest is shared with the thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bro2_ra_buf *head, **tail;	/* received, oldest first */
+	struct bro2_ra_buf *pool;
+	bool ended;	/* the thread won't queue any more */
+	int err;	/* why: an errno, or 0 for eof */
+	bool stop;
+	bool ready;	/* ready_fd is readable */
+};
+
+/* @depth buffers of @buf_sz. NULL if out of memory. */
+struct bro2_ra *bro2_ra_new(unsigned depth, size_t buf_sz);
+void bro2_ra_free(struct bro2_ra *ra);
+
+/* Start receiving from @fd, which must be non-blocking. Returns -1 if the
+ * thread can't be started. */
+int bro2_ra_start(struct bro2_ra *ra, int fd);
+
+/* Stop the thread and drop anything it queued */
+void bro2_ra_stop(struct bro2_ra *ra);
+
+/* Like recv(): the number of bytes copied to @dst, 0 at eof, -1 with errno
+ * set to EAGAIN if nothing is queued or to the error the thread got. */
+ssize_t bro2_ra_read(struct bro2_ra *ra, void *dst, size_t max);
+
+/* Block until bro2_ra_read() won't */
+void bro2_ra_wait(struct bro2_ra *ra);
+
+#endif
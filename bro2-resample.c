@@ -0,0 +1,246 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bro2-resample.h"
+
+/* weights are 0.16 fixed point and each pixel's add up to this, so a sum
+ * of samples scaled by them can't overflow */
+#define W_ONE 0xffff
+
+/* pieces of the memory block start on cache lines */
+#define PIECE(sz) (((sz) + 63) & ~(size_t)63)
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Most source pixels (or lines) an output one covers part of */
+static unsigned span_max(unsigned from, unsigned to)
+{
+	return (from - 1) / to + 2;
+}
+
+/*
+ * Weights of the source pixels output pixel @o covers, in @w. Returns how
+ * many there are, from *@first on. The output pixel is [o * from,
+ * (o + 1) * from) in units where source pixel i is [i * to, (i + 1) * to).
+ */
+static unsigned span(uint64_t o, unsigned from, unsigned to, uint16_t *w,
+		uint64_t *first)
+{
+	uint64_t lo = o * from, hi = lo + from;
+	uint64_t i = lo / to, last = (hi - 1) / to;
+	unsigned n, k, big = 0;
+	uint32_t sum = 0;
+
+	*first = i;
+	for (n = 0; i <= last; i++, n++) {
+		uint64_t a = i * to > lo ? i * to : lo;
+		uint64_t b = (i + 1) * to < hi ? (i + 1) * to : hi;
+		w[n] = (b - a) * W_ONE / from;
+		sum += w[n];
+		if (w[n] > w[big])
+			big = n;
+	}
+	/* what rounding down lost goes to the biggest share */
+	w[big] += W_ONE - sum;
+	for (k = n; k < span_max(from, to); k++)
+		w[k] = 0;
+	return n;
+}
+
+size_t bro2_rs_width(size_t src_w, unsigned from, unsigned to)
+{
+	return (uint64_t)src_w * to / from;
+}
+
+size_t bro2_rs_mem_sz(size_t src_w, unsigned channels, unsigned x_from,
+		unsigned x_to, unsigned y_from, unsigned y_to)
+{
+	unsigned gx = gcd(x_from, x_to), gy = gcd(y_from, y_to);
+	size_t dst_w = bro2_rs_width(src_w, x_from, x_to);
+	size_t bpl = src_w * channels;
+
+	x_from /= gx;
+	x_to /= gx;
+	y_from /= gy;
+	y_to /= gy;
+	return PIECE(dst_w * sizeof(uint32_t))
+		+ PIECE(dst_w * span_max(x_from, x_to) * sizeof(uint16_t))
+		+ PIECE(span_max(y_from, y_to) * bpl)
+		+ PIECE((bpl + span_max(x_from, x_to) * channels)
+				* sizeof(uint16_t));
+}
+
+void bro2_rs_init(struct bro2_rs *rs, size_t src_w, unsigned channels,
+		unsigned x_from, unsigned x_to, unsigned y_from, unsigned y_to,
+		void *mem)
+{
+	unsigned gx = gcd(x_from, x_to), gy = gcd(y_from, y_to);
+	uint8_t *p = mem;
+	size_t i;
+
+	*rs = (typeof(*rs)) {
+		.src_w = src_w,
+		.dst_w = bro2_rs_width(src_w, x_from, x_to),
+		.channels = channels,
+		.x_from = x_from / gx,
+		.x_to = x_to / gx,
+		.y_from = y_from / gy,
+		.y_to = y_to / gy,
+	};
+	rs->x_max = span_max(rs->x_from, rs->x_to);
+	rs->ring_ct = span_max(rs->y_from, rs->y_to);
+
+	rs->x_first = (uint32_t *)p;
+	p += PIECE(rs->dst_w * sizeof(uint32_t));
+	rs->x_w = (uint16_t *)p;
+	p += PIECE(rs->dst_w * rs->x_max * sizeof(uint16_t));
+	rs->ring = p;
+	p += PIECE(rs->ring_ct * src_w * channels);
+	rs->mid = (uint16_t *)p;
+	/* past the line for the last pixel's unused weights */
+	memset(rs->mid + src_w * channels, 0,
+			rs->x_max * channels * sizeof(uint16_t));
+
+	for (i = 0; i < rs->dst_w; i++) {
+		uint64_t first;
+		span(i, rs->x_from, rs->x_to, rs->x_w + i * rs->x_max, &first);
+		rs->x_first[i] = first;
+	}
+}
+
+void bro2_rs_reset(struct bro2_rs *rs)
+{
+	rs->src_rows = rs->dst_rows = 0;
+}
+
+uint8_t *bro2_rs_src(struct bro2_rs *rs)
+{
+	return rs->ring + rs->src_rows % rs->ring_ct * rs->src_w * rs->channels;
+}
+
+void bro2_rs_push(struct bro2_rs *rs)
+{
+	rs->src_rows++;
+}
+
+/* mid[i] = sum of row[i] * w, with row[i] as 8.8 and w as 0.16. @i is where
+ * to start. */
+static void rows_scalar(uint16_t *mid, uint8_t *const *row,
+		const uint16_t *w, unsigned n, size_t i, size_t len)
+{
+	for (; i < len; i++) {
+		uint32_t acc = 0;
+		unsigned k;
+		for (k = 0; k < n; k++)
+			acc += (uint32_t)(row[k][i] << 8) * w[k] >> 16;
+		mid[i] = acc;
+	}
+}
+
+#ifdef __SSE2__
+/* 16 samples at a time. Returns where it stopped. */
+static size_t rows_sse2(uint16_t *mid, uint8_t *const *row,
+		const uint16_t *w, unsigned n, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i lo = zero, hi = zero;
+		unsigned k;
+
+		for (k = 0; k < n; k++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(row[k] + i));
+			__m128i wk = _mm_set1_epi16((short)w[k]);
+			/* the sample in the high byte is the 8.8 value */
+			lo = _mm_add_epi16(lo, _mm_mulhi_epu16(
+						_mm_unpacklo_epi8(zero, v), wk));
+			hi = _mm_add_epi16(hi, _mm_mulhi_epu16(
+						_mm_unpackhi_epi8(zero, v), wk));
+		}
+		_mm_storeu_si128((__m128i *)(mid + i), lo);
+		_mm_storeu_si128((__m128i *)(mid + i + 8), hi);
+	}
+	return i;
+}
+
+/* Round 8.8 back to 8 bits, 16 at a time. Returns where it stopped. */
+static size_t round_sse2(uint8_t *dst, const uint16_t *mid, size_t len)
+{
+	const __m128i half = _mm_set1_epi16(0x80);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(mid + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(mid + i + 8));
+		lo = _mm_srli_epi16(_mm_adds_epu16(lo, half), 8);
+		hi = _mm_srli_epi16(_mm_adds_epu16(hi, half), 8);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+#endif
+
+/* Each output pixel from the source ones it covers in mid */
+static void cols(const struct bro2_rs *rs, uint8_t *dst)
+{
+	unsigned ch = rs->channels, c, k;
+	size_t i;
+
+	for (i = 0; i < rs->dst_w; i++) {
+		const uint16_t *w = rs->x_w + i * rs->x_max;
+		const uint16_t *src = rs->mid + (size_t)rs->x_first[i] * ch;
+
+		for (c = 0; c < ch; c++) {
+			uint32_t acc = 0;
+			for (k = 0; k < rs->x_max; k++)
+				acc += (uint32_t)src[k * ch + c] * w[k];
+			dst[i * ch + c] = ((acc >> 16) + 0x80) >> 8;
+		}
+	}
+}
+
+bool bro2_rs_emit(struct bro2_rs *rs, uint8_t *dst)
+{
+	size_t len = rs->src_w * rs->channels, i = 0;
+	uint8_t *row[rs->ring_ct];
+	uint16_t w[rs->ring_ct];
+	uint64_t first;
+	unsigned n, k;
+
+	n = span(rs->dst_rows, rs->y_from, rs->y_to, w, &first);
+	if (first + n > rs->src_rows)
+		return false;
+
+	for (k = 0; k < n; k++)
+		row[k] = rs->ring + (first + k) % rs->ring_ct * len;
+#ifdef __SSE2__
+	i = rows_sse2(rs->mid, row, w, n, len);
+#endif
+	rows_scalar(rs->mid, row, w, n, i, len);
+
+	if (rs->x_from == rs->x_to) {
+		i = 0;
+#ifdef __SSE2__
+		i = round_sse2(dst, rs->mid, len);
+#endif
+		for (; i < len; i++)
+			dst[i] = (rs->mid[i] + 0x80) >> 8;
+	} else {
+		cols(rs, dst);
+	}
+
+	rs->dst_rows++;
+	return true;
+}
@@ -0,0 +1,69 @@
+#ifndef BRO2_RESAMPLE_H_
+#define BRO2_RESAMPLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Resampling 8 bit lines to another resolution, for when the scanner won't
+ * scan at the one asked for (PROTO: 9600x9600 gets 600x2400).
+ *
+ * It's an area filter: an output pixel is the mean of the source it
+ * covers, the source pixels at its edges counted by how much of them it
+ * covers. That's right for shrinking, the usual case. Growing repeats
+ * pixels, blending the two an output pixel straddles.
+ *
+ * Lines stream through. Each source line goes into a ring of the few the
+ * next output line needs, and an output line can be taken as soon as its
+ * last source line is in. Rows are combined first, across the ring at the
+ * source width, then columns. Lines left over at the end of a page that
+ * don't make up a whole output line are dropped.
+ */
+
+struct bro2_rs {
+	size_t src_w, dst_w;		/* pixels */
+	unsigned channels;
+	/* an output pixel is x_from / x_to source pixels wide */
+	unsigned x_from, x_to, y_from, y_to;
+
+	/* output pixel i takes the x_max weights at x_w[i * x_max] from
+	 * source pixel x_first[i] on, unused ones 0 */
+	unsigned x_max;
+	uint32_t *x_first;
+	uint16_t *x_w;
+
+	uint8_t *ring;			/* ring_ct source lines */
+	unsigned ring_ct;
+	uint64_t src_rows, dst_rows;	/* put in, taken out */
+	uint16_t *mid;			/* rows combined, 8.8 fixed point,
+					   then x_max pixels of 0 */
+};
+
+/* Width of @src_w pixels at @to dpi, scanned at @from. 0 if that's less
+ * than a pixel. */
+size_t bro2_rs_width(size_t src_w, unsigned from, unsigned to);
+
+/* Bytes of memory bro2_rs_init() needs */
+size_t bro2_rs_mem_sz(size_t src_w, unsigned channels, unsigned x_from,
+		unsigned x_to, unsigned y_from, unsigned y_to);
+
+/* Lines of @src_w pixels of @channels samples scanned at @x_from x @y_from
+ * dpi, to @x_to x @y_to. @mem is bro2_rs_mem_sz() bytes that stay the
+ * caller's. */
+void bro2_rs_init(struct bro2_rs *rs, size_t src_w, unsigned channels,
+		unsigned x_from, unsigned x_to, unsigned y_from, unsigned y_to,
+		void *mem);
+
+/* Forget the lines so far, for the next page */
+void bro2_rs_reset(struct bro2_rs *rs);
+
+/* Where the next source line goes, put it in with bro2_rs_push() */
+uint8_t *bro2_rs_src(struct bro2_rs *rs);
+void bro2_rs_push(struct bro2_rs *rs);
+
+/* Take the next output line into @dst (dst_w * channels bytes) if it's
+ * complete. Take all there are before pushing another source line. */
+bool bro2_rs_emit(struct bro2_rs *rs, uint8_t *dst);
+
+#endif
@@ -0,0 +1,158 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bro2-rle.h"
+
+enum {
+	RLE_CTRL,	/* expecting a control byte */
+	RLE_LIT,	/* copying count literal bytes */
+	RLE_RUN_BYTE,	/* expecting the byte to repeat count times */
+	RLE_RUN,	/* emitting count copies of byte */
+};
+
+bool bro2_rle_pending(const struct bro2_rle *d)
+{
+	return d->state == RLE_RUN && d->count;
+}
+
+/* Runs are at most 128 bytes. When the destination has room, round the run
+ * up to whole vector stores: the excess is overwritten by whatever follows,
+ * or is simply beyond the data handed back. */
+static void fill_run(uint8_t *dst, uint8_t b, size_t n, size_t room)
+{
+#ifdef __SSE2__
+	if (((n + 15) & ~(size_t)15) <= room) {
+		__m128i v = _mm_set1_epi8((char)b);
+		size_t i;
+		for (i = 0; i < n; i += 16)
+			_mm_storeu_si128((__m128i *)(dst + i), v);
+		return;
+	}
+#endif
+	memset(dst, b, n);
+}
+
+size_t bro2_rle_decode(struct bro2_rle *d, const uint8_t *src, size_t src_len,
+		size_t *src_used, uint8_t *dst, size_t dst_len)
+{
+	size_t s = 0, o = 0;
+
+	for (;;) {
+		size_t n;
+		switch (d->state) {
+		case RLE_CTRL:
+			/* Fast path: whole codes that fit in both buffers. A
+			 * code takes at most 129 input and 128 output bytes. */
+			while (src_len - s >= 129 && dst_len - o >= 128) {
+				uint8_t c = src[s];
+				if (c < 128) {
+					n = c + 1;
+					memcpy(dst + o, src + s + 1, n);
+					s += n + 1;
+					o += n;
+				} else if (c > 128) {
+					n = 257 - c;
+					fill_run(dst + o, src[s + 1], n, dst_len - o);
+					s += 2;
+					o += n;
+				} else {
+					s++;
+				}
+			}
+
+			if (s == src_len)
+				goto out;
+
+			{
+				uint8_t c = src[s++];
+				if (c < 128) {
+					d->state = RLE_LIT;
+					d->count = c + 1;
+				} else if (c > 128) {
+					d->state = RLE_RUN_BYTE;
+					d->count = 257 - c;
+				}
+			}
+			break;
+
+		case RLE_LIT:
+			n = d->count;
+			if (n > src_len - s)
+				n = src_len - s;
+			if (n > dst_len - o)
+				n = dst_len - o;
+			if (!n)
+				goto out;
+
+			memcpy(dst + o, src + s, n);
+			s += n;
+			o += n;
+			d->count -= n;
+			if (!d->count)
+				d->state = RLE_CTRL;
+			break;
+
+		case RLE_RUN_BYTE:
+			if (s == src_len)
+				goto out;
+			d->byte = src[s++];
+			d->state = RLE_RUN;
+			break;
+
+		case RLE_RUN:
+			n = d->count;
+			if (n > dst_len - o)
+				n = dst_len - o;
+			if (!n)
+				goto out;
+
+			fill_run(dst + o, d->byte, n, dst_len - o);
+			o += n;
+			d->count -= n;
+			if (!d->count)
+				d->state = RLE_CTRL;
+			break;
+		}
+	}
+
+out:
+	*src_used = s;
+	return o;
+}
+
+size_t bro2_rle_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	size_t i = 0, o = 0;
+
+	while (i < len) {
+		size_t n = 1;
+		while (i + n < len && n < 128 && src[i + n] == src[i])
+			n++;
+
+		if (n > 1) {
+			dst[o++] = 257 - n;
+			dst[o++] = src[i];
+			i += n;
+			continue;
+		}
+
+		/* a literal, up to where a run of 3 (worth breaking it for)
+		 * starts */
+		while (i + n < len && n < 128) {
+			if (i + n + 2 < len && src[i + n] == src[i + n + 1]
+					&& src[i + n] == src[i + n + 2])
+				break;
+			n++;
+		}
+
+		dst[o++] = n - 1;
+		memcpy(dst + o, src + i, n);
+		o += n;
+		i += n;
+	}
+
+	return o;
+}
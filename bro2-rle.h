@@ -0,0 +1,49 @@
+#ifndef BRO2_RLE_H_
+#define BRO2_RLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Decoder for "C=RLENGTH" scan data.
+ *
+ * The encoding is PackBits: a control byte n followed by
+ *   n in [0, 127]:    n + 1 literal bytes
+ *   n in [129, 255]:  a single byte to be repeated 257 - n times
+ *   n == 128:         nothing (padding)
+ * For example, the TEXT mode record "42 02 00 c1 00" is a run of 64 0x00
+ * bytes (a white 512 pixel line).
+ *
+ * The decoder keeps its position within a literal or run between calls, so
+ * input may be fed in arbitrary pieces (ring wrap, record and read
+ * boundaries) and output may be drained into arbitrarily small buffers.
+ */
+
+struct bro2_rle {
+	uint8_t state;
+	uint8_t byte;	/* the byte being repeated */
+	uint16_t count;	/* bytes left in the current literal or run */
+};
+
+static inline void bro2_rle_reset(struct bro2_rle *d)
+{
+	*d = (struct bro2_rle) { 0 };
+}
+
+/* A run is partially emitted and can be drained without further input */
+bool bro2_rle_pending(const struct bro2_rle *d);
+
+/* Decode from @src into @dst. Stores the number of input bytes consumed in
+ * @src_used and returns the number of bytes written. */
+size_t bro2_rle_decode(struct bro2_rle *d, const uint8_t *src, size_t src_len,
+		size_t *src_used, uint8_t *dst, size_t dst_len);
+
+/* Worst case size of @len bytes once encoded */
+#define BRO2_RLE_ENCODED_MAX(len) ((len) + ((len) + 127) / 128)
+
+/* Encode @len bytes from @src into @dst, which must have room for
+ * BRO2_RLE_ENCODED_MAX(@len). Returns the encoded length. */
+size_t bro2_rle_encode(const uint8_t *src, size_t len, uint8_t *dst);
+
+#endif
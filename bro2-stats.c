@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+
+#include "bro2.h"
+#include "bro2-stats.h"
+
+static void stats_init(struct bro2_stats *s, const char *addr)
+{
+	memset(s, 0, sizeof(*s));
+	s->version = BRO2_STATS_VERSION;
+	s->size = sizeof(*s);
+	s->pid = getpid();
+	snprintf(s->addr, sizeof(s->addr), "%s", addr ? addr : "");
+
+	/* a collector that sees the magic sees the rest of the header */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(s->magic, BRO2_STATS_MAGIC, sizeof(s->magic));
+}
+
+static struct bro2_stats *stats_map(const char *path)
+{
+	struct bro2_stats *s;
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return NULL;
+
+	if (ftruncate(fd, sizeof(*s))) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		unlink(path);
+		return NULL;
+	}
+	return s;
+}
+
+int bro2_stats_open(struct bro2_stats_map *m, const char *dir,
+		const char *addr)
+{
+	static unsigned seq;
+
+	*m = (typeof(*m)) { 0 };
+	if (dir) {
+		unsigned n = __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED);
+		if (asprintf(&m->path, "%s/bro2-%ld-%u", dir, (long)getpid(),
+					n) < 0)
+			m->path = NULL;
+		else if (!(m->s = stats_map(m->path))) {
+			free(m->path);
+			m->path = NULL;
+		}
+	}
+
+	if (!m->s) {
+		m->s = malloc(sizeof(*m->s));
+		if (!m->s)
+			return -1;
+	}
+
+	stats_init(m->s, addr);
+	return 0;
+}
+
+void bro2_stats_close(struct bro2_stats_map *m)
+{
+	if (m->path) {
+		unlink(m->path);
+		munmap(m->s, sizeof(*m->s));
+		free(m->path);
+	} else {
+		free(m->s);
+	}
+	m->s = NULL;
+	m->path = NULL;
+}
+
+int bro2_stats_type(int line_type)
+{
+	switch (line_type) {
+	case BRO2_LINE_TYPE_GRAY:
+		return BRO2_STATS_GRAY;
+	case BRO2_LINE_TYPE_BW:
+		return BRO2_STATS_BW;
+	case BRO2_LINE_TYPE_RED:
+		return BRO2_STATS_RED;
+	case BRO2_LINE_TYPE_GREEN:
+		return BRO2_STATS_GREEN;
+	case BRO2_LINE_TYPE_BLUE:
+		return BRO2_STATS_BLUE;
+	case BRO2_LINE_TYPE_C256:
+		return BRO2_STATS_C256;
+	default:
+		return BRO2_STATS_OTHER;
+	}
+}
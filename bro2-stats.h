@@ -0,0 +1,92 @@
+#ifndef BRO2_STATS_H_
+#define BRO2_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Per device counters. With a directory given they live in a file there
+ * (named bro2-<pid>-<n>) mapped shared, so a collector can map or just read
+ * it while the device is scanning. The file is removed when the device is
+ * closed.
+ *
+ * There's a single writer for each counter, so a reader sees every counter
+ * whole but not all of them from the same instant. Check magic, version and
+ * size before trusting the rest.
+ */
+
+#define BRO2_STATS_MAGIC	"bro2stat"
+#define BRO2_STATS_VERSION	1
+
+/* records[] is indexed by bro2_stats_type() */
+enum {
+	BRO2_STATS_GRAY,	/* 0x40 */
+	BRO2_STATS_BW,		/* 0x42 */
+	BRO2_STATS_RED,		/* 0x44 */
+	BRO2_STATS_GREEN,	/* 0x48 */
+	BRO2_STATS_BLUE,	/* 0x4c */
+	BRO2_STATS_C256,	/* 0x5c */
+	BRO2_STATS_OTHER,
+	BRO2_STATS_TYPES
+};
+
+/* batch_pages[] buckets, the last is for this many pages or more */
+#define BRO2_STATS_BATCH_MAX 50
+
+struct bro2_stats {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* of this struct */
+	int64_t pid;
+	char addr[128];		/* the device name it was opened with */
+
+	uint64_t bytes;		/* received after X, headers included */
+	uint64_t records[BRO2_STATS_TYPES];
+	uint64_t stalls;	/* receives that would block mid record */
+	uint64_t eagain;	/* receives that would block */
+	uint64_t blocked_ns;	/* sane_read() waiting for the scanner */
+	uint64_t decode_ns;	/* decompression and color line assembly */
+	uint64_t pages;
+	uint64_t batches;	/* finished, each counted in batch_pages[] */
+	uint64_t batch_pages[BRO2_STATS_BATCH_MAX + 1];
+};
+
+struct bro2_stats_map {
+	struct bro2_stats *s;	/* always valid after bro2_stats_open() */
+	char *path;		/* NULL if not shared */
+};
+
+/* Counters for the device opened as @addr. Shared if @dir isn't NULL and
+ * the file can be made there (@m->path is set), private (and the *_ns
+ * counters left alone) otherwise. Returns -1 if out of memory. */
+int bro2_stats_open(struct bro2_stats_map *m, const char *dir,
+		const char *addr);
+void bro2_stats_close(struct bro2_stats_map *m);
+
+int bro2_stats_type(int line_type);
+
+static inline void bro2_stats_add(uint64_t *ctr, uint64_t n)
+{
+	__atomic_store_n(ctr, *ctr + n, __ATOMIC_RELAXED);
+}
+
+/* For the *_ns counters: read the clock only when someone's looking */
+static inline uint64_t bro2_stats_clock(const struct bro2_stats_map *m)
+{
+	struct timespec ts;
+	if (!m->path)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void bro2_stats_lap(const struct bro2_stats_map *m,
+		uint64_t *ctr, uint64_t start)
+{
+	if (m->path)
+		bro2_stats_add(ctr, bro2_stats_clock(m) - start);
+}
+
+#endif
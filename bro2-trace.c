@@ -0,0 +1,723 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bro2.h"
+#include "bro2-trace.h"
+
+struct sess_build {
+	struct bro2_trace_sess s;
+	bool incomplete;
+};
+
+struct trace_build {
+	struct sess_build *sess;
+	size_t sess_ct, sess_sz;
+	const char *path;
+};
+
+static struct sess_build *sess_new(struct trace_build *b)
+{
+	if (b->sess_ct == b->sess_sz) {
+		size_t sz = b->sess_sz ? b->sess_sz * 2 : 8;
+		struct sess_build *s = realloc(b->sess, sz * sizeof(*s));
+		if (!s)
+			return NULL;
+		b->sess = s;
+		b->sess_sz = sz;
+	}
+
+	struct sess_build *s = &b->sess[b->sess_ct++];
+	*s = (typeof(*s)) { .s = { 0 } };
+	return s;
+}
+
+static void sess_free(struct bro2_trace_sess *s)
+{
+	free(s->data);
+	free(s->chunks);
+}
+
+/* Add bytes to the session, as a new chunk or continuing the last one */
+static int sess_append(struct bro2_trace_sess *s, bool from_scanner, double t,
+		const uint8_t *d, size_t len, bool new_chunk)
+{
+	struct bro2_trace_chunk *c = s->chunk_ct ? &s->chunks[s->chunk_ct - 1] : NULL;
+
+	if (!len)
+		return 0;
+
+	if (s->len + len > s->sz) {
+		size_t sz = s->sz ? s->sz : 4096;
+		while (sz < s->len + len)
+			sz *= 2;
+		uint8_t *data = realloc(s->data, sz);
+		if (!data)
+			return -1;
+		s->data = data;
+		s->sz = sz;
+	}
+
+	if (new_chunk || !c || c->from_scanner != from_scanner) {
+		if (s->chunk_ct == s->chunk_sz) {
+			size_t sz = s->chunk_sz ? s->chunk_sz * 2 : 64;
+			c = realloc(s->chunks, sz * sizeof(*c));
+			if (!c)
+				return -1;
+			s->chunks = c;
+			s->chunk_sz = sz;
+		}
+		c = &s->chunks[s->chunk_ct++];
+		*c = (typeof(*c)) {
+			.from_scanner = from_scanner,
+			.t = t,
+			.off = s->len,
+		};
+	}
+
+	memcpy(s->data + s->len, d, len);
+	s->len += len;
+	c->len += len;
+	return 0;
+}
+
+/* Keep only complete sessions */
+static int trace_finish(struct bro2_trace *t, struct trace_build *b)
+{
+	size_t i;
+
+	*t = (typeof(*t)) { 0 };
+	t->sess = calloc(b->sess_ct + 1, sizeof(*t->sess));
+	if (!t->sess)
+		goto fail;
+
+	for (i = 0; i < b->sess_ct; i++) {
+		struct sess_build *s = &b->sess[i];
+		if (!s->s.chunk_ct) {
+			sess_free(&s->s);
+		} else if (s->incomplete) {
+			fprintf(stderr, "%s: session %zu is incomplete, skipping it\n",
+					b->path, i);
+			sess_free(&s->s);
+		} else {
+			t->sess[t->sess_ct++] = s->s;
+		}
+	}
+	free(b->sess);
+
+	if (!t->sess_ct) {
+		fprintf(stderr, "%s: no sessions to play back\n", b->path);
+		bro2_trace_free(t);
+		return -1;
+	}
+	return 0;
+
+fail:
+	for (i = 0; i < b->sess_ct; i++)
+		sess_free(&b->sess[i].s);
+	free(b->sess);
+	return -1;
+}
+
+/*
+ * PROTO style notes
+ */
+
+struct proto_state {
+	struct sess_build *s;
+	int dir;		/* -1 until a '>' or '<', then from_scanner */
+	size_t msg_start;	/* where the current message begins */
+	bool msg_new;		/* nothing added to it yet */
+};
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* "1b" or "\x1b" */
+static int hex_byte(const char *tok)
+{
+	if (tok[0] == '\\' && tok[1] == 'x')
+		tok += 2;
+	if (strlen(tok) != 2 || hexval(tok[0]) < 0 || hexval(tok[1]) < 0)
+		return -1;
+	return hexval(tok[0]) << 4 | hexval(tok[1]);
+}
+
+static bool all_hex(const char *tok)
+{
+	size_t i;
+	for (i = 0; tok[i]; i++)
+		if (hexval(tok[i]) < 0)
+			return false;
+	return i > 0;
+}
+
+static int proto_add(struct proto_state *ps, const uint8_t *d, size_t len)
+{
+	int r = sess_append(&ps->s->s, ps->dir, 0, d, len, ps->msg_new);
+	if (len)
+		ps->msg_new = false;
+	return r;
+}
+
+/* Dump lines give their offset in the message, which lets the same message
+ * be written out twice (as PROTO does, hex string then dump) without being
+ * sent twice */
+static void proto_seek(struct proto_state *ps, size_t off)
+{
+	struct bro2_trace_sess *s = &ps->s->s;
+	size_t to = ps->msg_start + off;
+
+	if (to > s->len) {
+		ps->s->incomplete = true;
+		return;
+	}
+	if (ps->msg_new || to == s->len)
+		return;
+
+	struct bro2_trace_chunk *c = &s->chunks[s->chunk_ct - 1];
+	c->len -= s->len - to;
+	s->len = to;
+	if (!c->len) {
+		s->chunk_ct--;
+		ps->msg_new = true;
+	}
+}
+
+static int proto_line(struct trace_build *b, struct proto_state *ps, char *l)
+{
+	char *tok[64], *save;
+	uint8_t bytes[64];
+	size_t n = 0, i = 0, ct = 0, max = sizeof(bytes);
+	bool msg_line = false;
+
+	if (!strncmp(l, "-----", 5)) {
+		ps->s = sess_new(b);
+		if (!ps->s)
+			return -1;
+		ps->dir = -1;
+		return 0;
+	}
+
+	if (!ps->s)
+		return 0;
+
+	if (l[0] == '>' || l[0] == '<') {
+		ps->dir = l[0] == '>';
+		ps->msg_start = ps->s->s.len;
+		ps->msg_new = true;
+		msg_line = true;
+		l++;
+	}
+
+	char *c = strchr(l, '#');
+	if (c)
+		*c = '\0';
+
+	if (ps->dir < 0)
+		return 0;
+
+	/* the banner, written as text */
+	while (isspace((unsigned char)*l))
+		l++;
+	if (!strncmp(l, "+OK", 3) || !strncmp(l, "-NG", 3)) {
+		size_t len = strcspn(l, "\r\n");
+		while (len && isspace((unsigned char)l[len - 1]))
+			len--;
+		if (proto_add(ps, (uint8_t *)l, len) || proto_add(ps, (uint8_t *)"\r\n", 2))
+			return -1;
+		return 0;
+	}
+
+	for (save = NULL; n < 64 && (tok[n] = strtok_r(n ? NULL : l, " \t\r\n", &save)); n++)
+		;
+	if (!n)
+		return 0;
+
+	if (!strcmp(tok[0], "...")) {
+		ps->s->incomplete = true;
+		return 0;
+	}
+
+	bool dump = false;
+	if (strlen(tok[0]) >= 4 && all_hex(tok[0])) {
+		if (n > 1 && hex_byte(tok[1]) >= 0) {
+			/* a dump line: offset, up to 16 bytes, then ascii */
+			proto_seek(ps, strtoul(tok[0], NULL, 16));
+			dump = true;
+			max = 16;
+			i = 1;
+		} else if (n == 1 && strlen(tok[0]) % 2 == 0) {
+			/* an unbroken hex string */
+			const char *h = tok[0];
+			for (; *h; h += 2) {
+				uint8_t v = hexval(h[0]) << 4 | hexval(h[1]);
+				if (proto_add(ps, &v, 1))
+					return -1;
+			}
+			return 0;
+		} else {
+			/* prose where the message should be */
+			if (msg_line)
+				ps->s->incomplete = true;
+			return 0;
+		}
+	}
+
+	for (; i < n && ct < max; i++) {
+		int v = hex_byte(tok[i]);
+		if (v < 0)
+			break;
+		bytes[ct++] = v;
+	}
+
+	/* "1b 58 ..." leaves the rest out, and a message line with words on
+	 * it ("> lots of packets") says what was left out */
+	if (!dump && i < n && ((ct && !strncmp(tok[i], "...", 3)) || msg_line))
+		ps->s->incomplete = true;
+
+	return proto_add(ps, bytes, ct);
+}
+
+/* From an X request to the end of the page each message from the scanner
+ * should be whole records. Notes that lost some of one don't say so. */
+static bool proto_records_whole(const struct bro2_trace_sess *s)
+{
+	bool scanning = false;
+	size_t i;
+
+	for (i = 0; i < s->chunk_ct; i++) {
+		const struct bro2_trace_chunk *c = &s->chunks[i];
+		const uint8_t *d = s->data + c->off;
+		size_t pos = 0;
+
+		if (!c->from_scanner) {
+			if (c->len >= 2 && d[0] == 0x1b && d[1] == 'X')
+				scanning = true;
+			continue;
+		}
+
+		while (scanning && pos < c->len) {
+			switch (d[pos]) {
+			case BRO2_END_PAGE_MORE:
+				pos++;
+				continue;
+			case BRO2_END_PAGE:
+				pos++;
+				scanning = false;
+				continue;
+			case BRO2_END_NO_DOCS:
+				pos += 2;
+				scanning = false;
+				continue;
+			}
+			if (c->len - pos < 3
+					|| c->len - pos - 3 < (d[pos + 1] | d[pos + 2] << 8))
+				return false;
+			pos += 3 + (d[pos + 1] | d[pos + 2] << 8);
+		}
+
+		/* a terminator cut short, or bytes after the last one */
+		if (pos > c->len || (pos && pos < c->len))
+			return false;
+	}
+	return true;
+}
+
+static int load_proto(struct trace_build *b, FILE *f)
+{
+	struct proto_state ps = { .dir = -1 };
+	char line[1024];
+	size_t i;
+
+	while (fgets(line, sizeof(line), f))
+		if (proto_line(b, &ps, line))
+			return -1;
+
+	for (i = 0; i < b->sess_ct; i++)
+		if (!proto_records_whole(&b->sess[i].s))
+			b->sess[i].incomplete = true;
+	return 0;
+}
+
+/*
+ * pcap
+ */
+
+#define PCAP_MAGIC	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d
+
+enum {
+	LINK_NULL = 0,
+	LINK_ETHERNET = 1,
+	LINK_RAW = 101,
+	LINK_LINUX_SLL = 113,
+};
+
+struct pcap_seg {
+	bool from;
+	uint32_t seq;
+	uint8_t *data;
+	size_t len;
+};
+
+struct pcap_conn {
+	uint8_t addr[2][16];	/* client, scanner */
+	uint16_t client_port;
+	size_t sess_idx;
+	double t0;
+
+	bool have_seq[2];
+	uint32_t next_seq[2];	/* indexed by from_scanner */
+
+	/* segments that arrived ahead of a gap */
+	struct pcap_seg *held;
+	size_t held_ct, held_sz;
+};
+
+struct pcap_state {
+	struct trace_build *b;
+	bool swap, ns;
+	uint32_t link;
+	uint16_t port;
+
+	struct pcap_conn *conns;
+	size_t conn_ct, conn_sz;
+};
+
+static uint32_t get32(const uint8_t *p, bool swap)
+{
+	uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static struct pcap_conn *conn_find(struct pcap_state *st,
+		const uint8_t client[16], const uint8_t scanner[16],
+		uint16_t client_port, bool create, double t)
+{
+	size_t i;
+
+	/* newest first, a port may be reused */
+	for (i = st->conn_ct; i-- > 0;) {
+		struct pcap_conn *c = &st->conns[i];
+		if (!create && c->client_port == client_port
+				&& !memcmp(c->addr[0], client, 16)
+				&& !memcmp(c->addr[1], scanner, 16))
+			return c;
+	}
+
+	if (st->conn_ct == st->conn_sz) {
+		size_t sz = st->conn_sz ? st->conn_sz * 2 : 8;
+		struct pcap_conn *c = realloc(st->conns, sz * sizeof(*c));
+		if (!c)
+			return NULL;
+		st->conns = c;
+		st->conn_sz = sz;
+	}
+
+	struct pcap_conn *c = &st->conns[st->conn_ct++];
+	*c = (typeof(*c)) {
+		.client_port = client_port,
+		.sess_idx = st->b->sess_ct,
+		.t0 = t,
+	};
+	memcpy(c->addr[0], client, 16);
+	memcpy(c->addr[1], scanner, 16);
+	if (!sess_new(st->b))
+		return NULL;
+	return c;
+}
+
+/* Append in sequence order, trimming what was already seen */
+static int conn_data(struct pcap_conn *c, struct sess_build *s, bool from,
+		uint32_t seq, double t, const uint8_t *d, size_t len)
+{
+	int32_t rel = seq - c->next_seq[from];
+
+	if (rel > 0) {
+		if (c->held_ct == c->held_sz) {
+			size_t sz = c->held_sz ? c->held_sz * 2 : 8;
+			struct pcap_seg *h = realloc(c->held, sz * sizeof(*h));
+			if (!h)
+				return -1;
+			c->held = h;
+			c->held_sz = sz;
+		}
+		struct pcap_seg *h = &c->held[c->held_ct];
+		h->data = malloc(len);
+		if (!h->data)
+			return -1;
+		memcpy(h->data, d, len);
+		h->from = from;
+		h->seq = seq;
+		h->len = len;
+		c->held_ct++;
+		return 0;
+	}
+
+	if ((size_t)-rel >= len)
+		return 0;
+	d += -rel;
+	len -= -rel;
+
+	if (sess_append(&s->s, from, t - c->t0, d, len, true))
+		return -1;
+	c->next_seq[from] += len;
+	return 0;
+}
+
+static int conn_segment(struct pcap_state *st, struct pcap_conn *c, bool from,
+		uint32_t seq, double t, const uint8_t *d, size_t len)
+{
+	struct sess_build *s = &st->b->sess[c->sess_idx];
+	size_t i;
+
+	if (!c->have_seq[from]) {
+		c->have_seq[from] = true;
+		c->next_seq[from] = seq;
+	}
+
+	if (conn_data(c, s, from, seq, t, d, len))
+		return -1;
+
+	/* see if the gap has been filled, what was held is only available
+	 * from now */
+	for (i = 0; i < c->held_ct;) {
+		struct pcap_seg h = c->held[i];
+		if (h.from != from || (int32_t)(h.seq - c->next_seq[from]) > 0) {
+			i++;
+			continue;
+		}
+		c->held[i] = c->held[--c->held_ct];
+		if (conn_data(c, s, from, h.seq, t, h.data, h.len)) {
+			free(h.data);
+			return -1;
+		}
+		free(h.data);
+		i = 0;
+	}
+	return 0;
+}
+
+static int pcap_packet(struct pcap_state *st, double t, const uint8_t *p,
+		size_t caplen)
+{
+	const uint8_t *end = p + caplen;
+	uint8_t src[16] = { 0 }, dst[16] = { 0 };
+	unsigned ethertype;
+
+	switch (st->link) {
+	case LINK_NULL:
+		if (caplen < 4)
+			return 0;
+		/* the family is in the capturing host's byte order */
+		ethertype = get32(p, st->swap) == 2 ? 0x0800 : 0x86dd;
+		p += 4;
+		break;
+	case LINK_ETHERNET:
+		if (caplen < 14)
+			return 0;
+		ethertype = be16(p + 12);
+		p += 14;
+		if (ethertype == 0x8100 && end - p >= 4) {
+			ethertype = be16(p + 2);
+			p += 4;
+		}
+		break;
+	case LINK_LINUX_SLL:
+		if (caplen < 16)
+			return 0;
+		ethertype = be16(p + 14);
+		p += 16;
+		break;
+	default:
+		if (caplen < 1)
+			return 0;
+		ethertype = (p[0] >> 4) == 4 ? 0x0800 : 0x86dd;
+		break;
+	}
+
+	size_t ip_len, hdr;
+	if (ethertype == 0x0800) {
+		if (end - p < 20 || p[9] != 6 || (be16(p + 6) & 0x3fff))
+			return 0;
+		hdr = (p[0] & 0xf) * 4;
+		ip_len = be16(p + 2);
+		memcpy(src + 12, p + 12, 4);
+		memcpy(dst + 12, p + 16, 4);
+	} else if (ethertype == 0x86dd) {
+		if (end - p < 40 || p[6] != 6)
+			return 0;
+		hdr = 40;
+		ip_len = 40 + be16(p + 4);
+		memcpy(src, p + 8, 16);
+		memcpy(dst, p + 24, 16);
+	} else {
+		return 0;
+	}
+
+	if (ip_len < hdr + 20 || (size_t)(end - p) < hdr + 20)
+		return 0;
+	const uint8_t *tcp = p + hdr;
+	uint16_t sport = be16(tcp), dport = be16(tcp + 2);
+	uint32_t seq = be32(tcp + 4);
+	size_t tcp_hdr = (tcp[12] >> 4) * 4;
+	uint8_t flags = tcp[13];
+	bool from;
+
+	if (sport == st->port)
+		from = true;
+	else if (dport == st->port)
+		from = false;
+	else
+		return 0;
+
+	if (ip_len < hdr + tcp_hdr)
+		return 0;
+	const uint8_t *d = tcp + tcp_hdr;
+	size_t len = ip_len - hdr - tcp_hdr;
+
+	bool syn = (flags & 0x02) && !(flags & 0x10);
+	struct pcap_conn *c = conn_find(st, from ? dst : src, from ? src : dst,
+			from ? dport : sport, syn && !from, t);
+	if (!c)
+		return -1;
+
+	if (flags & 0x02) {
+		c->have_seq[from] = true;
+		c->next_seq[from] = seq + 1;
+		return 0;
+	}
+
+	if (!len)
+		return 0;
+	if (d > end || (size_t)(end - d) < len) {
+		/* cut short by the snaplen */
+		st->b->sess[c->sess_idx].incomplete = true;
+		return 0;
+	}
+
+	return conn_segment(st, c, from, seq, t, d, len);
+}
+
+static int load_pcap(struct trace_build *b, FILE *f)
+{
+	struct pcap_state st = { .b = b, .port = strtoul(BRO2_PORT_STR, NULL, 10) };
+	uint8_t hdr[24], rec[16], *pkt = NULL;
+	size_t pkt_sz = 0, i, j;
+	int r = -1;
+
+	if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+		return -1;
+
+	uint32_t magic = get32(hdr, false);
+	st.swap = magic == __builtin_bswap32(PCAP_MAGIC)
+		|| magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	magic = get32(hdr, st.swap);
+	st.ns = magic == PCAP_MAGIC_NS;
+	st.link = get32(hdr + 20, st.swap) & 0xffff;
+
+	if (st.link != LINK_NULL && st.link != LINK_ETHERNET
+			&& st.link != LINK_RAW && st.link != LINK_LINUX_SLL) {
+		fprintf(stderr, "%s: unsupported link type %u\n", b->path, st.link);
+		return -1;
+	}
+
+	while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+		double t = get32(rec, st.swap)
+			+ get32(rec + 4, st.swap) / (st.ns ? 1e9 : 1e6);
+		size_t caplen = get32(rec + 8, st.swap);
+
+		if (caplen > pkt_sz) {
+			uint8_t *np = realloc(pkt, caplen);
+			if (!np)
+				goto out;
+			pkt = np;
+			pkt_sz = caplen;
+		}
+		if (fread(pkt, 1, caplen, f) != caplen)
+			break;
+		if (pcap_packet(&st, t, pkt, caplen))
+			goto out;
+	}
+	r = 0;
+
+out:
+	for (i = 0; i < st.conn_ct; i++) {
+		struct pcap_conn *c = &st.conns[i];
+		if (c->held_ct)
+			b->sess[c->sess_idx].incomplete = true;
+		for (j = 0; j < c->held_ct; j++)
+			free(c->held[j].data);
+		free(c->held);
+	}
+	free(st.conns);
+	free(pkt);
+	return r;
+}
+
+int bro2_trace_load(struct bro2_trace *t, const char *path)
+{
+	struct trace_build b = { .path = path };
+	uint8_t magic[4];
+	int r;
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(magic, 1, 4, f) == 4) {
+		uint32_t m = get32(magic, false);
+		rewind(f);
+		if (m == PCAP_MAGIC || m == PCAP_MAGIC_NS
+				|| m == __builtin_bswap32(PCAP_MAGIC)
+				|| m == __builtin_bswap32(PCAP_MAGIC_NS))
+			r = load_pcap(&b, f);
+		else
+			r = load_proto(&b, f);
+	} else {
+		r = -1;
+	}
+	fclose(f);
+
+	if (r) {
+		size_t i;
+		fprintf(stderr, "%s: could not load trace\n", path);
+		for (i = 0; i < b.sess_ct; i++)
+			sess_free(&b.sess[i].s);
+		free(b.sess);
+		return -1;
+	}
+
+	return trace_finish(t, &b);
+}
+
+void bro2_trace_free(struct bro2_trace *t)
+{
+	size_t i;
+	for (i = 0; i < t->sess_ct; i++)
+		sess_free(&t->sess[i]);
+	free(t->sess);
+	t->sess = NULL;
+	t->sess_ct = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef BRO2_TRACE_H_
+#define BRO2_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Recorded scanner sessions, for the emulator to play back.
+ *
+ * Two kinds of file are understood:
+ *
+ *  - PROTO style notes. "-----" starts a session, a line starting with '>'
+ *    (from the scanner) or '<' (to it) starts a message, and the message is
+ *    made up of the hex that follows: wireshark style dumps ("0010   1b 58
+ *    ..." with the offset giving the position in the message), runs of hex
+ *    bytes or "\x80" escapes, unbroken hex strings, or a "+OK 200" banner.
+ *    '#' starts a comment and anything else is taken as commentary. A
+ *    session with data left out can't be played back and is dropped: one
+ *    with "...", words on a '>' or '<' line ("> lots of packets"), or scan
+ *    data that isn't whole records in each message.
+ *
+ *  - pcap files. Every TCP connection to BRO2_PORT_STR is a session, with
+ *    the capture timestamps kept for each segment.
+ */
+
+struct bro2_trace_chunk {
+	bool from_scanner;
+	double t;		/* seconds into the session */
+	size_t off, len;	/* in the session's data */
+};
+
+struct bro2_trace_sess {
+	uint8_t *data;
+	size_t len, sz;
+
+	struct bro2_trace_chunk *chunks;
+	size_t chunk_ct, chunk_sz;
+};
+
+struct bro2_trace {
+	struct bro2_trace_sess *sess;
+	size_t sess_ct;
+};
+
+/* Returns -1 if the file can't be read or has no complete sessions */
+int bro2_trace_load(struct bro2_trace *t, const char *path);
+void bro2_trace_free(struct bro2_trace *t);
+
+#endif
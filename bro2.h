@@ -35,6 +35,7 @@ static const char *bro2_modes[] = {
 #define BRO2_MSG_I_MAX_X 4 /* XXX: correctness of name is questionable */
 #define BRO2_MSG_I_UNK2 5
 #define BRO2_MSG_I_MAX_Y 6 /* XXX: correctness of name is questionable */
+#define BRO2_MSG_I_CT    7
 
 /* Extremely pesimistic line length maximum */
 #define BRO2_MAX_LINE_SZ     ((1 << 16) - 1)
@@ -46,5 +47,11 @@ static const char *bro2_modes[] = {
 #define BRO2_LINE_TYPE_RED   0x44
 #define BRO2_LINE_TYPE_GREEN 0x48
 #define BRO2_LINE_TYPE_BLUE  0x4c
+#define BRO2_LINE_TYPE_C256  0x5c /* palette indices */
+
+/* Scan terminators, a single byte unless noted */
+#define BRO2_END_PAGE      0x80
+#define BRO2_END_PAGE_MORE 0x81 /* another page is waiting */
+#define BRO2_END_NO_DOCS   0xc2 /* followed by 0x00, there is nothing to scan */
 
 #endif
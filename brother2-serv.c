@@ -2,12 +2,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <ctype.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <sys/resource.h>
+
 #include <ev.h>
 
 #include <ccan/net/net.h>
@@ -16,17 +19,85 @@
 #include "penny/print.h"
 
 #include "bro2.h"
+#include "bro2-farm.h"
+#include "bro2-gen.h"
+#include "bro2-trace.h"
 
 #define peer_err(peer, fmt, ...) fprintf(stderr, fmt ##, __VA_ARGS__)
 
+/* chatter about every packet, off in load test mode */
+static bool verbose = true;
+#define vlog(...) do { if (verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/* One emulated scanner: a port (each of its bound addresses gets a listener)
+ * and the clients currently connected to it */
+struct vscanner {
+	ev_io listen[2];
+	int listen_ct;
+	unsigned port;
+	unsigned peer_ct;
+};
+
+/* clients allowed on a single vscanner at once, 0 for no limit */
+static unsigned max_peers = 1;
+
+/* pages per batch (0 for an empty feeder), where page content comes from
+ * (NULL for a synthetic page), and the bytes/sec each client gets (0 for as
+ * fast as it'll take them) */
+static unsigned batch_pages = 1;
+static struct bro2_gen_img *page_src;
+static double tx_rate;
+
+/* Play back recorded sessions instead, each client getting the next one.
+ * Optionally keeping the recorded gaps between what the scanner sent. */
+static struct bro2_trace replay;
+static size_t replay_next;
+static bool replay_timed;
+
+static struct {
+	unsigned peers;
+	unsigned long accepted, refused, msgs, pages;
+	unsigned long long tx, tx_last;
+} stats;
+
+/* generate scan data in pieces of about this size */
+#define PEER_OUT_CHUNK (64 * 1024)
+
 struct peer {
 	ev_io w; /* I'm lazy & require this to be the first member */
+	struct vscanner *vs;
 	struct sockaddr_storage addr;
 	socklen_t addr_len;
-	uint8_t buf[128];
+	uint8_t buf[256];
 	size_t pos;
+
+	/* replies and scan data not yet sent */
+	ev_io ww;
+	uint8_t *out;
+	size_t out_sz, out_pos, out_len;
+
+	/* the page being sent, and how many of the batch are left after it */
+	struct bro2_gen gen;
+	bool scanning;
+	unsigned pages_left;
+
+	/* throughput cap */
+	ev_timer throttle;
+	double tokens;
+	ev_tstamp tokens_at;
+
+	/* the recorded session being played back: the chunk we're at, how far
+	 * into it, and when the one before it was finished */
+	const struct bro2_trace_sess *rs;
+	size_t rs_idx, rs_chunk, rs_pos;
+	ev_tstamp rs_at;
+	ev_timer rs_wait;
+	bool rs_diverged;
 };
 
+#define peer_of(ptr, member) \
+	((struct peer *)((char *)(ptr) - offsetof(struct peer, member)))
+
 static void peer_scan_buf_for_start_byte(struct peer *p)
 {
 	size_t i;
@@ -40,6 +111,7 @@ static void peer_scan_buf_for_start_byte(struct peer *p)
 	}
 
 	memmove(p->buf, &p->buf[i], p->pos - i);
+	p->pos -= i;
 }
 
 static ssize_t peer_scan_buf_for_end_byte(struct peer *p)
@@ -74,46 +146,417 @@ static uint8_t *tokenize_packet(uint8_t **pos)
 }
 
 
-static int peer_parse_msg(struct peer *peer)
+static int peer_out_reserve(struct peer *peer, size_t len)
+{
+	if (peer->out_pos) {
+		memmove(peer->out, peer->out + peer->out_pos,
+				peer->out_len - peer->out_pos);
+		peer->out_len -= peer->out_pos;
+		peer->out_pos = 0;
+	}
+
+	if (peer->out_len + len > peer->out_sz) {
+		size_t sz = peer->out_len + len;
+		uint8_t *out = realloc(peer->out, sz);
+		if (!out)
+			return -1;
+		peer->out = out;
+		peer->out_sz = sz;
+	}
+	return 0;
+}
+
+/* There's something to write. While throttled that waits for the timer,
+ * which starts ww itself. */
+static void peer_wake(EV_P_ struct peer *peer)
+{
+	if (!ev_is_active(&peer->throttle))
+		ev_io_start(EV_A_ &peer->ww);
+}
+
+static int peer_send(EV_P_ struct peer *peer, const void *data, size_t len)
+{
+	if (peer_out_reserve(peer, len))
+		return -1;
+	memcpy(peer->out + peer->out_len, data, len);
+	peer->out_len += len;
+	peer_wake(EV_A_ peer);
+	return 0;
+}
+
+static void peer_scan_stop(struct peer *peer)
+{
+	bro2_gen_free(&peer->gen);
+	peer->scanning = false;
+}
+
+/* Queue up the next lines of the page. The rest of a batch follows on the
+ * same connection, each page ended with "another page waiting" but the
+ * last. */
+static int peer_scan_gen(struct peer *peer)
+{
+	while (peer->scanning && peer->out_len - peer->out_pos < PEER_OUT_CHUNK) {
+		if (peer_out_reserve(peer, bro2_gen_line_max(&peer->gen) + 1))
+			return -1;
+
+		size_t n = bro2_gen_line(&peer->gen, peer->out + peer->out_len);
+		if (n) {
+			peer->out_len += n;
+			continue;
+		}
+
+		stats.pages++;
+		if (peer->pages_left) {
+			peer->pages_left--;
+			peer->out[peer->out_len++] = BRO2_END_PAGE_MORE;
+			bro2_gen_rewind(&peer->gen);
+		} else {
+			peer->out[peer->out_len++] = BRO2_END_PAGE;
+			peer_scan_stop(peer);
+		}
+	}
+	return 0;
+}
+
+/* Queue what the scanner sent, up to where it waits on the client (or,
+ * when timed, until the recording says it's time for the next chunk) */
+static int peer_replay_fill(EV_P_ struct peer *peer)
+{
+	const struct bro2_trace_sess *rs = peer->rs;
+
+	while (peer->rs_chunk < rs->chunk_ct
+			&& peer->out_len - peer->out_pos < PEER_OUT_CHUNK) {
+		const struct bro2_trace_chunk *c = &rs->chunks[peer->rs_chunk];
+		if (!c->from_scanner)
+			break;
+
+		if (replay_timed && !peer->rs_pos && peer->rs_chunk) {
+			double gap = c->t - rs->chunks[peer->rs_chunk - 1].t;
+			ev_tstamp due = peer->rs_at + (gap > 0 ? gap : 0);
+			if (due > ev_now(EV_A)) {
+				if (!ev_is_active(&peer->rs_wait)) {
+					ev_timer_set(&peer->rs_wait, due - ev_now(EV_A), 0);
+					ev_timer_start(EV_A_ &peer->rs_wait);
+				}
+				break;
+			}
+		}
+
+		size_t n = c->len - peer->rs_pos;
+		if (n > PEER_OUT_CHUNK)
+			n = PEER_OUT_CHUNK;
+		if (peer_out_reserve(peer, n))
+			return -1;
+		memcpy(peer->out + peer->out_len, rs->data + c->off + peer->rs_pos, n);
+		peer->out_len += n;
+		peer->rs_pos += n;
+
+		if (peer->rs_pos == c->len) {
+			peer->rs_chunk++;
+			peer->rs_pos = 0;
+			peer->rs_at = ev_now(EV_A);
+			/* may have stopped reading while this went out */
+			ev_io_start(EV_A_ &peer->w);
+		}
+	}
+
+	return 0;
+}
+
+/* Match what the client sent against the recording */
+static void peer_replay_input(EV_P_ struct peer *peer)
+{
+	const struct bro2_trace_sess *rs = peer->rs;
+	size_t used = 0;
+
+	while (used < peer->pos && peer->rs_chunk < rs->chunk_ct) {
+		const struct bro2_trace_chunk *c = &rs->chunks[peer->rs_chunk];
+		if (c->from_scanner)
+			break;
+
+		size_t n = c->len - peer->rs_pos;
+		if (n > peer->pos - used)
+			n = peer->pos - used;
+
+		if (!peer->rs_diverged && memcmp(peer->buf + used,
+					rs->data + c->off + peer->rs_pos, n)) {
+			fprintf(stderr, "session %zu: client differs from the recording in chunk %zu\n",
+					peer->rs_idx, peer->rs_chunk);
+			peer->rs_diverged = true;
+		}
+
+		used += n;
+		peer->rs_pos += n;
+		if (peer->rs_pos == c->len) {
+			peer->rs_chunk++;
+			peer->rs_pos = 0;
+			peer->rs_at = ev_now(EV_A);
+		}
+	}
+
+	/* nothing more is expected from the client once it's over */
+	if (peer->rs_chunk == rs->chunk_ct)
+		used = peer->pos;
+
+	memmove(peer->buf, peer->buf + used, peer->pos - used);
+	peer->pos -= used;
+
+	/* the client is ahead of the recording, wait for it to catch up */
+	if (peer->pos == sizeof(peer->buf))
+		ev_io_stop(EV_A_ &peer->w);
+
+	peer_wake(EV_A_ peer);
+}
+
+static void peer_replay_wait_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct peer *peer = peer_of(w, rs_wait);
+	peer_wake(EV_A_ peer);
+}
+
+struct peer_req {
+	unsigned res[2];
+	const char *mode, *compress;
+	unsigned area[4];
+	bool have_area;
+};
+
+static void peer_parse_field(struct peer_req *rq, char *elem)
+{
+	if (elem[0] == '\0' || elem[1] != '=')
+		return;
+
+	char *v = elem + 2;
+	switch (elem[0]) {
+	case 'R':
+		sscanf(v, "%u,%u", &rq->res[0], &rq->res[1]);
+		break;
+	case 'M':
+		rq->mode = v;
+		break;
+	case 'C':
+		rq->compress = v;
+		break;
+	case 'A':
+		rq->have_area = sscanf(v, "%u,%u,%u,%u", &rq->area[0],
+				&rq->area[1], &rq->area[2], &rq->area[3]) == 4;
+		break;
+	}
+}
+
+/* 2 byte little endian length, then the numbers */
+static int peer_reply_I(EV_P_ struct peer *peer, struct peer_req *rq)
+{
+	int nums[BRO2_MSG_I_CT];
+	char buf[128];
+
+	bro2_gen_info(&rq->res[0], &rq->res[1], nums);
+	int l = snprintf(buf + 2, sizeof(buf) - 2, "%d,%d,%d,%d,%d,%d,%d",
+			nums[0], nums[1], nums[2], nums[3], nums[4], nums[5],
+			nums[6]);
+	buf[0] = l & 0xff;
+	buf[1] = l >> 8;
+	vlog("\tI reply: %s\n", buf + 2);
+	return peer_send(EV_A_ peer, buf, l + 2);
+}
+
+/* 2 byte little endian length, then the palette */
+static int peer_reply_P(EV_P_ struct peer *peer)
+{
+	uint8_t buf[2 + BRO2_GEN_PALETTE_SZ];
+
+	buf[0] = BRO2_GEN_PALETTE_SZ & 0xff;
+	buf[1] = BRO2_GEN_PALETTE_SZ >> 8;
+	bro2_gen_palette(buf + 2);
+	vlog("\tP reply: %d bytes\n", BRO2_GEN_PALETTE_SZ);
+	return peer_send(EV_A_ peer, buf, sizeof(buf));
+}
+
+static int peer_start_X(EV_P_ struct peer *peer, struct peer_req *rq)
+{
+	if (!batch_pages) {
+		static const uint8_t no_docs[] = { BRO2_END_NO_DOCS, 0x00 };
+		vlog("\tX: no documents\n");
+		return peer_send(EV_A_ peer, no_docs, sizeof(no_docs));
+	}
+
+	if (!rq->have_area) {
+		int nums[BRO2_MSG_I_CT];
+		unsigned xr = rq->res[0], yr = rq->res[1];
+		bro2_gen_info(&xr, &yr, nums);
+		rq->area[0] = rq->area[1] = 0;
+		rq->area[2] = nums[BRO2_MSG_I_MAX_X];
+		rq->area[3] = nums[BRO2_MSG_I_MAX_Y];
+	}
+
+	peer_scan_stop(peer);
+	if (bro2_gen_start(&peer->gen, page_src, rq->mode, rq->compress,
+				rq->res[0], rq->res[1], rq->area))
+		return -1;
+
+	vlog("\tX: %ux%u %s %s, %ux%u px, %u pages\n",
+			peer->gen.x_res, peer->gen.y_res, rq->mode, rq->compress,
+			peer->gen.w, peer->gen.h, batch_pages);
+	peer->pages_left = batch_pages - 1;
+	peer->scanning = true;
+	peer_wake(EV_A_ peer);
+	return 0;
+}
+
+static int peer_parse_msg(EV_P_ struct peer *peer)
 {
 	uint8_t *data = peer->buf + 1;
 	uint8_t *pkt_type = tokenize_packet(&data);
 	uint8_t *elem;
-	if (strlen((char *)pkt_type) != 1) {
-		fprintf(stderr, "\tpacket type is not len 1: \"%s\"", pkt_type);
+	struct peer_req rq = {
+		.res = { 300, 300 },
+		.mode = "CGRAY",
+		.compress = "NONE",
+	};
+
+	if (!pkt_type || strlen((char *)pkt_type) != 1) {
+		fprintf(stderr, "\tpacket type is not len 1: \"%s\"",
+				pkt_type ? (char *)pkt_type : "");
 		return -1;
 	}
 
-	fprintf(stderr, "\tpacket type = %c\n", *pkt_type);
+	vlog("\tpacket type = %c\n", *pkt_type);
+	stats.msgs++;
 
 	while ((elem = tokenize_packet(&data))) {
-		fprintf(stderr, "\t\telem = %s\n", elem);
+		vlog("\t\telem = %s\n", elem);
+		peer_parse_field(&rq, (char *)elem);
+	}
+
+	switch (*pkt_type) {
+	case 'I':
+		return peer_reply_I(EV_A_ peer, &rq);
+	case 'P':
+		return peer_reply_P(EV_A_ peer);
+	case 'X':
+		return peer_start_X(EV_A_ peer, &rq);
+	case 'R':
+		/* cancel, there is no reply */
+		peer_scan_stop(peer);
+		peer->out_pos = peer->out_len = 0;
+		return 0;
 	}
 
 	return 0;
 }
 
+static void peer_close(EV_P_ struct peer *peer)
+{
+	peer->vs->peer_ct--;
+	stats.peers--;
+	ev_io_stop(EV_A_ &peer->w);
+	ev_io_stop(EV_A_ &peer->ww);
+	ev_timer_stop(EV_A_ &peer->throttle);
+	ev_timer_stop(EV_A_ &peer->rs_wait);
+	close(peer->w.fd);
+	peer_scan_stop(peer);
+	free(peer->out);
+	free(peer);
+}
+
+/* How much may be sent now. Refills at tx_rate, in quanta big enough that
+ * thousands of throttled clients don't mean thousands of wakeups per ms. */
+static size_t peer_tx_allowed(EV_P_ struct peer *peer, size_t want)
+{
+	double quantum = tx_rate / 100 > 1460 ? tx_rate / 100 : 1460;
+	ev_tstamp now = ev_now(EV_A);
+
+	peer->tokens += (now - peer->tokens_at) * tx_rate;
+	peer->tokens_at = now;
+	if (peer->tokens > quantum * 4)
+		peer->tokens = quantum * 4;
+
+	if (peer->tokens >= 1)
+		return want < peer->tokens ? want : (size_t)peer->tokens;
+
+	/* already waiting, a watcher mustn't be set while it's active */
+	ev_io_stop(EV_A_ &peer->ww);
+	if (ev_is_active(&peer->throttle))
+		return 0;
+	ev_timer_set(&peer->throttle, (quantum - peer->tokens) / tx_rate, 0);
+	ev_timer_start(EV_A_ &peer->throttle);
+	return 0;
+}
+
+static void peer_throttle_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct peer *peer = peer_of(w, throttle);
+	ev_io_start(EV_A_ &peer->ww);
+}
+
+static void peer_write_cb(EV_P_ ev_io *w, int revents)
+{
+	struct peer *peer = peer_of(w, ww);
+
+	for (;;) {
+		if (peer->out_pos == peer->out_len) {
+			peer->out_pos = peer->out_len = 0;
+			if (peer->rs ? peer_replay_fill(EV_A_ peer)
+					: peer_scan_gen(peer))
+				goto close_con;
+			if (!peer->out_len) {
+				ev_io_stop(EV_A_ w);
+				return;
+			}
+		}
+
+		size_t n = peer->out_len - peer->out_pos;
+		if (tx_rate) {
+			n = peer_tx_allowed(EV_A_ peer, n);
+			if (!n)
+				return;
+		}
+
+		ssize_t r = write(w->fd, peer->out + peer->out_pos, n);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			vlog("\terror in write: %s\n", strerror(errno));
+			goto close_con;
+		}
+
+		peer->out_pos += r;
+		peer->tokens -= r;
+		stats.tx += r;
+	}
+
+close_con:
+	peer_close(EV_A_ peer);
+}
 
-static int peer_ct;
 static void peer_cb(EV_P_ ev_io *w, int revents)
 {
-	fprintf(stderr, "PEER EVENT\n");
+	vlog("PEER EVENT\n");
 	struct peer *peer = (struct peer *)w;
 	ssize_t r = read(w->fd, peer->buf + peer->pos, sizeof(peer->buf) - peer->pos);
 	if (r == 0) {
-		fprintf(stderr, "\tdisconnected.\n");
+		vlog("\tdisconnected.\n");
 		goto close_con;
 	} else if (r < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
 		fprintf(stderr, "\tunknown error in read: %zd %s\n", r, strerror(errno));
 		goto close_con;
 	}
 
-	fprintf(stderr,   "\treceived      : ");
-	print_bytes_as_cstring(peer->buf + peer->pos, r, stderr);
 	peer->pos += r;
-	fprintf(stderr, "\n\tpeer buffer is: ");
-	print_bytes_as_cstring(peer->buf, peer->pos, stderr);
-	putc('\n', stderr);
+	if (verbose) {
+		fprintf(stderr,   "\treceived      : ");
+		print_bytes_as_cstring(peer->buf + peer->pos - r, r, stderr);
+		fprintf(stderr, "\n\tpeer buffer is: ");
+		print_bytes_as_cstring(peer->buf, peer->pos, stderr);
+		putc('\n', stderr);
+	}
+
+	if (peer->rs) {
+		peer_replay_input(EV_A_ peer);
+		return;
+	}
 
 repeat_msg:
 	peer_scan_buf_for_start_byte(peer);
@@ -121,21 +564,23 @@ repeat_msg:
 		ssize_t p = peer_scan_buf_for_end_byte(peer);
 		if (p > 0) {
 			/* we have a complete message */
-			r = peer_parse_msg(peer);
+			r = peer_parse_msg(EV_A_ peer);
 			if (r < 0)
 				goto close_con;
 			else {
 				memmove(peer->buf, peer->buf + p + 1, peer->pos - p - 1);
 				peer->pos -= p + 1;
-				fprintf(stderr, "\tpeer buffer is: ");
-				print_bytes_as_cstring(peer->buf, peer->pos, stderr);
-				putc('\n', stderr);
+				if (verbose) {
+					fprintf(stderr, "\tpeer buffer is: ");
+					print_bytes_as_cstring(peer->buf, peer->pos, stderr);
+					putc('\n', stderr);
+				}
 				goto repeat_msg;
 			}
 
 		} else {
 			/* not complete, check if we have more room */
-			fprintf(stderr, "\tMessage not complete.\n");
+			vlog("\tMessage not complete.\n");
 			if (sizeof(peer->buf) == peer->pos) {
 				fprintf(stderr, "\tran out of buffer space.\n");
 				goto close_con;
@@ -144,33 +589,58 @@ repeat_msg:
 	}
 	return;
 close_con:
-	peer_ct --;
-	ev_io_stop(EV_A_ w);
-	close(w->fd);
-	free(peer);
+	peer_close(EV_A_ peer);
+}
+
+/* Out of fds or memory: stop accepting for a moment rather than spin on the
+ * pending connections, and let some clients go away. */
+static ev_timer accept_pause;
+static struct vscanner *vscanners;
+static size_t vscanner_ct;
+
+static void accept_set(EV_P_ bool on)
+{
+	size_t i;
+	int j;
+	for (i = 0; i < vscanner_ct; i++)
+		for (j = 0; j < vscanners[i].listen_ct; j++) {
+			if (on)
+				ev_io_start(EV_A_ &vscanners[i].listen[j]);
+			else
+				ev_io_stop(EV_A_ &vscanners[i].listen[j]);
+		}
+}
+
+static void accept_resume_cb(EV_P_ ev_timer *w, int revents)
+{
+	accept_set(EV_A_ true);
 }
 
 static struct peer *accept_peer;
 static void accept_cb(EV_P_ ev_io *w, int revents)
 {
+	struct vscanner *vs = w->data;
+
 	for(;;) {
 		if (!accept_peer) {
-			accept_peer = malloc(sizeof(*accept_peer));
-			memset(accept_peer, 0, sizeof(*accept_peer));
-			accept_peer->addr_len = sizeof(accept_peer->addr);
+			accept_peer = calloc(1, sizeof(*accept_peer));
+			if (!accept_peer)
+				goto pause;
 		}
+		accept_peer->addr_len = sizeof(accept_peer->addr);
 
 		int fd = accept(w->fd, (struct sockaddr *)&accept_peer->addr,
 				&accept_peer->addr_len);
 		if (fd == -1) {
 			switch (errno) {
-			case EBADF:
-			case ENOTSOCK:
-			case EINVAL:
 			case EMFILE:
 			case ENFILE:
 			case ENOBUFS:
 			case ENOMEM:
+				goto pause;
+			case EBADF:
+			case ENOTSOCK:
+			case EINVAL:
 			case EPROTO:
 			default:
 				/* DIE A HORRIBLE DEATH */
@@ -185,71 +655,258 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 			}
 		}
 
-		if (peer_ct == 0) {
-			peer_ct ++;
-			write(fd, "+OK 200\r\n", 9);
+		if (!max_peers || vs->peer_ct < max_peers) {
+			vs->peer_ct++;
+			stats.peers++;
+			stats.accepted++;
+			fd_set_nonblock(fd);
+			accept_peer->vs = vs;
+			accept_peer->tokens_at = ev_now(EV_A);
 			ev_io_init(&accept_peer->w, peer_cb, fd, EV_READ);
+			ev_io_init(&accept_peer->ww, peer_write_cb, fd, EV_WRITE);
+			ev_init(&accept_peer->throttle, peer_throttle_cb);
+			ev_init(&accept_peer->rs_wait, peer_replay_wait_cb);
 			ev_io_start(EV_A_ &accept_peer->w);
+
+			if (replay.sess_ct) {
+				/* the recording has the banner */
+				accept_peer->rs_idx = replay_next;
+				accept_peer->rs = &replay.sess[replay_next];
+				accept_peer->rs_at = ev_now(EV_A);
+				replay_next = (replay_next + 1) % replay.sess_ct;
+				ev_io_start(EV_A_ &accept_peer->ww);
+			} else {
+				write(fd, "+OK 200\r\n", 9);
+			}
 			accept_peer = NULL;
 		} else {
+			stats.refused++;
 			write(fd, "-NG 401\r\n", 9);
 			close(fd);
 		}
 	}
+
+pause:
+	fprintf(stderr, "can't take more clients right now: %s\n", strerror(errno));
+	accept_set(EV_A_ false);
+	ev_timer_start(EV_A_ &accept_pause);
 }
 
-int main(int argc, char **argv)
+static void stats_cb(EV_P_ ev_timer *w, int revents)
 {
-	const char *bind_addr = NULL, *port = BRO2_PORT_STR;
-	int opt;
+	fprintf(stderr, "peers %u accepted %lu refused %lu msgs %lu pages %lu tx %.2f MB/s\n",
+			stats.peers, stats.accepted, stats.refused, stats.msgs,
+			stats.pages, (stats.tx - stats.tx_last) / 1e6);
+	stats.tx_last = stats.tx;
+}
 
-	while ((opt = getopt(argc, argv, "a:p:")) != -1) {
-		switch (opt) {
-		case 'a':
-			bind_addr = optarg;
-			break;
-		case 'p':
-			port = optarg;
-			break;
-		default: /* '?' */
-			fprintf(stderr, "usage: %s [-a bind_addr] [-p bind_port]\n",
-					argv[0]);
-			return 1;
-		}
+/* "54921" or "54921-55020" */
+static int parse_ports(const char *s, unsigned *first, unsigned *last)
+{
+	char *end;
+	unsigned long a = strtoul(s, &end, 10), b = a;
+	if (end == s)
+		return -1;
+	if (*end == '-') {
+		const char *t = end + 1;
+		b = strtoul(t, &end, 10);
+		if (end == t)
+			return -1;
 	}
+	if (*end || !a || a > b || b > 65535)
+		return -1;
+	*first = a;
+	*last = b;
+	return 0;
+}
+
+static int vscanner_bind(struct vscanner *vs, const char *bind_addr)
+{
+	char port[8];
+	int fds[2], i;
 
+	snprintf(port, sizeof(port), "%u", vs->port);
 	struct addrinfo *addr = net_server_lookup_(bind_addr, port, AF_UNSPEC, SOCK_STREAM);
 	if (!addr) {
 		fprintf(stderr, "could not resolve %s\n", bind_addr);
-		return 1;
+		return -1;
 	}
 
-	int fds[2];
 	int num_fds = net_bind(addr, fds);
+	freeaddrinfo(addr);
 	if (num_fds < 0) {
 		fprintf(stderr, "could not bind to addr %s, port %s: %s\n", bind_addr, port, strerror(errno));
-		return 1;
+		return -1;
 	}
 
-	freeaddrinfo(addr);
-
-	int i;
-	ev_io accept_listener[2];
 	for (i = 0; i < num_fds; i++) {
-		int r = listen(fds[i], 128);
+		int r = listen(fds[i], SOMAXCONN);
 		if (r == -1) {
 			fprintf(stderr, "could not listen.\n");
-			return 1;
+			return -1;
 		}
 
 		r = fd_set_nonblock(fds[i]);
 		if (r < 0) {
 			fprintf(stderr, "could not set socket non-blocking.\n");
+			return -1;
+		}
+
+		ev_io_init(&vs->listen[i], accept_cb, fds[i], EV_READ);
+		vs->listen[i].data = vs;
+	}
+	vs->listen_ct = num_fds;
+	return 0;
+}
+
+static void usage(const char *prgm)
+{
+	fprintf(stderr,
+		"usage: %s [-a bind_addr] [-p bind_port[-last_port]] [-c clients] [-l]\n"
+		"          [-n pages] [-f page.pnm] [-t mbit] [-R trace [-T]]\n"
+		"       %s -s scanner [-s scanner]... [-o out_dir] [-j workers]\n"
+		"           [-q jpeg_quality] [-m mode] [-r resolution] [-i idle_secs]\n"
+		"\n"
+		"Without -s, pretend to be a scanner, or one per port when given a\n"
+		"range. Each takes up to -c clients at once (0 for any number).\n"
+		"-l is for load testing: no per packet output, just a stats line\n"
+		"every second. Scans are batches of -n pages (0 for an empty\n"
+		"feeder) of a made up page, or of a P5/P6 image given with -f,\n"
+		"sent to each client at up to -t Mbit/s.\n"
+		"-R plays back the sessions in a PROTO style trace or pcap file\n"
+		"instead, one per client in turn. Immediately, or with -T, keeping\n"
+		"to the recorded timing.\n"
+		"\n"
+		"With -s, scan from every scanner given (SANE device names) at\n"
+		"once and write the pages to out_dir.\n",
+		prgm, prgm);
+}
+
+int main(int argc, char **argv)
+{
+	const char *bind_addr = NULL;
+	unsigned port_first, port_last;
+	bool load_test = false;
+	struct bro2_farm_opts farm = {
+		.out_dir = ".",
+		.workers = 4,
+		.idle_secs = 5,
+	};
+	size_t scanner_sz = 0;
+	int opt;
+
+	parse_ports(BRO2_PORT_STR, &port_first, &port_last);
+	while ((opt = getopt(argc, argv, "a:p:c:ln:f:t:R:Ts:o:j:q:m:r:i:")) != -1) {
+		switch (opt) {
+		case 'a':
+			bind_addr = optarg;
+			break;
+		case 'p':
+			if (parse_ports(optarg, &port_first, &port_last)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'c':
+			max_peers = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			load_test = true;
+			break;
+		case 'n':
+			batch_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			page_src = malloc(sizeof(*page_src));
+			if (!page_src || bro2_gen_load_pnm(page_src, optarg)) {
+				fprintf(stderr, "could not load %s, it needs to be P5 or P6 with a maxval of 255\n",
+						optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			tx_rate = strtod(optarg, NULL) * 1e6 / 8;
+			break;
+		case 'R':
+			if (bro2_trace_load(&replay, optarg))
+				return 1;
+			break;
+		case 'T':
+			replay_timed = true;
+			break;
+		case 's':
+			if (farm.scanner_ct == scanner_sz) {
+				scanner_sz = scanner_sz ? scanner_sz * 2 : 8;
+				farm.scanners = realloc(farm.scanners,
+						scanner_sz * sizeof(*farm.scanners));
+				if (!farm.scanners) {
+					fprintf(stderr, "out of memory\n");
+					return 1;
+				}
+			}
+			farm.scanners[farm.scanner_ct++] = optarg;
+			break;
+		case 'o':
+			farm.out_dir = optarg;
+			break;
+		case 'j':
+			farm.workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			farm.quality = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			farm.mode = optarg;
+			break;
+		case 'r':
+			farm.resolution = strtol(optarg, NULL, 0);
+			break;
+		case 'i':
+			farm.idle_secs = strtod(optarg, NULL);
+			break;
+		default: /* '?' */
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (farm.scanner_ct) {
+		if (!farm.workers || farm.quality < 0 || farm.quality > 100) {
+			usage(argv[0]);
 			return 1;
 		}
+		return bro2_farm_run(EV_DEFAULT_ &farm) ? 1 : 0;
+	}
+
+	/* every client is a fd, and there are meant to be a lot of them */
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	vscanner_ct = port_last - port_first + 1;
+	vscanners = calloc(vscanner_ct, sizeof(*vscanners));
+	if (!vscanners) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	size_t i;
+	for (i = 0; i < vscanner_ct; i++) {
+		vscanners[i].port = port_first + i;
+		if (vscanner_bind(&vscanners[i], bind_addr))
+			return 1;
+	}
+
+	ev_timer_init(&accept_pause, accept_resume_cb, 0.1, 0);
+	accept_set(EV_DEFAULT_ true);
 
-		ev_io_init(&accept_listener[i], accept_cb, fds[i], EV_READ);
-		ev_io_start(EV_DEFAULT_ &accept_listener[i]);
+	ev_timer stats_timer;
+	if (load_test) {
+		verbose = false;
+		ev_timer_init(&stats_timer, stats_cb, 1, 1);
+		ev_timer_start(EV_DEFAULT_ &stats_timer);
 	}
 
 	ev_run(EV_DEFAULT_ 0);
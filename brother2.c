@@ -18,10 +18,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
-
+#include <pthread.h>
+
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
 
 #include <net-snmp/net-snmp-config.h>
 #include <net-snmp/net-snmp-includes.h>
@@ -35,6 +46,19 @@
 #include <ccan/list/list.h>
 
 #include "bro2.h"
+#include "bro2-frame.h"
+#include "bro2-rle.h"
+#include "bro2-jpeg.h"
+#include "bro2-color.h"
+#include "bro2-devcache.h"
+#include "bro2-evlog.h"
+#include "bro2-stats.h"
+#include "bro2-readahead.h"
+#include "bro2-arena.h"
+#include "bro2-file.h"
+#include "bro2-blank.h"
+#include "bro2-resample.h"
+#include "bro2-pipe.h"
 
 #define memstr(haystack, h_size, needle_str) memmem(haystack, h_size, needle_str, strlen(needle_str))
 
@@ -64,18 +88,66 @@ enum opts {
 	OPT_BR_Y,
 	OPT_B,
 	OPT_C,
+	OPT_JPEG_RAW,
+	OPT_PREFETCH_INFO,
+	OPT_READAHEAD,
+	OPT_AUTO_AREA,
+	OPT_RESAMPLE,
 	/* String options */
 	OPT_FIRST_STR,
 	OPT_MODE = OPT_FIRST_STR,
 	OPT_COMPRESS,
-	OPT_D
+	OPT_D,
+	OPT_OUTPUT_FILE,
+
+	/* read only, about the last page read */
+	OPT_PAGE_BLANK,
+	OPT_PAGE_CONTENT,
+	OPT_PAGE_LEVELS,
 };
 
+/* output-file, with room for a page number */
+#define BRO2_PATH_SZ 1024
+
+/* distinct (resolution, mode) pairs remembered per device */
+#define BRO2_INFO_CACHE 16
+
 struct bro2_device {
 	struct list_head list;
 	int fd;
 	const char *addr;
-	struct addrinfo *res;
+	struct addrinfo *res;	/* resolved once, redone if connecting fails */
+
+	/* the next session's connection, started when the last one ended */
+	struct pollfd spare[2];
+	bool spare_live;
+	/* after a 401, don't try again before busy_until */
+	int64_t busy_until;
+	long busy_backoff;	/* ms */
+
+	/* how far along getting a scan going we are, see
+	 * bro2_session_step() */
+	enum {
+		BRO2_SESS_IDLE,		/* not connected, maybe a spare on the way */
+		BRO2_SESS_CONNECTING,	/* waiting on the spare to connect */
+		BRO2_SESS_STATUS,	/* waiting for the status banner */
+		BRO2_SESS_READY,	/* banner read, nothing asked yet */
+		BRO2_SESS_P,		/* P sent, waiting for the palette */
+		BRO2_SESS_I,		/* I sent, waiting for the response */
+		BRO2_SESS_SCAN,		/* X sent, records follow */
+	} sess;
+	unsigned sess_tries;	/* failed connections since the last start */
+	/* the status banner, P or I response, as it arrives */
+	char neg[1024];
+	size_t neg_len;
+
+	bool nonblock;		/* sane_set_io_mode() */
+	bool start_pending;	/* sane_start() returned before X was sent */
+
+	/* for sane_get_select_fd(), see bro2_select_update() */
+	int sel_fd, ev_fd;
+	int watched[2];
+	bool ev_set;
 
 	/* settings */
 	union {
@@ -83,6 +155,11 @@ struct bro2_device {
 			int x_res, y_res;
 			int tl_x, tl_y, br_x, br_y;
 			int brightness, contrast;
+			int jpeg_raw;
+			int prefetch_info;
+			int readahead;
+			int auto_area;
+			int resample;
 		};
 		int int_opts[OPT_FIRST_STR];
 	};
@@ -95,12 +172,113 @@ struct bro2_device {
 		};
 		char str_opts[OPT_D - OPT_FIRST_STR + 1][SETTING_STR_LEN];
 	};
+	char output_file[BRO2_PATH_SZ];
+
+	/* param is what the frontend gets, scan what the scanner sends at
+	 * scan_x_res x scan_y_res. They differ only while resampling. */
+	SANE_Parameters param, scan;
+	int scan_x_res, scan_y_res;
+
+	/* I responses already seen, they depend only on R and M */
+	struct bro2_info {
+		int x_res, y_res;	/* as requested */
+		char mode[SETTING_STR_LEN];
+		int nums[BRO2_MSG_I_CT];
+	} info[BRO2_INFO_CACHE];
+	unsigned info_ct, info_next;
+
+	bool scan_done;
+	int page_end;	/* terminator that ended the page */
+	SANE_Status decode_err;	/* for the read after the one that hit it */
+	struct bro2_frame frame;
+
+	/* feeder batches: pages after the first follow on the same
+	 * connection without another I/X negotiation */
+	enum {
+		BRO2_BATCH_NONE,
+		BRO2_BATCH_MORE,	/* the last page ended with "another page waiting" */
+		BRO2_BATCH_DONE,	/* the final page of a batch has been read */
+	} batch;
+	unsigned batch_pages;
+
+	/* record in flight */
+	int rec_type;
+	bool rec_rle;	/* run length encoded */
+	bool rec_drop;	/* not part of the image */
+
+	/* C=RLENGTH */
+	bool rlength;
+
+	/* records into lines, the pipeline for this scan's M= */
+	struct bro2_pipe pipe;
+
+	/* M=C256 palette, asked for once per handle */
+	uint32_t lut[BRO2_PALETTE_SZ];
+	bool have_palette;
+
+	/* see the resample option: scanned lines are gathered in rs (rs_fill
+	 * of the next one so far), resampled into rs_line to hand out */
+	bool resampling;
+	struct bro2_rs rs;
+	size_t rs_fill;
+	uint8_t *rs_line;
+	size_t rs_len, rs_pos;
+
+	/* the frame ring, the pipeline's lines and the rest, laid out per
+	 * scan by bro2_bufs_layout() */
+	struct bro2_arena bufs;
+
+	/* auto-area: the document the last preview found, in its pixels at
+	 * the resolution it was scanned at. x1 and y1 are exclusive. */
+	struct {
+		bool found;
+		int x_res, y_res;
+		int x0, y0, x1, y1;
+	} area;
+	bool previewing;
+
+	/* what's on the page, from the lines handed out. last_page is the
+	 * outcome for the page last read to its end, see page-blank. */
+	struct bro2_blank blank;
+	struct bro2_blank_page last_page;
+	bool page_read;
+
+	/* pages going to files instead of the frontend, see output-file.
+	 * file_seq numbers them. */
+	struct bro2_file file;
+	unsigned file_seq;
+
+	/* C=JPEG decoder, NULL when passing the bitstream through */
+	struct bro2_jpeg *jpeg;
+
+	/* data path events, see bro2_trace_open() */
+	struct bro2_evlog trace;
+	/* receiving while the frontend is busy, see the readahead option.
+	 * ra_live while it owns the socket. */
+	struct bro2_ra *ra;
+	bool ra_live;
+
+	/* counters, shared with collectors when BRO2_STATS_DIR is set */
+	struct bro2_stats_map stats;
+};
 
-	SANE_Parameters param;
+#define bro2_stat_add(dev, ctr, n) bro2_stats_add(&(dev)->stats.s->ctr, n)
 
-	size_t line_buffer_pos;
-	uint8_t line_buffer[BRO2_MAX_LINE_MSG_SZ]; /* ~64kbytes, ~16 pages*/
-};
+/* Frame ring bounds. Records larger than the ring are streamed through in
+ * pieces, so it only has to hold enough lines for the syscalls to be few:
+ * BRO2_RING_LINES of them, within these. */
+#define BRO2_RING_SZ (1 << 16)
+#define BRO2_RING_MIN (1 << 12)
+#define BRO2_RING_LINES 32
+
+/* auto-area's preview only has to tell the document from the lid */
+#define BRO2_PREVIEW_RES 100
+#define BRO2_PREVIEW_MODE "GRAY64"
+/* preview pixels kept around the document, for its edges */
+#define BRO2_PREVIEW_MARGIN 2
+
+/* readahead buffers are BRO2_RING_SZ each, so up to 16MiB */
+#define BRO2_READAHEAD_MAX 256
 
 SANE_Status sane_init(SANE_Int *ver, SANE_Auth_Callback authorize)
 {
@@ -111,64 +289,219 @@ SANE_Status sane_init(SANE_Int *ver, SANE_Auth_Callback authorize)
 	return SANE_STATUS_GOOD;
 }
 
+static void free_device_list(void);
+static void seen_free_all(void);
+
 void sane_exit(void)
 {
 	/* TODO: required that all allocations are freed */
+	free_device_list();
+	seen_free_all();
 }
 
 static const char *vendor_str = "Brother";
 static const char *type_str = "flatbed scanner";
-static size_t num_devs = 0;
+
+/*
+ * Scanners found by bro2_snmp_probe_all(), keyed by MAC address (or by host
+ * if a device doesn't report one). Enumerations within BRO2_DISCOVERY_TTL
+ * seconds of the last probe are answered from here without touching the
+ * network.
+ *
+ * On the first enumeration the list is seeded from the on disk cache (see
+ * bro2-devcache.h) and returned right away, while a probe refreshes it in
+ * the background. Devices from disk that don't answer that probe are
+ * dropped.
+ */
+struct bro2_seen {
+	struct list_node list;
+	uint8_t mac[6];
+	bool have_mac;
+	char host[128];
+	char model[128];
+	char sys_name[64];
+	time_t seen;
+	unsigned probe;	/* the probe that last saw this device, 0 if only on disk */
+};
+
+static LIST_HEAD(seen_devs);
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t last_probe;
+static unsigned probe_gen;
+static bool disk_loaded;
+
+/* the background refresh, net-snmp isn't thread safe so only ever one */
+static pthread_t probe_thread;
+static bool probe_thread_live;
+static bool probe_running;
+
+/* Handed to the frontend. A snapshot, so the background probe can't change
+ * it underneath them. */
+struct bro2_dev_entry {
+	SANE_Device sane;
+	char host[128];
+	char model[128];
+};
 static SANE_Device **device_list = NULL;
+static struct bro2_dev_entry *device_entries;
 
-static int add_device(SANE_Device *d)
+/* Tunables, from the environment */
+#define BRO2_DISCOVERY_QUIET_MS   300	/* stop once nothing new answered for this long */
+#define BRO2_DISCOVERY_TIMEOUT_MS 2000	/* ... or this long after sending */
+#define BRO2_DISCOVERY_TTL        60	/* seconds */
+
+static long env_long(const char *name, long def)
 {
-	device_list = realloc(device_list, sizeof(*device_list) * (num_devs + 2));
-	if (!device_list)
-		return -1;
+	const char *v = getenv(name);
+	if (!v || !*v)
+		return def;
 
-	device_list[num_devs] = d;
-	device_list[num_devs + 1] = NULL;
-	num_devs ++;
+	char *end;
+	long it = strtol(v, &end, 10);
+	if (*end || it < 0) {
+		DBG(1, "ignoring bad %s=\"%s\"\n", name, v);
+		return def;
+	}
+	return it;
+}
 
-	return 0;
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct bro2_seen *seen_find(const uint8_t *mac, const char *host)
+{
+	struct bro2_seen *s;
+	list_for_each(&seen_devs, s, list) {
+		if (mac ? (s->have_mac && !memcmp(s->mac, mac, sizeof(s->mac)))
+			: (!s->have_mac && !strcmp(s->host, host)))
+			return s;
+	}
+	return NULL;
 }
 
-static SANE_Device *_new_device(const char *host, const char *model)
+static void seen_free_all(void)
 {
-	SANE_Device *d = malloc(sizeof(*d));
-	if (!d)
-		return NULL;
+	struct bro2_seen *s, *n;
 
-	d->name = strdup(host);
-	if (!d->name)
-		goto c1;
-	d->model = strdup(model);
-	if (!d->model)
-		goto c2;
-	d->vendor = vendor_str;
-	d->type = type_str;
+	if (probe_thread_live) {
+		pthread_join(probe_thread, NULL);
+		probe_thread_live = false;
+	}
 
-	return d;
-c2:
-	free((char *)d->name);
-c1:
-	free(d);
-	return NULL;
+	list_for_each_safe(&seen_devs, s, n, list) {
+		list_del(&s->list);
+		free(s);
+	}
+	last_probe = 0;
+	disk_loaded = false;
 }
 
-static int new_device(const char *host, const char *model)
+static void seen_load_disk(void)
 {
-	SANE_Device *d = _new_device(host, model);
-	if (!d)
-		return -1;
+	struct bro2_devcache c;
+	char path[4096];
+	size_t i;
+
+	if (bro2_devcache_path(path, sizeof(path)) || bro2_devcache_open(&c, path)) {
+		DBG(2, "no device cache\n");
+		return;
+	}
+
+	pthread_mutex_lock(&seen_lock);
+	for (i = 0; i < c.count; i++) {
+		const struct bro2_devcache_rec *r = &c.recs[i];
+		if (seen_find(r->have_mac ? r->mac : NULL, r->host))
+			continue;
+
+		struct bro2_seen *s = calloc(1, sizeof(*s));
+		if (!s)
+			break;
+
+		memcpy(s->mac, r->mac, sizeof(s->mac));
+		s->have_mac = r->have_mac;
+		snprintf(s->host, sizeof(s->host), "%.*s", (int)sizeof(r->host), r->host);
+		snprintf(s->model, sizeof(s->model), "%.*s", (int)sizeof(r->model), r->model);
+		snprintf(s->sys_name, sizeof(s->sys_name), "%.*s",
+				(int)sizeof(r->sys_name), r->sys_name);
+		s->seen = r->seen;
+		list_add_tail(&seen_devs, &s->list);
+	}
+	pthread_mutex_unlock(&seen_lock);
+
+	DBG(2, "loaded %zu devices from %s\n", c.count, path);
+	bro2_devcache_close(&c);
+}
+
+static void seen_save_disk(void)
+{
+	struct bro2_devcache_rec *recs;
+	struct bro2_seen *s;
+	size_t ct = 0, i = 0;
+	char path[4096];
+
+	if (bro2_devcache_path(path, sizeof(path)))
+		return;
+
+	pthread_mutex_lock(&seen_lock);
+	list_for_each(&seen_devs, s, list)
+		ct++;
+
+	recs = calloc(ct ? ct : 1, sizeof(*recs));
+	if (!recs) {
+		pthread_mutex_unlock(&seen_lock);
+		return;
+	}
+
+	list_for_each(&seen_devs, s, list) {
+		struct bro2_devcache_rec *r = &recs[i++];
+		r->seen = s->seen;
+		memcpy(r->mac, s->mac, sizeof(r->mac));
+		r->have_mac = s->have_mac;
+		memcpy(r->host, s->host, sizeof(r->host));
+		memcpy(r->model, s->model, sizeof(r->model));
+		memcpy(r->sys_name, s->sys_name, sizeof(r->sys_name));
+	}
+	pthread_mutex_unlock(&seen_lock);
+
+	if (bro2_devcache_save(path, recs, ct))
+		DBG(1, "could not write device cache %s: %s\n", path, strerror(errno));
+	free(recs);
+}
+
+/* Copy the value of "KEY:value;" out of an IEEE 1284 device id */
+static void id_field(char *dst, size_t dst_sz, const void *id, size_t id_len,
+		const char *key)
+{
+	const char *v = memstr(id, id_len, key);
+	if (!v) {
+		snprintf(dst, dst_sz, "UNKNOWN");
+		return;
+	}
 
-	return add_device(d);
+	v += strlen(key);
+	const char *end = memchr(v, ';', id_len - (v - (const char *)id));
+	if (!end)
+		end = (const char *)id + id_len;
+
+	size_t len = MIN(dst_sz - 1, (size_t)(end - v));
+	memcpy(dst, v, len);
+	dst[len] = '\0';
 }
 
+struct bro2_probe {
+	unsigned gen;
+	int64_t last_new;	/* when a device we hadn't heard from this probe answered */
+};
+
 static int bro2_snmp_async_cb(int operation, struct snmp_session *sp, int reqid,
 			struct snmp_pdu *pdu, void *data)
 {
+	struct bro2_probe *probe = data;
+
 	if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
 		DBG(2, "snmp timeout\n");
 		return 1;
@@ -222,42 +555,94 @@ static int bro2_snmp_async_cb(int operation, struct snmp_session *sp, int reqid,
 	if (!vp)
 		goto non_bro2;
 
-	if (vp->type != 4)
+	if (vp->type != ASN_OCTET_STR)
 		goto non_bro2;
 
 	/* OK, that is enough checking for now, add a device */
-	char *maybe_model = memstr(vp->val.string, vp->val_len, ";MDL:");
-	const char *model;
-	char mbuf[256];
-	if (!maybe_model)
-		model = "UNKNOWN";
-	else {
-		maybe_model = maybe_model + 5;
-		char *end = memchr(maybe_model, ';', vp->val_len - (maybe_model - (char *)vp->val.string));
-		if (!end)
-			end = (char *)vp->val.string + vp->val_len;
-
-		size_t model_len = MIN(sizeof(mbuf) - 1, end - maybe_model - 1);
-		memcpy(mbuf, maybe_model, model_len);
-		mbuf[model_len] = '\0';
-		model = mbuf;
+	struct variable_list *id = vp;
+	struct variable_list *sys_name = id->next_variable;
+	struct variable_list *mac = sys_name ? sys_name->next_variable : NULL;
+	bool have_mac = mac && mac->type == ASN_OCTET_STR && mac->val_len == 6;
+
+	pthread_mutex_lock(&seen_lock);
+	struct bro2_seen *s = seen_find(have_mac ? mac->val.string : NULL, host);
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (!s) {
+			pthread_mutex_unlock(&seen_lock);
+			errno = ENOMEM;
+			return 1;
+		}
+		if (have_mac) {
+			memcpy(s->mac, mac->val.string, sizeof(s->mac));
+			s->have_mac = true;
+		}
+		list_add_tail(&seen_devs, &s->list);
 	}
 
-	new_device(host, model);
+	if (s->probe != probe->gen)
+		probe->last_new = now_ms();
+	s->probe = probe->gen;
+	s->seen = time(NULL);
+
+	/* a device keeps its MAC across DHCP leases, pick up the new host */
+	snprintf(s->host, sizeof(s->host), "%s", host);
+	id_field(s->model, sizeof(s->model), id->val.string, id->val_len, ";MDL:");
+	if (sys_name && sys_name->type == ASN_OCTET_STR)
+		snprintf(s->sys_name, sizeof(s->sys_name), "%.*s",
+				(int)sys_name->val_len, (char *)sys_name->val.string);
+	pthread_mutex_unlock(&seen_lock);
 
 non_bro2:
 	return 1;
 }
 
-static void bro2_snmp_probe_all(void)
+/* Directed broadcast addresses of every interface that has one */
+static size_t bro2_bcast_addrs(char addrs[][INET_ADDRSTRLEN], size_t max)
 {
-	struct snmp_session session, *ss;
-	struct snmp_pdu *pdu;
+	struct ifaddrs *ifas, *ifa;
+	size_t ct = 0;
+
+	if (getifaddrs(&ifas)) {
+		DBG(1, "getifaddrs failed: %s\n", strerror(errno));
+		goto fallback;
+	}
+
+	for (ifa = ifas; ifa && ct < max; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+		if (!(ifa->ifa_flags & IFF_UP) || !(ifa->ifa_flags & IFF_BROADCAST))
+			continue;
+		if (!ifa->ifa_broadaddr)
+			continue;
+
+		char a[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_broadaddr)->sin_addr,
+				a, sizeof(a));
+
+		size_t i;
+		for (i = 0; i < ct; i++)
+			if (!strcmp(addrs[i], a))
+				break;
+		if (i == ct)
+			strcpy(addrs[ct++], a);
+	}
+
+	freeifaddrs(ifas);
+
+fallback:
+	if (!ct)
+		strcpy(addrs[ct++], "255.255.255.255");
+	return ct;
+}
+
+#define BRO2_MAX_BCAST 16
 
-	/* TODO: figure out if we can reuse these between snmp_add_null_var()
-	 * calls */
-	oid init_oids[5][MAX_OID_LEN];
-	size_t init_oid_lens[5];
+static void bro2_snmp_probe_all(void)
+{
+	static bool snmp_ready;
+	static oid init_oids[5][MAX_OID_LEN];
+	static size_t init_oid_lens[5];
 
 	const char *oid_strs[5] = {
 		/* SNMPv2-SMI::enterprises.2435.2.3.9.1.1.7.0
@@ -280,43 +665,65 @@ static void bro2_snmp_probe_all(void)
 		".1.3.6.1.2.1.1.1.0"
 	};
 
-	bool timed_out = false;
-
-	init_snmp("brother2");
-	snmp_sess_init(&session);
-
-	session.peername = (char *)"255.255.255.255";
-	session.flags |= SNMP_FLAGS_UDP_BROADCAST;
-	session.version = SNMP_VERSION_1;
-	session.community = (unsigned char *)"public";
-	session.community_len = strlen((char *)session.community);
-
-	SOCK_STARTUP;
-
-	ss = snmp_open(&session);
-	if (!ss) {
-		snmp_perror("ack");
-		snmp_log(LOG_ERR, "failed to open session\n");
-		goto out_setup;
+	long quiet = env_long("BRO2_DISCOVERY_QUIET_MS", BRO2_DISCOVERY_QUIET_MS);
+	long timeout = env_long("BRO2_DISCOVERY_TIMEOUT_MS", BRO2_DISCOVERY_TIMEOUT_MS);
+	struct bro2_probe probe = { .gen = ++probe_gen };
+	struct snmp_session *sessions[BRO2_MAX_BCAST];
+	char addrs[BRO2_MAX_BCAST][INET_ADDRSTRLEN];
+	size_t addr_ct, sess_ct = 0;
+	size_t i;
+
+	if (!snmp_ready) {
+		init_snmp("brother2");
+		SOCK_STARTUP;
+		for (i = 0; i < ARRAY_SIZE(oid_strs); i++) {
+			init_oid_lens[i] = MAX_OID_LEN;
+			read_objid(oid_strs[i], init_oids[i], &init_oid_lens[i]);
+		}
+		snmp_ready = true;
 	}
 
-	pdu = snmp_pdu_create(SNMP_MSG_GET);
+	/* Send to every broadcast domain up front, then wait on all of them */
+	addr_ct = bro2_bcast_addrs(addrs, ARRAY_SIZE(addrs));
+	for (i = 0; i < addr_ct; i++) {
+		struct snmp_session session, *ss;
+		struct snmp_pdu *pdu;
+		size_t j;
+
+		snmp_sess_init(&session);
+		session.peername = addrs[i];
+		session.flags |= SNMP_FLAGS_UDP_BROADCAST;
+		session.version = SNMP_VERSION_1;
+		session.community = (unsigned char *)"public";
+		session.community_len = strlen((char *)session.community);
+		/* we do our own timing, keep netsnmp from resending or
+		 * expiring the request underneath us */
+		session.retries = 0;
+		session.timeout = (timeout + 1000) * 1000;
+
+		ss = snmp_open(&session);
+		if (!ss) {
+			snmp_perror("ack");
+			snmp_log(LOG_ERR, "failed to open session to %s\n", addrs[i]);
+			continue;
+		}
+
+		pdu = snmp_pdu_create(SNMP_MSG_GET);
+		for (j = 0; j < ARRAY_SIZE(oid_strs); j++)
+			snmp_add_null_var(pdu, init_oids[j], init_oid_lens[j]);
 
-	int i;
-	for (i = 0; i < ARRAY_SIZE(oid_strs); i++) {
-		init_oid_lens[i] = MAX_OID_LEN;
-		read_objid(oid_strs[i], init_oids[i], &init_oid_lens[i]);
-		snmp_add_null_var(pdu, init_oids[i], init_oid_lens[i]);
-	}
+		int reqid = snmp_async_send(ss, pdu, bro2_snmp_async_cb, &probe);
+		if (reqid == 0) {
+			DBG(1, "failed to send broadcast snmp to %s\n", addrs[i]);
+			snmp_free_pdu(pdu);
+			snmp_close(ss);
+			continue;
+		}
 
-	int reqid = snmp_async_send(ss, pdu, bro2_snmp_async_cb, &timed_out);
-	if (reqid == 0) {
-		DBG(1, "failed to send broadcast snmp\n");
-		goto out_close;
+		DBG(4, "async send to %s reqid = %d\n", addrs[i], reqid);
+		sessions[sess_ct++] = ss;
 	}
 
-	DBG(4, "async send reqid = %d\n", reqid);
-
 	/* FIXME: netsnmp doesn't know how to handle reciving multiple
 	 * responses from a single packet.
 	 * - Indicating "failure" in the callback means that
@@ -324,58 +731,184 @@ static void bro2_snmp_probe_all(void)
 	 * - Indicating "success" or having all the retries used up results in
 	 *   the request being destroyed and the pdu being freed.
 	 *
+	 * Sleep until a response arrives, and stop once nobody new has
+	 * answered for the quiet period.
 	 */
-	time_t endtime = time(NULL) + 2;
-	while (time(NULL) < endtime) {
+	int64_t start = now_ms();
+	probe.last_new = start;
+	while (sess_ct) {
+		int64_t wait = MIN(probe.last_new + quiet, start + timeout) - now_ms();
+		if (wait <= 0)
+			break;
+
 		int fds = 0, block = 0;
 		fd_set fdset;
-		struct timeval timeout = { .tv_usec = 5000 };
+		struct timeval tv = {
+			.tv_sec = wait / 1000,
+			.tv_usec = (wait % 1000) * 1000,
+		};
 		FD_ZERO(&fdset);
-		snmp_select_info(&fds, &fdset, &timeout, &block);
-		fds = select(fds, &fdset, NULL, NULL, &timeout);
-		if (fds)
+		snmp_select_info(&fds, &fdset, &tv, &block);
+		fds = select(fds, &fdset, NULL, NULL, &tv);
+		if (fds > 0)
 			snmp_read(&fdset);
-		else
+		else if (fds == 0)
 			snmp_timeout(); /* calls the callback if timeout has occured. */
+		else if (errno != EINTR)
+			break;
 	}
 
-out_close:
-	snmp_close(ss);
-out_setup:
-	SOCK_CLEANUP;
-	return;
+	DBG(2, "probe done after %lld ms\n", (long long)(now_ms() - start));
+
+	for (i = 0; i < sess_ct; i++)
+		snmp_close(sessions[i]);
 }
 
 static void free_device_list(void)
 {
-	if (!device_list)
-		return;
-
 	free(device_list);
+	free(device_entries);
+	device_list = NULL;
+	device_entries = NULL;
+}
+
+/* Forget devices that haven't answered for a whole TTL, or at all if they
+ * came from disk and a probe has since completed. Called with seen_lock
+ * held. */
+static size_t seen_prune(time_t ttl)
+{
+	struct bro2_seen *s, *n;
+	time_t now = time(NULL);
+	size_t ct = 0;
+
+	list_for_each_safe(&seen_devs, s, n, list) {
+		if (s->probe ? now - s->seen > ttl : last_probe != 0) {
+			list_del(&s->list);
+			free(s);
+			continue;
+		}
+		ct++;
+	}
+
+	return ct;
+}
+
+/* Rebuild device_list from the devices seen */
+static int bro2_build_device_list(time_t ttl)
+{
+	struct bro2_seen *s;
+	size_t ct, i = 0;
+	int r = 0;
+
+	pthread_mutex_lock(&seen_lock);
+	ct = seen_prune(ttl);
+
+	device_list = malloc(sizeof(*device_list) * (ct + 1));
+	device_entries = malloc(sizeof(*device_entries) * (ct ? ct : 1));
+	if (!device_list || !device_entries) {
+		free_device_list();
+		r = -1;
+		goto out;
+	}
+
+	list_for_each(&seen_devs, s, list) {
+		struct bro2_dev_entry *e = &device_entries[i];
+		memcpy(e->host, s->host, sizeof(e->host));
+		memcpy(e->model, s->model, sizeof(e->model));
+		e->sane = (SANE_Device) {
+			.name = e->host,
+			.vendor = vendor_str,
+			.model = e->model,
+			.type = type_str,
+		};
+		device_list[i++] = &e->sane;
+	}
+	device_list[i] = NULL;
+
+out:
+	pthread_mutex_unlock(&seen_lock);
+	return r;
+}
+
+static void bro2_probe_and_save(void)
+{
+	bro2_snmp_probe_all();
+
+	pthread_mutex_lock(&seen_lock);
+	last_probe = time(NULL);
+	seen_prune(env_long("BRO2_DISCOVERY_TTL", BRO2_DISCOVERY_TTL));
+	pthread_mutex_unlock(&seen_lock);
+
+	seen_save_disk();
+}
+
+static void *bro2_probe_thread(void *arg)
+{
+	bro2_probe_and_save();
+
+	pthread_mutex_lock(&seen_lock);
+	probe_running = false;
+	pthread_mutex_unlock(&seen_lock);
+	return NULL;
 }
 
-/* return an empty list of detected devices */
 SANE_Status sane_get_devices(const SANE_Device ***dev_list,
 			     SANE_Bool local_only)
 {
+	static const SANE_Device *no_devs[] = { NULL };
+	time_t ttl = env_long("BRO2_DISCOVERY_TTL", BRO2_DISCOVERY_TTL);
+	bool stale, running;
+
 	free_device_list();
 	DBG_INIT();
 
-	if (local_only)
+	if (local_only) {
+		*dev_list = no_devs;
 		return SANE_STATUS_GOOD;
+	}
+
+	if (!disk_loaded) {
+		disk_loaded = true;
+		seen_load_disk();
+	}
 
 	errno = 0;
-	bro2_snmp_probe_all();
-	*dev_list = (const SANE_Device **)device_list;
+	pthread_mutex_lock(&seen_lock);
+	running = probe_running;
+	stale = !last_probe || time(NULL) - last_probe >= ttl;
+	pthread_mutex_unlock(&seen_lock);
+
+	if (running) {
+		DBG(2, "probe in progress, using cached devices\n");
+	} else if (stale && !list_empty(&seen_devs)) {
+		/* have something to show already, refresh it in the background */
+		if (probe_thread_live)
+			pthread_join(probe_thread, NULL);
+		probe_running = true;
+		probe_thread_live = !pthread_create(&probe_thread, NULL,
+				bro2_probe_thread, NULL);
+		if (!probe_thread_live) {
+			probe_running = false;
+			bro2_probe_and_save();
+		}
+	} else if (stale) {
+		bro2_probe_and_save();
+	} else {
+		DBG(2, "using cached devices, probed %lds ago\n",
+				(long)(time(NULL) - last_probe));
+	}
 
-	if (errno == ENOMEM)
+	if (errno == ENOMEM || bro2_build_device_list(ttl)) {
+		*dev_list = no_devs;
 		return SANE_STATUS_NO_MEM;
+	}
+
+	*dev_list = (const SANE_Device **)device_list;
 	return SANE_STATUS_GOOD;
 }
 
-static int bro2_connect(struct bro2_device *dev)
+static int bro2_resolve(struct bro2_device *dev)
 {
-	/* Hook up the connection */
 	struct addrinfo *res = net_client_lookup(dev->addr, BRO2_PORT_STR,
 						AF_UNSPEC, SOCK_STREAM);
 
@@ -385,19 +918,138 @@ static int bro2_connect(struct bro2_device *dev)
 		return -1;
 	}
 
-	int fd = net_connect(res);
-
-	dev->fd = fd;
+	if (dev->res)
+		freeaddrinfo(dev->res);
 	dev->res = res;
+	return 0;
+}
+
+/* Start connecting for the next session without waiting on it. The banner
+ * is read when the session is wanted, by which time it has usually
+ * arrived. */
+static void bro2_spare_start(struct bro2_device *dev)
+{
+	if (dev->spare_live || (!dev->res && bro2_resolve(dev)))
+		return;
 
-	if (fd == -1) {
-		return -2;
+	int fd = net_connect_async(dev->res, dev->spare);
+	if (fd == -1 && errno != EINPROGRESS) {
+		DBG(2, "could not start spare connection: %s\n", strerror(errno));
+		return;
 	}
-	return 0;
+
+	dev->spare_live = true;
+}
+
+static void bro2_spare_drop(struct bro2_device *dev)
+{
+	if (!dev->spare_live)
+		return;
+
+	net_connect_abort(dev->spare);
+	dev->spare_live = false;
+}
+
+static void bro2_hangup(struct bro2_device *dev)
+{
+	if (dev->ra_live) {
+		bro2_ra_stop(dev->ra);
+		dev->ra_live = false;
+	}
+	if (dev->fd != -1)
+		close(dev->fd);
+	dev->fd = -1;
+	dev->sess = BRO2_SESS_IDLE;
+}
+
+/*
+ * The frontend gets a single fd to select() on, an epoll set that stays the
+ * same across connections. It holds whichever socket we're waiting on (or
+ * the readahead queue's ready_fd while that's receiving for us), and
+ * an eventfd that is kept readable while sane_read() has something to hand
+ * out without waiting on the scanner (the rest of a page that didn't fit,
+ * or its end).
+ */
+static void bro2_select_update(struct bro2_device *dev, bool ready)
+{
+	int want[2] = { -1, -1 };
+	uint32_t events = EPOLLIN;
+	size_t i;
+
+	if (dev->sel_fd == -1)
+		return;
+
+	if (dev->ra_live) {
+		want[0] = dev->ra->ready_fd;
+	} else if (dev->fd != -1) {
+		want[0] = dev->fd;
+	} else if (dev->spare_live) {
+		want[0] = dev->spare[0].fd;
+		want[1] = dev->spare[1].fd;
+		events = EPOLLOUT;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(dev->watched); i++) {
+		int fd = dev->watched[i];
+		if (fd != -1 && fd != want[0] && fd != want[1])
+			epoll_ctl(dev->sel_fd, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	/* fd numbers get reused, so don't trust that what we watched
+	 * before is still in the set */
+	for (i = 0; i < ARRAY_SIZE(want); i++) {
+		struct epoll_event ev = { .events = events, .data.fd = want[i] };
+		if (want[i] == -1)
+			continue;
+		if (epoll_ctl(dev->sel_fd, EPOLL_CTL_ADD, want[i], &ev) && errno == EEXIST)
+			epoll_ctl(dev->sel_fd, EPOLL_CTL_MOD, want[i], &ev);
+	}
+	memcpy(dev->watched, want, sizeof(want));
+
+	if (ready != dev->ev_set) {
+		uint64_t v = 1;
+		if (ready)
+			(void)!write(dev->ev_fd, &v, sizeof(v));
+		else
+			(void)!read(dev->ev_fd, &v, sizeof(v));
+		dev->ev_set = ready;
+	}
+}
+
+static int bro2_select_init(struct bro2_device *dev)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	dev->sel_fd = epoll_create1(EPOLL_CLOEXEC);
+	dev->ev_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (dev->sel_fd == -1 || dev->ev_fd == -1)
+		return -1;
+
+	ev.data.fd = dev->ev_fd;
+	return epoll_ctl(dev->sel_fd, EPOLL_CTL_ADD, dev->ev_fd, &ev);
+}
+
+static void bro2_select_free(struct bro2_device *dev)
+{
+	if (dev->sel_fd != -1)
+		close(dev->sel_fd);
+	if (dev->ev_fd != -1)
+		close(dev->ev_fd);
 }
 
+/* With auto-area, narrow the scan to what the preview found, in scanner
+ * pixels. br_x and br_y come in as the bed's extent from the I response. */
 static void bro2_set_area(struct bro2_device *dev)
 {
+	if (!dev->auto_area || !dev->area.found)
+		return;
+
+	dev->tl_x = (int64_t)dev->area.x0 * dev->scan_x_res / dev->area.x_res;
+	dev->tl_y = (int64_t)dev->area.y0 * dev->scan_y_res / dev->area.y_res;
+	dev->br_x = MIN(dev->br_x, ((int64_t)dev->area.x1 * dev->scan_x_res
+				+ dev->area.x_res - 1) / dev->area.x_res);
+	dev->br_y = MIN(dev->br_y, ((int64_t)dev->area.y1 * dev->scan_y_res
+				+ dev->area.y_res - 1) / dev->area.y_res);
 }
 
 static void bro2_init(struct bro2_device *dev, const char *addr)
@@ -405,48 +1057,46 @@ static void bro2_init(struct bro2_device *dev, const char *addr)
 	*dev = (typeof(*dev)) {
 		.fd = -1,
 		.addr = addr,
+		.file = { .fd = -1 },
+		/* no page read yet */
+		.last_page = {
+			.min = -1, .mean = -1,
+			.tl_x = -1, .tl_y = -1, .br_x = -1, .br_y = -1,
+		},
+		.spare = { { .fd = -1 }, { .fd = -1 } },
+		.sel_fd = -1,
+		.ev_fd = -1,
+		.watched = { -1, -1 },
 
 		/* defaults */
 		.x_res = 300,
 		.y_res = 300,
 		.brightness = 50,
 		.contrast = 50,
-		.mode = "CGREY",
+		.mode = "CGRAY",
 		.d = "SIN",
 		.compress = "NONE",
 
 		.param = {
-			.format = SANE_FRAME_GRAY, /* XXX: fixed to this for debugging */
-			.last_frame = SANE_FALSE,  /* will need to be modified
-						      to switch when scan is
-						      complete */
+			.format = SANE_FRAME_GRAY,
+			.last_frame = SANE_TRUE,   /* single pass, every page is
+						      a single frame */
 			.bytes_per_line = 0,  /* FIXME: unknown */
 			.pixels_per_line = 0, /* FIXME: unknown */
 			.lines = -1, /* -1 == unknown, call sane_read() until SANE_STATUS_EOF */
-			.depth = 1,	      /* Or 8? */
+			.depth = 8,
 		},
 	};
+	/* nothing to hand out until there's a scan */
+	bro2_pipe_init(&dev->pipe, BRO2_PIPE_GRAY, 0, dev->lut, NULL);
 }
 
-/* Must be called immediately after connecting, status is only sent at that
- * time. 
+/* The status banner is only sent immediately after connecting. @buf is nul
+ * terminated.
  * Returns a positive status, or a negative error code.
  * */
-static int bro2_read_status(struct bro2_device *dev)
+static int bro2_parse_status(const char *buf, size_t r)
 {
-	char buf[512];
-	ssize_t r = read(dev->fd, buf, sizeof(buf) - 1);
-
-	if (r == 0) {
-		DBG(1, "eof?\n");
-		return -1;
-	} else if (r == -1) {
-		DBG(1, "error?\n");
-		return -1;
-	}
-
-	buf[r] = '\0';
-
 	if (r <= 4) {
 		DBG(1, "String too short.\n");
 		return -1;
@@ -484,7 +1134,36 @@ static int bro2_read_status(struct bro2_device *dev)
 	return it;
 }
 
-static int bro2_send_I(struct bro2_device *dev)
+/* poll() for the blocking paths, the socket itself is always non-blocking */
+static int bro2_wait_fd(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	size_t p = 0;
+	while (p < len) {
+		ssize_t r = write(fd, (const char *)buf + p, len - p);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK)
+					&& !bro2_wait_fd(fd, POLLOUT))
+				continue;
+			return -1;
+		}
+		p += r;
+	}
+	return 0;
+}
+
+static int bro2_send_I(struct bro2_device *dev, int x_res, int y_res,
+		const char *mode)
 {
 	char buf[512];
 	int l = snprintf(buf, sizeof(buf),
@@ -492,15 +1171,14 @@ static int bro2_send_I(struct bro2_device *dev)
 			"R=%u,%u\n"
 			"M=%s\n"
 			"\x80",
-			dev->x_res, dev->y_res, dev->mode);
+			x_res, y_res, mode);
 
 	if (l > sizeof(buf)) {
 		DBG(1, "too much for buffer.\n");
 		return -1;
 	}
 
-	ssize_t r = write(dev->fd, buf, l);
-	if (r != l) {
+	if (write_full(dev->fd, buf, l)) {
 		DBG(1, "write failed.\n");
 		return -1;
 	}
@@ -508,10 +1186,118 @@ static int bro2_send_I(struct bro2_device *dev)
 	return 0;
 }
 
+static bool bro2_jpeg_decoding(struct bro2_device *dev)
+{
+	return !strcmp(dev->compress, "JPEG") && !dev->jpeg_raw;
+}
+
+/* What the scanner will send for the X we're sending */
+static void bro2_scan_param(struct bro2_device *dev)
+{
+	dev->scan.pixels_per_line = dev->br_x - dev->tl_x;
+
+	if (!strcmp(dev->compress, "JPEG")) {
+		if (bro2_jpeg_decoding(dev)) {
+			/* the scanner only does JPEG for color */
+			dev->scan.format = SANE_FRAME_RGB;
+			dev->scan.depth = 8;
+			dev->scan.bytes_per_line = dev->scan.pixels_per_line * 3;
+		} else {
+			/* the bitstream as is, a byte stream rather than
+			 * lines; the frontend must know it's JPEG */
+			dev->scan.format = SANE_FRAME_GRAY;
+			dev->scan.depth = 8;
+			dev->scan.bytes_per_line = dev->scan.pixels_per_line;
+		}
+		return;
+	}
+
+	if (!strcmp(dev->mode, "CGRAY") || !strcmp(dev->mode, "C256")) {
+		dev->scan.format = SANE_FRAME_RGB;
+		dev->scan.depth = 8;
+		dev->scan.bytes_per_line = dev->scan.pixels_per_line * 3;
+		return;
+	}
+
+	dev->scan.format = SANE_FRAME_GRAY;
+	if (!strcmp(dev->mode, "TEXT") || !strcmp(dev->mode, "ERRDIF")) {
+		/* a set bit is black, MSB first, as the scanner sends it */
+		dev->scan.depth = 1;
+		dev->scan.bytes_per_line = (dev->scan.pixels_per_line + 7) / 8;
+		return;
+	}
+
+	dev->scan.depth = 8;
+	dev->scan.bytes_per_line = dev->scan.pixels_per_line;
+}
+
 static void bro2_update_param(struct bro2_device *dev)
 {
-	dev->param.pixels_per_line = dev->br_x - dev->tl_x;
-	dev->param.bytes_per_line  = dev->param.pixels_per_line * dev->param.depth;
+	bro2_scan_param(dev);
+	dev->param = dev->scan;
+
+	/* with the resample option, deliver what was asked for where it's
+	 * 8 bit pixels */
+	dev->resampling = dev->resample && dev->scan.depth == 8
+		&& (strcmp(dev->compress, "JPEG") || bro2_jpeg_decoding(dev))
+		&& (dev->x_res != dev->scan_x_res || dev->y_res != dev->scan_y_res)
+		&& bro2_rs_width(dev->scan.pixels_per_line, dev->scan_x_res,
+				dev->x_res);
+	if (!dev->resampling) {
+		dev->x_res = dev->scan_x_res;
+		dev->y_res = dev->scan_y_res;
+		return;
+	}
+
+	dev->param.pixels_per_line = bro2_rs_width(dev->scan.pixels_per_line,
+			dev->scan_x_res, dev->x_res);
+	dev->param.bytes_per_line = dev->param.pixels_per_line
+		* (dev->param.format == SANE_FRAME_RGB ? 3 : 1);
+}
+
+static bool bro2_c256(struct bro2_device *dev)
+{
+	return !strcmp(dev->mode, "C256") && !bro2_jpeg_decoding(dev);
+}
+
+/* What the scan's records are turned into lines by. Decoded JPEG goes
+ * through bro2-jpeg instead, raw JPEG is passed through as is. */
+static enum bro2_pipe_kind bro2_pipe_kind(struct bro2_device *dev)
+{
+	if (!strcmp(dev->compress, "JPEG"))
+		return BRO2_PIPE_GRAY;
+	if (bro2_c256(dev))
+		return BRO2_PIPE_C256;
+	if (dev->scan.format == SANE_FRAME_RGB)
+		return BRO2_PIPE_RGB;
+	if (dev->scan.depth == 1)
+		return BRO2_PIPE_BW;
+	return BRO2_PIPE_GRAY;
+}
+
+/* The response is a 2 byte little endian length followed by the palette,
+ * see bro2_palette_parse() */
+static int bro2_send_P(struct bro2_device *dev)
+{
+	char buf[] = "\x1bP\n\x80";
+	if (write_full(dev->fd, buf, sizeof(buf) - 1)) {
+		DBG(1, "write failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Done with P, given the palette in @p or NULL if there isn't one. The
+ * windows driver hangs up after asking for it, so we do too. */
+static void bro2_palette_done(struct bro2_device *dev, const uint8_t *p,
+		size_t len)
+{
+	bro2_palette_default(dev->lut);
+	if (!p || bro2_palette_parse(dev->lut, p, len))
+		DBG(1, "no usable palette, assuming 3-3-2 RGB\n");
+	dev->have_palette = true;
+	bro2_hangup(dev);
 }
 
 static int bro2_send_X(struct bro2_device *dev)
@@ -524,10 +1310,10 @@ static int bro2_send_X(struct bro2_device *dev)
 			"C=%s\n"
 			"B=%u\n"
 			"N=%u\n"
-			"A=%u,%u,%u,%u"
+			"A=%u,%u,%u,%u\n"
 			"D=%s\n"
 			"\x80",
-			dev->x_res, dev->y_res,
+			dev->scan_x_res, dev->scan_y_res,
 			dev->mode,
 			dev->compress,
 			dev->brightness,
@@ -541,9 +1327,8 @@ static int bro2_send_X(struct bro2_device *dev)
 		return -1;
 	}
 
-	ssize_t r = write(dev->fd, buf, l);
-	if (r != l) {
-		DBG(1, "write failed: %zd %s\n", r, strerror(errno));
+	if (write_full(dev->fd, buf, l)) {
+		DBG(1, "write failed: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -555,9 +1340,8 @@ static int bro2_send_X(struct bro2_device *dev)
 static int bro2_send_R(struct bro2_device *dev)
 {
 	char buf[] = "\x1bR\n";
-	ssize_t r = write(dev->fd, buf, sizeof(buf) - 1);
-	if (r != (sizeof(buf) - 1)) {
-		DBG(1, "write failed: %zd %s\n", r, strerror(errno));
+	if (write_full(dev->fd, buf, sizeof(buf) - 1)) {
+		DBG(1, "write failed: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -605,31 +1389,63 @@ static int parse_num_list(void const *v_buf, size_t buf_bytes, int *nums,
 	return i;
 }
 
-static int bro2_recv_I_response(struct bro2_device *dev)
+/* read() exactly @len bytes */
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t p = 0;
+	while (p < len) {
+		ssize_t r = read(fd, (char *)buf + p, len - p);
+		if (r == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK)
+					&& !bro2_wait_fd(fd, POLLIN))
+				continue;
+			return -1;
+		}
+		p += r;
+	}
+	return 0;
+}
+
+static int bro2_parse_I(const char *buf, size_t l, int nums[BRO2_MSG_I_CT]);
+
+/* The response is a 2 byte little endian length followed by that many
+ * bytes of comma separated numbers */
+static int bro2_recv_I_response(struct bro2_device *dev, int nums[BRO2_MSG_I_CT])
 {
 	char buf[512];
-	/* FIXME: timeout at some point. */
-	ssize_t l = read(dev->fd, buf, sizeof(buf) - 1);
+	uint8_t hdr[2];
 
-	if (l <= 0) {
-		DBG(1, "error in read\n");
+	/* FIXME: timeout at some point. */
+	if (read_full(dev->fd, hdr, sizeof(hdr))) {
+		DBG(1, "error in read: %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (buf[0] != 0x1b) {
-		DBG(1, "wrong start byte: %c %x\n", buf[0], buf[0]);
+	size_t l = hdr[0] | (hdr[1] << 8);
+	if (!l || l >= sizeof(buf)) {
+		DBG(1, "bad I response length: %zu\n", l);
 		return -1;
 	}
 
-	if (buf[1] != 0x00) {
-		DBG(1, "wrong 2nd byte: %c %x\n", buf[1], buf[1]);
+	if (read_full(dev->fd, buf, l)) {
+		DBG(1, "error in read: %s\n", strerror(errno));
 		return -1;
 	}
 
-	int nums[7];
+	return bro2_parse_I(buf, l, nums);
+}
+
+static int bro2_parse_I(const char *buf, size_t l, int nums[BRO2_MSG_I_CT])
+{
 	char *end;
-	int c = parse_num_list(buf + 2, l - 2, nums, 7, &end);
-	if (c != 7) {
+	int c = parse_num_list(buf, l, nums, BRO2_MSG_I_CT, &end);
+	if (c != BRO2_MSG_I_CT) {
 		DBG(1, "Did not get enough numbers: %d\n", c);
 		return -1;
 	}
@@ -642,51 +1458,550 @@ static int bro2_recv_I_response(struct bro2_device *dev)
 		return -1;
 	}
 
-	/* Fixup the resolution based on info */
-	dev->x_res = nums[BRO2_MSG_I_XRES];
-	dev->y_res = nums[BRO2_MSG_I_YRES];
+	return 0;
+}
+
+static void bro2_apply_I(struct bro2_device *dev, const int nums[BRO2_MSG_I_CT])
+{
+	/* the resolution it'll scan at, the one asked for is given up in
+	 * bro2_update_param() unless we're resampling to it */
+	dev->scan_x_res = nums[BRO2_MSG_I_XRES];
+	dev->scan_y_res = nums[BRO2_MSG_I_YRES];
+	if (dev->scan_x_res != dev->x_res || dev->scan_y_res != dev->y_res)
+		DBG(2, "asked for %dx%d dpi, scanning at %dx%d\n",
+				dev->x_res, dev->y_res,
+				dev->scan_x_res, dev->scan_y_res);
 
 	dev->br_x = nums[BRO2_MSG_I_MAX_X];
 	dev->br_y = nums[BRO2_MSG_I_MAX_Y];
+}
+
+static const int *bro2_info_find(struct bro2_device *dev, int x_res, int y_res,
+		const char *mode)
+{
+	unsigned i;
+	for (i = 0; i < dev->info_ct; i++) {
+		struct bro2_info *in = &dev->info[i];
+		if (in->x_res == x_res && in->y_res == y_res
+				&& !strcmp(in->mode, mode))
+			return in->nums;
+	}
+	return NULL;
+}
+
+static void bro2_info_add(struct bro2_device *dev, int x_res, int y_res,
+		const char *mode, const int nums[BRO2_MSG_I_CT])
+{
+	struct bro2_info *in;
+
+	if (dev->info_ct < BRO2_INFO_CACHE) {
+		in = &dev->info[dev->info_ct++];
+	} else {
+		in = &dev->info[dev->info_next];
+		dev->info_next = (dev->info_next + 1) % BRO2_INFO_CACHE;
+	}
 
+	in->x_res = x_res;
+	in->y_res = y_res;
+	snprintf(in->mode, sizeof(in->mode), "%s", mode);
+	memcpy(in->nums, nums, sizeof(in->nums));
+}
+
+/* Resolutions asked about by bro2_info_prefetch(). The scanner accepts
+ * anything in steps of 100 and rounds it to what it can do, these are the
+ * ones frontends tend to offer. */
+static const int prefetch_res[] = { 100, 150, 200, 300, 600, 1200, 2400 };
+
+static int bro2_session_run(struct bro2_device *dev, int target, bool block);
+
+/* Fill the cache for every resolution in the current mode, sending all the
+ * requests before reading any of the responses so it costs a single round
+ * trip. */
+static int bro2_info_prefetch(struct bro2_device *dev)
+{
+	int nums[BRO2_MSG_I_CT];
+	size_t i, sent = 0;
+
+	if (dev->sess > BRO2_SESS_READY) {
+		DBG(2, "mid scan, not prefetching\n");
+		return 0;
+	}
+
+	dev->sess_tries = 0;
+	if (bro2_session_run(dev, BRO2_SESS_READY, true))
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(prefetch_res); i++) {
+		int res = prefetch_res[i];
+		if (bro2_info_find(dev, res, res, dev->mode))
+			continue;
+		if (bro2_send_I(dev, res, res, dev->mode))
+			return -1;
+		sent |= 1u << i;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(prefetch_res); i++) {
+		int res = prefetch_res[i];
+		if (!(sent & (1u << i)))
+			continue;
+		if (bro2_recv_I_response(dev, nums))
+			return -1;
+		bro2_info_add(dev, res, res, dev->mode, nums);
+	}
+
+	DBG(2, "prefetched I responses for M=%s\n", dev->mode);
 	return 0;
 }
 
-static int bro2_connect_and_get_status(struct bro2_device *dev)
+/* Tunables, from the environment */
+#define BRO2_BUSY_BACKOFF_MS 250	/* first wait after a 401, doubling ... */
+#define BRO2_BUSY_BACKOFF_MAX_MS 4000	/* ... up to this */
+#define BRO2_BUSY_TIMEOUT_MS 10000	/* give up with DEVICE_BUSY after this long */
+
+static void sleep_ms(int64_t ms)
 {
-	int r = bro2_connect(dev);
-	if (r)
-		return SANE_STATUS_IO_ERROR;
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000,
+	};
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
 
-	r = bro2_read_status(dev);
-	if (r == 401) {
-		/* should we retry? */
-		return SANE_STATUS_DEVICE_BUSY;
-	} else if (r != 200) {
-		return SANE_STATUS_IO_ERROR;
+/* returned by bro2_session_step() while waiting on the scanner */
+#define BRO2_PENDING (-1)
+
+/* One read() of the negotiation reply, up to @max bytes buffered */
+static ssize_t bro2_neg_read(struct bro2_device *dev, size_t max)
+{
+	ssize_t r = read(dev->fd, dev->neg + dev->neg_len, max - dev->neg_len);
+	if (r > 0) {
+		dev->neg_len += r;
+		dev->neg[dev->neg_len] = '\0';
 	}
+	return r;
+}
 
+static void bro2_busy_backoff(struct bro2_device *dev)
+{
+	long backoff_min = env_long("BRO2_BUSY_BACKOFF_MS", BRO2_BUSY_BACKOFF_MS);
+	long backoff_max = env_long("BRO2_BUSY_BACKOFF_MAX_MS", BRO2_BUSY_BACKOFF_MAX_MS);
+
+	dev->busy_backoff = dev->busy_backoff
+		? MIN(dev->busy_backoff * 2, backoff_max) : backoff_min;
+	dev->busy_until = now_ms() + dev->busy_backoff;
+}
+
+/*
+ * Move the session towards @target (BRO2_SESS_READY for a connection whose
+ * status banner has been read, BRO2_SESS_SCAN to have sent X) without
+ * blocking. Returns 0 once there, BRO2_PENDING when waiting on the scanner
+ * (on bro2_select_fd()), or a SANE_Status.
+ *
+ * A scanner that is busy with another client answers 401 and hangs up. We
+ * wait a doubling delay before trying again, and remember it across calls
+ * so a frontend that retries straight away doesn't get to reconnect any
+ * faster. Without @block, that is reported as DEVICE_BUSY rather than
+ * waited out.
+ */
+static int bro2_session_step(struct bro2_device *dev, int target, bool block)
+{
+	int nums[BRO2_MSG_I_CT];
+	const int *cached;
+	ssize_t r;
+
+	while (dev->sess < target) {
+		switch (dev->sess) {
+		case BRO2_SESS_IDLE:
+			if (dev->busy_until > now_ms())
+				return block ? BRO2_PENDING : SANE_STATUS_DEVICE_BUSY;
+
+			/* normally already started when the last session
+			 * ended */
+			bro2_spare_start(dev);
+			if (!dev->spare_live)
+				return SANE_STATUS_IO_ERROR;
+			dev->sess = BRO2_SESS_CONNECTING;
+			break;
+
+		case BRO2_SESS_CONNECTING:
+			r = net_connect_complete(dev->spare);
+			if (r == -1 && errno == EINPROGRESS)
+				return BRO2_PENDING;
+
+			dev->spare_live = false;
+			if (r == -1) {
+				DBG(1, "connect failed: %s\n", strerror(errno));
+				dev->sess = BRO2_SESS_IDLE;
+				/* resolving again helps if the scanner has
+				 * picked up a new DHCP lease */
+				if (dev->sess_tries++ || bro2_resolve(dev))
+					return SANE_STATUS_IO_ERROR;
+				break;
+			}
+
+			fcntl(r, F_SETFL, fcntl(r, F_GETFL) | O_NONBLOCK);
+			dev->fd = r;
+			dev->neg_len = 0;
+			dev->sess = BRO2_SESS_STATUS;
+			break;
+
+		case BRO2_SESS_STATUS:
+			r = bro2_neg_read(dev, sizeof(dev->neg) - 1);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return BRO2_PENDING;
+			if (r < 0 && errno == EINTR)
+				break;
+			if (r <= 0) {
+				/* the spare may have sat idle long enough to
+				 * be dropped, try a fresh one before giving up */
+				DBG(1, "no status: %s\n", r ? strerror(errno) : "eof");
+				bro2_hangup(dev);
+				if (dev->sess_tries++)
+					return SANE_STATUS_IO_ERROR;
+				break;
+			}
+
+			if (!strstr(dev->neg, "\r\n")) {
+				if (dev->neg_len < sizeof(dev->neg) - 1)
+					break;
+				bro2_hangup(dev);
+				return SANE_STATUS_IO_ERROR;
+			}
+
+			r = bro2_parse_status(dev->neg, dev->neg_len);
+			if (r == 401) {
+				bro2_hangup(dev);
+				bro2_busy_backoff(dev);
+				break;
+			} else if (r != 200) {
+				bro2_hangup(dev);
+				return SANE_STATUS_IO_ERROR;
+			}
+
+			dev->busy_backoff = 0;
+			dev->busy_until = 0;
+			dev->sess = BRO2_SESS_READY;
+			break;
+
+		case BRO2_SESS_READY:
+			if (bro2_c256(dev) && !dev->have_palette) {
+				if (bro2_send_P(dev)) {
+					DBG(1, "send P failed\n");
+					return SANE_STATUS_IO_ERROR;
+				}
+				dev->neg_len = 0;
+				dev->sess = BRO2_SESS_P;
+				break;
+			}
+
+			cached = bro2_info_find(dev, dev->x_res, dev->y_res, dev->mode);
+			if (cached) {
+				DBG(2, "I response for R=%d,%d M=%s is cached\n",
+						dev->x_res, dev->y_res, dev->mode);
+				bro2_apply_I(dev, cached);
+				goto send_X;
+			}
+
+			if (bro2_send_I(dev, dev->x_res, dev->y_res, dev->mode)) {
+				DBG(1, "send I failed\n");
+				return SANE_STATUS_IO_ERROR;
+			}
+			dev->neg_len = 0;
+			dev->sess = BRO2_SESS_I;
+			break;
+
+		case BRO2_SESS_P: {
+			size_t want = 2;
+			if (dev->neg_len >= 2)
+				want += (uint8_t)dev->neg[0] | ((uint8_t)dev->neg[1] << 8);
+
+			if (want < sizeof(dev->neg) && dev->neg_len < want) {
+				r = bro2_neg_read(dev, want);
+				if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return BRO2_PENDING;
+				if (r < 0 && errno == EINTR)
+					break;
+				if (r > 0)
+					break;
+				DBG(1, "no P response: %s\n", r ? strerror(errno) : "eof");
+			}
+
+			if (dev->neg_len == want)
+				bro2_palette_done(dev, (uint8_t *)dev->neg + 2, want - 2);
+			else
+				bro2_palette_done(dev, NULL, 0);
+			break;
+		}
+
+		case BRO2_SESS_I: {
+			size_t want = 2;
+			if (dev->neg_len >= 2)
+				want += (uint8_t)dev->neg[0] | ((uint8_t)dev->neg[1] << 8);
+			if (want >= sizeof(dev->neg)) {
+				DBG(1, "bad I response length: %zu\n", want - 2);
+				return SANE_STATUS_IO_ERROR;
+			}
+
+			if (dev->neg_len < want) {
+				r = bro2_neg_read(dev, want);
+				if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return BRO2_PENDING;
+				if (r < 0 && errno == EINTR)
+					break;
+				if (r <= 0) {
+					DBG(1, "error in read: %s\n",
+							r ? strerror(errno) : "eof");
+					return SANE_STATUS_IO_ERROR;
+				}
+				break;
+			}
+
+			if (want == 2 || bro2_parse_I(dev->neg + 2, want - 2, nums)) {
+				DBG(1, "handle I resp failed\n");
+				return SANE_STATUS_IO_ERROR;
+			}
+
+			bro2_info_add(dev, dev->x_res, dev->y_res, dev->mode, nums);
+			bro2_apply_I(dev, nums);
+		}
+		send_X:
+			bro2_set_area(dev);
+			if (bro2_send_X(dev)) {
+				DBG(1, "send X failed\n");
+				return SANE_STATUS_IO_ERROR;
+			}
+			dev->sess = BRO2_SESS_SCAN;
+			break;
+
+		case BRO2_SESS_SCAN:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+#define BRO2_CONNECT_TIMEOUT_MS 5000
+/* P isn't known to be answered by every model */
+#define BRO2_PALETTE_TIMEOUT_MS 2000
+
+/* Wait for bro2_session_step() to be able to make progress */
+static int bro2_session_wait(struct bro2_device *dev, int64_t give_up)
+{
+	int64_t wait;
+	int r;
+
+	switch (dev->sess) {
+	case BRO2_SESS_IDLE:
+		/* backing off after a 401 */
+		wait = dev->busy_until - now_ms();
+		if (wait <= 0)
+			return 0;
+		if (now_ms() + wait > give_up)
+			return SANE_STATUS_DEVICE_BUSY;
+		DBG(2, "scanner busy, waiting %lld ms\n", (long long)wait);
+		sleep_ms(wait);
+		return 0;
+
+	case BRO2_SESS_CONNECTING:
+		r = poll(dev->spare, 2, BRO2_CONNECT_TIMEOUT_MS);
+		if (r == 0) {
+			DBG(1, "connect timed out\n");
+			bro2_spare_drop(dev);
+			dev->sess = BRO2_SESS_IDLE;
+			return SANE_STATUS_IO_ERROR;
+		}
+		break;
+
+	case BRO2_SESS_P:
+		r = poll(&(struct pollfd) { .fd = dev->fd, .events = POLLIN }, 1,
+				BRO2_PALETTE_TIMEOUT_MS);
+		if (r == 0) {
+			DBG(1, "P timed out\n");
+			bro2_palette_done(dev, NULL, 0);
+			return 0;
+		}
+		break;
+
+	default:
+		/* FIXME: timeout at some point. */
+		r = bro2_wait_fd(dev->fd, POLLIN);
+		break;
+	}
+
+	if (r < 0 && errno != EINTR)
+		return SANE_STATUS_IO_ERROR;
 	return 0;
 }
 
+static int bro2_session_run(struct bro2_device *dev, int target, bool block)
+{
+	int64_t give_up = now_ms() + env_long("BRO2_BUSY_TIMEOUT_MS", BRO2_BUSY_TIMEOUT_MS);
+	int r;
+
+	for (;;) {
+		r = bro2_session_step(dev, target, block);
+		if (r != BRO2_PENDING || !block)
+			return r;
+
+		r = bro2_session_wait(dev, give_up);
+		if (r)
+			return r;
+	}
+}
+
+/*
+ * BRO2_TRACE=n keeps the last n data path events of each device (see
+ * bro2-evlog.h). They're written to BRO2_TRACE_FILE, or stderr, for every
+ * open device on SIGUSR1 and for a device whose read fails.
+ */
+#define BRO2_TRACE_DEVS 16
+
+static struct bro2_device *traced[BRO2_TRACE_DEVS];
+static int trace_fd = STDERR_FILENO;
+
+static void bro2_trace_dump(struct bro2_device *dev)
+{
+	if (dev->trace.ev)
+		bro2_evlog_dump(&dev->trace, dev->addr, trace_fd);
+}
+
+static void bro2_trace_sig(int sig)
+{
+	unsigned i;
+	for (i = 0; i < BRO2_TRACE_DEVS; i++) {
+		struct bro2_device *dev = __atomic_load_n(&traced[i],
+				__ATOMIC_ACQUIRE);
+		if (dev)
+			bro2_trace_dump(dev);
+	}
+}
+
+static void bro2_trace_setup(void)
+{
+	const char *path = getenv("BRO2_TRACE_FILE");
+	struct sigaction sa;
+
+	if (path && *path) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+				0644);
+		if (fd != -1)
+			trace_fd = fd;
+		else
+			DBG(1, "can't open %s: %s\n", path, strerror(errno));
+	}
+
+	/* leave SIGUSR1 alone if the frontend has a use for it */
+	if (sigaction(SIGUSR1, NULL, &sa) || sa.sa_handler != SIG_DFL)
+		return;
+	sa = (typeof(sa)) {
+		.sa_handler = bro2_trace_sig,
+		.sa_flags = SA_RESTART,
+	};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void bro2_trace_open(struct bro2_device *dev)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	long ct = env_long("BRO2_TRACE", 0);
+	unsigned i;
+
+	if (!ct)
+		return;
+	if (bro2_evlog_init(&dev->trace, ct)) {
+		DBG(1, "no memory for %ld trace events\n", ct);
+		return;
+	}
+	pthread_once(&once, bro2_trace_setup);
+
+	for (i = 0; i < BRO2_TRACE_DEVS; i++) {
+		struct bro2_device *none = NULL;
+		if (__atomic_compare_exchange_n(&traced[i], &none, dev, false,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+	DBG(1, "more than %d devices traced, SIGUSR1 skips %s\n",
+			BRO2_TRACE_DEVS, dev->addr);
+}
+
+static void bro2_trace_close(struct bro2_device *dev)
+{
+	unsigned i;
+	for (i = 0; i < BRO2_TRACE_DEVS; i++) {
+		struct bro2_device *it = dev;
+		__atomic_compare_exchange_n(&traced[i], &it, NULL, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	bro2_evlog_free(&dev->trace);
+}
+
 #define STR(x) STR_(x)
 #define STR_(x) #x
 
 SANE_Status sane_open(SANE_String_Const name, SANE_Handle *h)
 {
 	struct bro2_device *dev = malloc(sizeof(*dev));
-	*h = dev;
+	const char *stats_dir = getenv("BRO2_STATS_DIR");
+	SANE_Status r = SANE_STATUS_NO_MEM;
+
+	*h = NULL;
+	if (!dev)
+		return SANE_STATUS_NO_MEM;
 
 	bro2_init(dev, name);
-	int r = bro2_connect_and_get_status(dev);
+	bro2_trace_open(dev);
+
+	if (stats_dir && !*stats_dir)
+		stats_dir = NULL;
+	if (bro2_stats_open(&dev->stats, stats_dir, name))
+		goto fail;
+	if (stats_dir && !dev->stats.path)
+		DBG(1, "can't share stats in %s: %s\n", stats_dir, strerror(errno));
+
+	if (bro2_select_init(dev))
+		goto fail;
+
+	r = bro2_session_run(dev, BRO2_SESS_READY, true);
 	if (r)
-		return r;
+		goto fail;
+
+	/* the option can't be set before we're opened, allow asking for the
+	 * prefetch from the environment too */
+	dev->prefetch_info = env_long("BRO2_PREFETCH_INFO", 0) != 0;
+	dev->readahead = MIN(env_long("BRO2_READAHEAD", 0), BRO2_READAHEAD_MAX);
+	if (dev->prefetch_info && bro2_info_prefetch(dev)) {
+		DBG(1, "I prefetch failed\n");
+		bro2_hangup(dev);
+	}
 
+	*h = dev;
 	return SANE_STATUS_GOOD;
+
+fail:
+	/* everything sane_close() undoes is safe to undo from bro2_init() on */
+	sane_close(dev);
+	return r;
 }
 
 void sane_close(SANE_Handle h)
-{}
+{
+	struct bro2_device *dev = h;
+	bro2_hangup(dev);
+	bro2_ra_free(dev->ra);
+	bro2_spare_drop(dev);
+	bro2_select_free(dev);
+	if (dev->res)
+		freeaddrinfo(dev->res);
+	bro2_jpeg_free(dev->jpeg);
+	bro2_file_free(&dev->file);
+	bro2_arena_free(&dev->bufs);
+	bro2_trace_close(dev);
+	bro2_stats_close(&dev->stats);
+	free(dev);
+}
 
 #define SANE_STR(thing)		\
 	.name = SANE_NAME_##thing,	\
@@ -699,6 +2014,12 @@ static SANE_Range range_percent = {
 	.quant = 1
 };
 
+static SANE_Range range_readahead = {
+	.min = 0,
+	.max = BRO2_READAHEAD_MAX,
+	.quant = 1
+};
+
 #define OPT_PX_CORD(it)				\
 	SANE_STR(SCAN_##it),			\
 	.type = SANE_TYPE_INT,			\
@@ -746,6 +2067,68 @@ static SANE_Option_Descriptor mfc7820n_opts [] = {
 		.cap = SANE_CAP_SOFT_SELECT,
 		.constraint_type = SANE_CONSTRAINT_RANGE,
 		.constraint = { .range = &range_percent }
+	}, {
+		.name = "jpeg-raw",
+		.title = "Pass JPEG Through",
+		.desc = "With JPEG compression, return the compressed bitstream "
+			"as sent by the scanner instead of decoded RGB lines. "
+			"The parameters then say 8 bit gray, a line per pixel "
+			"of width; the stream ends at EOF, not after so many "
+			"lines.",
+		.type = SANE_TYPE_BOOL,
+		.unit = SANE_UNIT_NONE,
+		.size = sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_SELECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "prefetch-info",
+		.title = "Prefetch Scan Geometry",
+		.desc = "Ask the scanner about every common resolution in the "
+			"current mode up front, so later scans at any of them "
+			"start without the extra round trip.",
+		.type = SANE_TYPE_BOOL,
+		.unit = SANE_UNIT_NONE,
+		.size = sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_SELECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "readahead",
+		.title = "Readahead Buffers",
+		.desc = "Receive from the scanner in the background into this many "
+			"64KiB buffers, so it isn't held up while the frontend is "
+			"busy between reads. 0 to receive only when read from.",
+		.type = SANE_TYPE_INT,
+		.unit = SANE_UNIT_NONE,
+		.size = sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_SELECT,
+		.constraint_type = SANE_CONSTRAINT_RANGE,
+		.constraint = { .range = &range_readahead },
+	}, {
+		.name = "auto-area",
+		.title = "Find The Document",
+		.desc = "Preview the whole bed at " STR(BRO2_PREVIEW_RES) "dpi "
+			"before each scan, and scan only the document found on "
+			"it (the whole bed if there's nothing). The scan area "
+			"options are set to what was scanned. For the flatbed, "
+			"with the feeder loaded the preview takes its first "
+			"page.",
+		.type = SANE_TYPE_BOOL,
+		.unit = SANE_UNIT_NONE,
+		.size = sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_SELECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "resample",
+		.title = "Resample",
+		.desc = "When the scanner won't scan at the resolution asked "
+			"for, scale what it sends to that rather than giving "
+			"up the resolution. Not for line art or undecoded "
+			"JPEG.",
+		.type = SANE_TYPE_BOOL,
+		.unit = SANE_UNIT_NONE,
+		.size = sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_SELECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
 	}, {
 		SANE_STR(SCAN_MODE),
 		.type = SANE_TYPE_STRING,
@@ -771,6 +2154,52 @@ static SANE_Option_Descriptor mfc7820n_opts [] = {
 		.size = SETTING_STR_LEN,
 		.cap = SANE_CAP_SOFT_SELECT,
 		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "output-file",
+		.title = "Scan To File",
+		.desc = "Write each page to this file instead of returning it: "
+			"PNM, a G4 compressed TIFF for TEXT and ERRDIF, or the "
+			"JPEG as is with jpeg-raw. The first %d is replaced by "
+			"the page's number. sane_read() then hands out no data, "
+			"and in blocking mode returns once the page is written. "
+			"Empty to return pages as usual.",
+		.type = SANE_TYPE_STRING,
+		.unit = SANE_UNIT_NONE,
+		.size = BRO2_PATH_SZ,
+		.cap = SANE_CAP_SOFT_SELECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "page-blank",
+		.title = "Page Is Blank",
+		.desc = "Whether the page last read to its end had next to "
+			"nothing on it. Always false with jpeg-raw.",
+		.type = SANE_TYPE_BOOL,
+		.unit = SANE_UNIT_NONE,
+		.size = sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_DETECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "page-content",
+		.title = "Page Content Area",
+		.desc = "The box around what's on the page last read to its "
+			"end: left, top, right and bottom pixel, inclusive. All "
+			"-1 if there was nothing, or with jpeg-raw.",
+		.type = SANE_TYPE_INT,
+		.unit = SANE_UNIT_PIXEL,
+		.size = 4 * sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_DETECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
+	}, {
+		.name = "page-levels",
+		.title = "Page Levels",
+		.desc = "Of the page last read to its end: the darkest sample, "
+			"the mean sample and the number of pixels darker than "
+			"the paper. -1, -1, 0 with jpeg-raw.",
+		.type = SANE_TYPE_INT,
+		.unit = SANE_UNIT_NONE,
+		.size = 3 * sizeof(SANE_Word),
+		.cap = SANE_CAP_SOFT_DETECT,
+		.constraint_type = SANE_CONSTRAINT_NONE,
 	}
 };
 
@@ -818,6 +2247,11 @@ SANE_Status sane_control_option(SANE_Handle h, SANE_Int n, SANE_Action a, void *
 		case OPT_BR_Y:
 		case OPT_B:
 		case OPT_C:
+		case OPT_JPEG_RAW:
+		case OPT_PREFETCH_INFO:
+		case OPT_READAHEAD:
+		case OPT_AUTO_AREA:
+		case OPT_RESAMPLE:
 			*(SANE_Int *)v = dev->int_opts[n-1];
 			break;
 		case OPT_MODE:
@@ -825,6 +2259,27 @@ SANE_Status sane_control_option(SANE_Handle h, SANE_Int n, SANE_Action a, void *
 		case OPT_D:
 			strcpy(v, dev->str_opts[n-OPT_FIRST_STR]);
 			break;
+		case OPT_OUTPUT_FILE:
+			strcpy(v, dev->output_file);
+			break;
+		case OPT_PAGE_BLANK:
+			*(SANE_Bool *)v = dev->last_page.blank;
+			break;
+		case OPT_PAGE_CONTENT: {
+			SANE_Int *box = v;
+			box[0] = dev->last_page.tl_x;
+			box[1] = dev->last_page.tl_y;
+			box[2] = dev->last_page.br_x;
+			box[3] = dev->last_page.br_y;
+			break;
+		}
+		case OPT_PAGE_LEVELS: {
+			SANE_Int *lv = v;
+			lv[0] = dev->last_page.min;
+			lv[1] = dev->last_page.mean;
+			lv[2] = MIN(dev->last_page.ink, INT_MAX);
+			break;
+		}
 		default:
 			return SANE_STATUS_INVAL;
 		}
@@ -839,13 +2294,34 @@ SANE_Status sane_control_option(SANE_Handle h, SANE_Int n, SANE_Action a, void *
 		case OPT_BR_Y:
 		case OPT_B:
 		case OPT_C:
+		case OPT_JPEG_RAW:
+		case OPT_AUTO_AREA:
+		case OPT_RESAMPLE:
+			dev->int_opts[n-1] = *(SANE_Int *)v;
+			break;
+		case OPT_READAHEAD:
+			/* taken up by the next sane_start() */
+			dev->readahead = MAX(0, MIN(*(SANE_Int *)v,
+						BRO2_READAHEAD_MAX));
+			break;
+		case OPT_PREFETCH_INFO:
 			dev->int_opts[n-1] = *(SANE_Int *)v;
+			if (dev->prefetch_info && bro2_info_prefetch(dev)) {
+				/* leave it to sane_start() to reconnect */
+				DBG(1, "I prefetch failed\n");
+				bro2_hangup(dev);
+			}
 			break;
 		case OPT_MODE:
 		case OPT_COMPRESS:
 		case OPT_D:
 			strcpy(dev->str_opts[n-OPT_FIRST_STR], v);
 			break;
+		case OPT_OUTPUT_FILE:
+			/* taken up by the next page */
+			snprintf(dev->output_file, sizeof(dev->output_file),
+					"%s", (char *)v);
+			break;
 		default:
 			return SANE_STATUS_INVAL;
 		}
@@ -857,13 +2333,296 @@ SANE_Status sane_control_option(SANE_Handle h, SANE_Int n, SANE_Action a, void *
 	return SANE_STATUS_IO_ERROR;
 }
 
+static SANE_Status bro2_start_finish(struct bro2_device *dev, bool block);
+
 SANE_Status sane_get_parameters(SANE_Handle h, SANE_Parameters *p)
 {
 	struct bro2_device *dev = h;
+
+	/* the geometry isn't settled until the I response is in. That is
+	 * usually cached or already waiting (see prefetch-info), otherwise
+	 * this is the one place a non-blocking start waits. */
+	if (dev->start_pending) {
+		SANE_Status r = bro2_start_finish(dev, true);
+		bro2_select_update(dev, false);
+		if (r)
+			return r;
+	}
+
 	*p = dev->param;
 	return SANE_STATUS_GOOD;
 }
 
+/* Create the page's file, output-file with the first %d replaced by its
+ * number */
+static SANE_Status bro2_file_page(struct bro2_device *dev)
+{
+	const char *pct = strstr(dev->output_file, "%d");
+	char path[BRO2_PATH_SZ + 16];
+	int kind = BRO2_FILE_PNM;
+
+	dev->file_seq++;
+	if (pct)
+		snprintf(path, sizeof(path), "%.*s%u%s",
+				(int)(pct - dev->output_file), dev->output_file,
+				dev->file_seq, pct + 2);
+	else
+		snprintf(path, sizeof(path), "%s", dev->output_file);
+
+	if (!strcmp(dev->compress, "JPEG") && !bro2_jpeg_decoding(dev))
+		kind = BRO2_FILE_RAW;
+	else if (dev->param.depth == 1)
+		kind = BRO2_FILE_TIFF;
+
+	if (bro2_file_begin(&dev->file, path, kind, dev->param.pixels_per_line,
+				dev->param.format == SANE_FRAME_RGB ? 3 : 1,
+				dev->param.depth, dev->x_res, dev->y_res)) {
+		DBG(1, "can't write %s: %s\n", path, strerror(errno));
+		return errno == ENOMEM ? SANE_STATUS_NO_MEM : SANE_STATUS_IO_ERROR;
+	}
+	return SANE_STATUS_GOOD;
+}
+
+/* Per page decode state, everything but the framer (which may already hold
+ * the start of the next page) */
+static SANE_Status bro2_page_start(struct bro2_device *dev)
+{
+	dev->rlength = !strcmp(dev->compress, "RLENGTH");
+	dev->scan_done = false;
+	dev->page_end = 0;
+	dev->decode_err = SANE_STATUS_GOOD;
+
+	bro2_pipe_reset(&dev->pipe);
+	bro2_blank_reset(&dev->blank);
+	dev->page_read = false;
+	if (dev->resampling)
+		bro2_rs_reset(&dev->rs);
+	dev->rs_fill = dev->rs_len = dev->rs_pos = 0;
+
+	if (bro2_jpeg_decoding(dev)) {
+		if (!dev->jpeg)
+			dev->jpeg = bro2_jpeg_new();
+		if (!dev->jpeg)
+			return SANE_STATUS_NO_MEM;
+		bro2_jpeg_reset(dev->jpeg);
+	} else if (dev->jpeg) {
+		bro2_jpeg_free(dev->jpeg);
+		dev->jpeg = NULL;
+	}
+
+	if (dev->output_file[0] && !dev->previewing)
+		return bro2_file_page(dev);
+	return SANE_STATUS_GOOD;
+}
+
+/* Hand the socket to a readahead thread for the rest of the session, if
+ * asked to. Without one (if it can't be had) we just receive directly. */
+static void bro2_readahead_begin(struct bro2_device *dev)
+{
+	dev->ra_live = false;
+	if (dev->readahead <= 0)
+		return;
+
+	if (dev->ra && dev->ra->depth != (unsigned)dev->readahead) {
+		bro2_ra_free(dev->ra);
+		dev->ra = NULL;
+	}
+	if (!dev->ra)
+		dev->ra = bro2_ra_new(dev->readahead, BRO2_RING_SZ);
+	if (!dev->ra || bro2_ra_start(dev->ra, dev->fd)) {
+		DBG(1, "no readahead, receiving directly\n");
+		return;
+	}
+	dev->ra_live = true;
+}
+
+/* Frame ring size for the negotiated parameters: BRO2_RING_LINES of the
+ * largest records the mode has, a color plane or a whole line otherwise.
+ * JPEG isn't sent in lines. */
+static size_t bro2_ring_size(struct bro2_device *dev)
+{
+	size_t want = BRO2_RING_LINES * (dev->scan.pixels_per_line + 3);
+	size_t sz = BRO2_RING_MIN;
+
+	if (!strcmp(dev->compress, "JPEG"))
+		return BRO2_RING_SZ;
+	while (sz < want && sz < BRO2_RING_SZ)
+		sz <<= 1;
+	return sz;
+}
+
+/* Carve the scan's buffers out of dev->bufs. The geometry holds for every
+ * page of a batch, so this is done once per scan, and allocates only when
+ * a scan needs more than any before it on this handle. */
+static SANE_Status bro2_bufs_layout(struct bro2_device *dev)
+{
+	size_t ring_sz = bro2_ring_size(dev);
+	size_t width = dev->scan.pixels_per_line;
+	unsigned channels = dev->param.format == SANE_FRAME_RGB ? 3 : 1;
+	enum bro2_pipe_kind kind = bro2_pipe_kind(dev);
+	size_t pipe_sz = bro2_pipe_mem_sz(kind, width);
+	size_t rs_sz = 0;
+	size_t total = BRO2_ARENA_SZ(ring_sz) + BRO2_ARENA_SZ(pipe_sz)
+		+ BRO2_ARENA_SZ(dev->param.bytes_per_line);
+	unsigned depth = dev->param.depth;
+
+	if (dev->resampling) {
+		rs_sz = bro2_rs_mem_sz(width, channels, dev->scan_x_res,
+				dev->x_res, dev->scan_y_res, dev->y_res);
+		total += BRO2_ARENA_SZ(rs_sz)
+			+ BRO2_ARENA_SZ(dev->param.bytes_per_line);
+	}
+
+	bro2_frame_reset(&dev->frame);
+	if (bro2_arena_reset(&dev->bufs, total))
+		return SANE_STATUS_NO_MEM;
+
+	bro2_frame_attach(&dev->frame, bro2_arena_take(&dev->bufs, ring_sz),
+			ring_sz);
+	bro2_pipe_init(&dev->pipe, kind, width, dev->lut,
+			bro2_arena_take(&dev->bufs, pipe_sz));
+	if (dev->resampling) {
+		bro2_rs_init(&dev->rs, width, channels, dev->scan_x_res,
+				dev->x_res, dev->scan_y_res, dev->y_res,
+				bro2_arena_take(&dev->bufs, rs_sz));
+		dev->rs_line = bro2_arena_take(&dev->bufs,
+				dev->param.bytes_per_line);
+	}
+
+	/* the JPEG bitstream isn't pixels */
+	if (!strcmp(dev->compress, "JPEG") && !bro2_jpeg_decoding(dev))
+		depth = 0;
+	bro2_blank_init(&dev->blank, dev->param.pixels_per_line, channels, depth,
+			MIN(env_long("BRO2_BLANK_WHITE", BRO2_BLANK_WHITE), 0xff),
+			bro2_arena_take(&dev->bufs, dev->param.bytes_per_line));
+	return SANE_STATUS_GOOD;
+}
+
+/* X has been sent, the first page follows */
+static SANE_Status bro2_scan_begin(struct bro2_device *dev)
+{
+	SANE_Status r = bro2_bufs_layout(dev);
+	if (r)
+		return r;
+	dev->batch_pages = 0;
+	bro2_readahead_begin(dev);
+	return bro2_page_start(dev);
+}
+
+static SANE_Status bro2_read(struct bro2_device *dev, SANE_Byte *buf,
+		SANE_Int maxlen, SANE_Int *len);
+
+/*
+ * auto-area: scan the whole bed at BRO2_PREVIEW_RES, in a session of its
+ * own, and keep the box around what's on it for bro2_set_area(). Always
+ * blocking. The outcome for the last page read is left as it was.
+ */
+static SANE_Status bro2_preview(struct bro2_device *dev)
+{
+	int x_res = dev->x_res, y_res = dev->y_res;
+	char mode[SETTING_STR_LEN], compress[SETTING_STR_LEN];
+	struct bro2_blank_page last = dev->last_page;
+	bool nonblock = dev->nonblock;
+	uint8_t buf[1 << 14];
+	SANE_Status r;
+	SANE_Int n;
+
+	memcpy(mode, dev->mode, sizeof(mode));
+	memcpy(compress, dev->compress, sizeof(compress));
+	strcpy(dev->mode, BRO2_PREVIEW_MODE);
+	strcpy(dev->compress, "RLENGTH");
+	dev->x_res = dev->y_res = BRO2_PREVIEW_RES;
+	dev->tl_x = dev->tl_y = 0;
+	dev->area.found = false;
+	dev->previewing = true;
+	dev->nonblock = false;
+
+	dev->sess_tries = 0;
+	r = bro2_session_run(dev, BRO2_SESS_SCAN, true);
+	if (!r)
+		r = bro2_scan_begin(dev);
+	while (!r)
+		r = bro2_read(dev, buf, sizeof(buf), &n);
+
+	if (r == SANE_STATUS_EOF) {
+		const struct bro2_blank_page *pg = &dev->last_page;
+		if (!pg->blank) {
+			dev->area.found = true;
+			dev->area.x_res = dev->x_res;
+			dev->area.y_res = dev->y_res;
+			dev->area.x0 = MAX(pg->tl_x - BRO2_PREVIEW_MARGIN, 0);
+			dev->area.y0 = MAX(pg->tl_y - BRO2_PREVIEW_MARGIN, 0);
+			dev->area.x1 = MIN(pg->br_x + 1 + BRO2_PREVIEW_MARGIN,
+					dev->param.pixels_per_line);
+			dev->area.y1 = MIN(pg->br_y + 1 + BRO2_PREVIEW_MARGIN,
+					(int)dev->blank.rows);
+			DBG(2, "auto-area: %d,%d to %d,%d at %d,%d dpi\n",
+					dev->area.x0, dev->area.y0,
+					dev->area.x1, dev->area.y1,
+					dev->area.x_res, dev->area.y_res);
+		} else {
+			DBG(2, "auto-area: nothing found, scanning the bed\n");
+		}
+		r = SANE_STATUS_GOOD;
+	}
+
+	/* the real scan is a session of its own. From the feeder the next
+	 * page would be waiting for another X, it can have that. */
+	if (dev->batch == BRO2_BATCH_MORE || r) {
+		bro2_hangup(dev);
+		bro2_spare_start(dev);
+	}
+	dev->batch = BRO2_BATCH_NONE;
+
+	dev->x_res = x_res;
+	dev->y_res = y_res;
+	memcpy(dev->mode, mode, sizeof(mode));
+	memcpy(dev->compress, compress, sizeof(compress));
+	dev->last_page = last;
+	dev->previewing = false;
+	dev->nonblock = nonblock;
+	return r;
+}
+
+static SANE_Status bro2_start(struct bro2_device *dev)
+{
+	int r;
+
+	dev->start_pending = false;
+	switch (dev->batch) {
+	case BRO2_BATCH_DONE:
+		dev->batch = BRO2_BATCH_NONE;
+		return SANE_STATUS_NO_DOCS;
+	case BRO2_BATCH_MORE:
+		/* already negotiated, and the data may already be buffered */
+		DBG(2, "continuing feeder batch, page %u\n", dev->batch_pages + 1);
+		return bro2_page_start(dev);
+	case BRO2_BATCH_NONE:
+		break;
+	}
+
+	if (dev->auto_area) {
+		SANE_Status s = bro2_preview(dev);
+		if (s)
+			return s;
+	}
+
+	/* connect and negotiate parameters. In non-blocking mode whatever
+	 * is left is finished by sane_read(). */
+	dev->sess_tries = 0;
+	r = bro2_session_run(dev, BRO2_SESS_SCAN, !dev->nonblock);
+	if (r == BRO2_PENDING) {
+		dev->start_pending = true;
+		dev->scan_done = false;
+		dev->pipe.out_len = dev->pipe.out_pos = 0;
+		return SANE_STATUS_GOOD;
+	}
+	if (r)
+		return r;
+
+	return bro2_scan_begin(dev);
+}
+
 SANE_Status sane_start(SANE_Handle h)
 {
 #if 0
@@ -881,27 +2640,441 @@ have changed.
 #endif
 
 	struct bro2_device *dev = h;
-	/* negotiate parameters */
-	int r = bro2_send_I(dev);
+	SANE_Status r = bro2_start(dev);
 
-	if (r) {
-		DBG(1, "send I failed\n");
-		return SANE_STATUS_IO_ERROR;
+	/* the next page of a batch may already be buffered */
+	bro2_select_update(dev, bro2_frame_buffered(&dev->frame) != 0);
+	return r;
+}
+
+/* Finish a start that returned before the scanner was ready for it */
+static SANE_Status bro2_start_finish(struct bro2_device *dev, bool block)
+{
+	int r = bro2_session_run(dev, BRO2_SESS_SCAN, block);
+	if (r == BRO2_PENDING)
+		return SANE_STATUS_GOOD;
+
+	dev->start_pending = false;
+	if (r)
+		return r;
+	return bro2_scan_begin(dev);
+}
+
+/*
+ * With C=RLENGTH the scanner still sends some records uncompressed (every
+ * CGRAY capture in PROTO has plain 0x44 records exactly one line long), so
+ * only records that aren't exactly a line are run through the decoder.
+ */
+static bool bro2_rec_is_rle(struct bro2_device *dev, struct bro2_frame *f)
+{
+	return dev->rlength && f->len != bro2_pipe_rec_bytes(&dev->pipe, f->type);
+}
+
+static void bro2_rec_start(struct bro2_device *dev, struct bro2_frame *f)
+{
+	dev->rec_type = f->type;
+	dev->rec_rle = bro2_rec_is_rle(dev, f);
+	dev->rec_drop = dev->pipe.ops->drop(f->type);
+	bro2_evlog_add(&dev->trace, dev->rec_drop ? BRO2_EV_DROP : BRO2_EV_RECORD,
+			f->type, f->len, dev->rec_rle);
+	bro2_stat_add(dev, records[bro2_stats_type(f->type)], 1);
+}
+
+/* Top up the frame ring from the socket */
+static ssize_t bro2_fill(struct bro2_device *dev, struct bro2_frame *f,
+		int flags)
+{
+	size_t room = f->ring_sz - bro2_frame_buffered(f);
+	ssize_t r;
+
+	if (dev->ra_live) {
+		uint8_t *dst;
+		room = bro2_frame_space(f, &dst);
+		if (!room) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		r = bro2_ra_read(dev->ra, dst, room);
+		if (r > 0)
+			bro2_frame_commit(f, r);
+	} else {
+		r = bro2_frame_fill(f, dev->fd, flags);
+	}
+	if (r > 0) {
+		bro2_evlog_add(&dev->trace, BRO2_EV_RECV, f->type, r, room);
+		bro2_stat_add(dev, bytes, r);
 	}
+	return r;
+}
 
-	r = bro2_recv_I_response(dev);
-	if (r) {
-		DBG(1, "handle I resp failed\n");
-		return SANE_STATUS_IO_ERROR;
+static void bro2_page_end(struct bro2_device *dev, int type)
+{
+	DBG(1, "scan terminator: %#x\n", type);
+	bro2_evlog_add(&dev->trace, BRO2_EV_PAGE_END, type, 0, 0);
+	dev->scan_done = true;
+	dev->page_end = type;
+
+	switch (type) {
+	case BRO2_END_PAGE_MORE:
+		dev->batch = BRO2_BATCH_MORE;
+		dev->batch_pages++;
+		bro2_stat_add(dev, pages, 1);
+		return;
+	case BRO2_END_PAGE:
+		dev->batch = dev->batch == BRO2_BATCH_MORE
+			? BRO2_BATCH_DONE : BRO2_BATCH_NONE;
+		dev->batch_pages++;
+		bro2_stat_add(dev, pages, 1);
+		bro2_stat_add(dev, batches, 1);
+		bro2_stat_add(dev, batch_pages[MIN(dev->batch_pages,
+					BRO2_STATS_BATCH_MAX)], 1);
+		break;
+	case BRO2_END_NO_DOCS:
+		dev->batch = BRO2_BATCH_NONE;
+		break;
+	}
+
+	/* Done with this session, the windows driver hangs up here too. Get
+	 * the connection for the next sane_start() going. */
+	bro2_hangup(dev);
+	bro2_spare_start(dev);
+}
+
+/* All of the page has been handed out, or there wasn't one */
+static SANE_Status bro2_read_end(struct bro2_device *dev)
+{
+	if (dev->page_end == BRO2_END_NO_DOCS)
+		return SANE_STATUS_NO_DOCS;
+
+	if (!dev->page_read) {
+		bro2_blank_page(&dev->blank,
+				env_long("BRO2_BLANK_PPM", BRO2_BLANK_PPM),
+				&dev->last_page);
+		dev->page_read = true;
+	}
+	return SANE_STATUS_EOF;
+}
+
+/* The page as the scanner sends it, EOF at its end. Only waits for it if
+ * @block. */
+static SANE_Status bro2_decode(struct bro2_device *dev, SANE_Byte *buf,
+		SANE_Int maxlen, SANE_Int *len, bool block)
+{
+	struct bro2_frame *f = &dev->frame;
+	struct bro2_pipe *p = &dev->pipe;
+	size_t pos = 0;
+
+	*len = 0;
+	if (dev->start_pending) {
+		SANE_Status r = bro2_start_finish(dev, block);
+		if (r || dev->start_pending)
+			return r;
 	}
+	if (dev->decode_err)
+		return dev->decode_err;
+	if (dev->scan_done && !bro2_pipe_have_output(p))
+		return SANE_STATUS_EOF;
+	if (!dev->scan_done && dev->fd == -1)
+		return SANE_STATUS_IO_ERROR;
+
+	/*
+	 * Hand out as many records as fit in @buf. Only block (in blocking
+	 * mode) while we have nothing to return, after that just pick up
+	 * whatever has already arrived.
+	 */
+	while (pos < maxlen) {
+		int flags = MSG_DONTWAIT;
+		size_t room = maxlen - pos;
+		uint8_t *dst;
+		ssize_t r;
+		int type;
+
+		/* finish handing out an assembled line */
+		if (p->out_pos < p->out_len) {
+			size_t n = MIN(room, p->out_len - p->out_pos);
+			memcpy(buf + pos, p->out + p->out_pos, n);
+			p->out_pos += n;
+			pos += n;
+			continue;
+		}
+
+		if (p->ops->ready(p)) {
+			uint64_t t = bro2_stats_clock(&dev->stats);
+			p->ops->line(p);
+			bro2_stats_lap(&dev->stats, &dev->stats.s->decode_ns, t);
+			continue;
+		}
+
+		if (dev->scan_done)
+			break;
 
-	r = bro2_send_X(dev);
-	if (r) {
-		DBG(1, "send X failed\n");
+		/* a run left over from the last call needs no further input */
+		if (bro2_rle_pending(&p->rle)) {
+			uint64_t t = bro2_stats_clock(&dev->stats);
+			size_t used;
+			ssize_t n = p->ops->feed[1](p, dev->rec_type, NULL, 0, &used,
+					buf + pos, room);
+			bro2_stats_lap(&dev->stats, &dev->stats.s->decode_ns, t);
+			if (n < 0)
+				goto out_of_step;
+			pos += n;
+			continue;
+		}
+
+		if (dev->jpeg) {
+			uint64_t t = bro2_stats_clock(&dev->stats);
+			ssize_t n = bro2_jpeg_read(dev->jpeg, buf + pos, room);
+			bro2_stats_lap(&dev->stats, &dev->stats.s->decode_ns, t);
+			if (n < 0) {
+				/* what's in @buf goes out first, as with a
+				 * socket error */
+				DBG(1, "jpeg decode failed\n");
+				dev->decode_err = SANE_STATUS_IO_ERROR;
+				break;
+			}
+			/* lines of any other size would be out of step with
+			 * the parameters */
+			if (bro2_jpeg_started(dev->jpeg)
+					&& (bro2_jpeg_components(dev->jpeg) != 3
+					|| bro2_jpeg_width(dev->jpeg)
+					!= dev->scan.pixels_per_line)) {
+				DBG(1, "jpeg has %d pixels of %d components, "
+						"expected %d of 3\n",
+						bro2_jpeg_width(dev->jpeg),
+						bro2_jpeg_components(dev->jpeg),
+						dev->scan.pixels_per_line);
+				dev->decode_err = SANE_STATUS_IO_ERROR;
+				break;
+			}
+			if (n) {
+				pos += n;
+				continue;
+			}
+		}
+
+		type = bro2_frame_next(f);
+		if (f->fresh) {
+			f->fresh = false;
+			bro2_rec_start(dev, f);
+		}
+
+		if (type == BRO2_FRAME_NEED_MORE) {
+			r = bro2_fill(dev, f, flags);
+			goto check_io;
+		}
+
+		if (bro2_frame_is_end(type)) {
+			bro2_page_end(dev, type);
+			continue;
+		}
+
+		if (bro2_frame_buffered(f)) {
+			const uint8_t *src;
+			size_t used, avail = bro2_frame_peek(f, &src);
+
+			if (dev->rec_drop) {
+				bro2_frame_consume(f, avail);
+				continue;
+			}
+
+			if (dev->jpeg) {
+				uint64_t t = bro2_stats_clock(&dev->stats);
+				if (bro2_jpeg_feed(dev->jpeg, src, avail))
+					return SANE_STATUS_NO_MEM;
+				bro2_stats_lap(&dev->stats, &dev->stats.s->decode_ns, t);
+				bro2_frame_consume(f, avail);
+				continue;
+			}
+
+			uint64_t t = bro2_stats_clock(&dev->stats);
+			ssize_t n = p->ops->feed[dev->rec_rle](p, dev->rec_type, src,
+					avail, &used, buf + pos, room);
+			bro2_stats_lap(&dev->stats, &dev->stats.s->decode_ns, t);
+			if (n < 0)
+				goto out_of_step;
+			bro2_frame_consume(f, used);
+			pos += n;
+			continue;
+		}
+
+		if (!dev->rec_rle && !dev->rec_drop && !dev->jpeg
+				&& f->remain >= BRO2_FRAME_DIRECT_MIN) {
+			/* nothing buffered, receive straight into the destination */
+			dst = p->ops->dst(p, dev->rec_type, buf + pos, &room);
+			if (!dst)
+				goto out_of_step;
+
+			if (dev->ra_live) {
+				r = bro2_ra_read(dev->ra, dst, MIN(room, f->remain));
+				if (r > 0)
+					bro2_frame_payload_done(f, r);
+			} else {
+				r = bro2_frame_recv_payload(f, dev->fd, dst, room,
+						flags);
+			}
+			if (r > 0) {
+				bro2_evlog_add(&dev->trace, BRO2_EV_RECV_DIRECT,
+						dev->rec_type, r, room);
+				bro2_stat_add(dev, bytes, r);
+				pos += p->ops->commit(p, dev->rec_type, dst, r);
+			}
+		} else {
+			r = bro2_fill(dev, f, flags);
+		}
+
+check_io:
+		if (r > 0)
+			continue;
+
+		if (r == 0) {
+			/* we've been disconnected, probably */
+			DBG(1, "disconnected mid scan\n");
+			bro2_evlog_add(&dev->trace, BRO2_EV_ERROR, 0, 0, 0);
+			bro2_hangup(dev);
+			if (pos)
+				break;
+			return SANE_STATUS_IO_ERROR;
+		}
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			bro2_evlog_add(&dev->trace, BRO2_EV_WOULDBLOCK, 0, 0, pos);
+			bro2_stat_add(dev, eagain, 1);
+			if (f->remain || bro2_frame_buffered(f))
+				bro2_stat_add(dev, stalls, 1);
+			if (pos || !block)
+				break;
+
+			uint64_t t = bro2_stats_clock(&dev->stats);
+			int w = 0;
+			if (dev->ra_live)
+				bro2_ra_wait(dev->ra);
+			else
+				w = bro2_wait_fd(dev->fd, POLLIN);
+			bro2_stats_lap(&dev->stats, &dev->stats.s->blocked_ns, t);
+			if (!w)
+				continue;
+		}
+		if (errno == EINTR)
+			continue;
+
+		DBG(1, "sane_read fail: %d %s\n", errno, strerror(errno));
+		bro2_evlog_add(&dev->trace, BRO2_EV_ERROR, 0, 0, errno);
+		/* as for a disconnect, the next call reports it */
+		bro2_hangup(dev);
+		if (pos)
+			break;
 		return SANE_STATUS_IO_ERROR;
 	}
 
+	*len = pos;
+	if (!pos && dev->decode_err)
+		return dev->decode_err;
+	if (!pos && dev->scan_done)
+		return SANE_STATUS_EOF;
 	return SANE_STATUS_GOOD;
+
+out_of_step:
+	DBG(1, "color planes more than %d lines apart\n", BRO2_COLOR_WINDOW);
+	return SANE_STATUS_IO_ERROR;
+}
+
+/* Decode whole scanned lines into the resampler and hand out what comes
+ * of them */
+static SANE_Status bro2_resample_read(struct bro2_device *dev, SANE_Byte *buf,
+		SANE_Int maxlen, SANE_Int *len)
+{
+	size_t src_bpl = dev->scan.bytes_per_line;
+	size_t pos = 0;
+
+	*len = 0;
+	while (pos < maxlen) {
+		SANE_Status r;
+		SANE_Int n;
+
+		if (dev->rs_pos < dev->rs_len) {
+			size_t c = MIN(maxlen - pos, dev->rs_len - dev->rs_pos);
+			memcpy(buf + pos, dev->rs_line + dev->rs_pos, c);
+			dev->rs_pos += c;
+			pos += c;
+			continue;
+		}
+
+		if (bro2_rs_emit(&dev->rs, dev->rs_line)) {
+			dev->rs_len = dev->param.bytes_per_line;
+			dev->rs_pos = 0;
+			continue;
+		}
+
+		r = bro2_decode(dev, bro2_rs_src(&dev->rs) + dev->rs_fill,
+				src_bpl - dev->rs_fill, &n,
+				!dev->nonblock && !pos);
+		if (r) {
+			/* it'll come up again on the next call */
+			if (pos)
+				break;
+			return r;
+		}
+		if (!n)
+			break;
+
+		dev->rs_fill += n;
+		if (dev->rs_fill == src_bpl) {
+			bro2_rs_push(&dev->rs);
+			dev->rs_fill = 0;
+		}
+	}
+
+	*len = pos;
+	return SANE_STATUS_GOOD;
+}
+
+static SANE_Status bro2_read(struct bro2_device *dev, SANE_Byte *buf,
+		SANE_Int maxlen, SANE_Int *len)
+{
+	SANE_Status r;
+
+	if (dev->resampling)
+		r = bro2_resample_read(dev, buf, maxlen, len);
+	else
+		r = bro2_decode(dev, buf, maxlen, len, !dev->nonblock);
+
+	if (r == SANE_STATUS_EOF)
+		return bro2_read_end(dev);
+	if (r == SANE_STATUS_GOOD)
+		bro2_blank_feed(&dev->blank, buf, *len);
+	return r;
+}
+
+/*
+ * With output-file set the page goes to its file, decoded straight into
+ * the file's buffer, and the frontend is handed nothing. Each call moves
+ * the page along (to its end in blocking mode), the end is reported as
+ * usual. @full is set if there may be more to write right away.
+ */
+static SANE_Status bro2_read_file(struct bro2_device *dev, bool *full)
+{
+	SANE_Status r;
+
+	do {
+		uint8_t *dst;
+		size_t room = MIN(bro2_file_space(&dev->file, &dst), INT_MAX);
+		SANE_Int n = 0;
+
+		r = bro2_read(dev, dst, room, &n);
+		if (n && bro2_file_commit(&dev->file, n)) {
+			DBG(1, "writing %s: %s\n", dev->file.path, strerror(errno));
+			r = SANE_STATUS_IO_ERROR;
+		}
+		*full = n == room;
+	} while (r == SANE_STATUS_GOOD && !dev->nonblock);
+
+	if (r == SANE_STATUS_EOF && bro2_file_end(&dev->file)) {
+		DBG(1, "writing page: %s\n", strerror(errno));
+		r = SANE_STATUS_IO_ERROR;
+	} else if (r != SANE_STATUS_GOOD) {
+		bro2_file_abort(&dev->file);
+	}
+	return r;
 }
 
 SANE_Status sane_read(SANE_Handle h, SANE_Byte *buf, SANE_Int maxlen, SANE_Int *len)
@@ -918,72 +3091,45 @@ SANE STATUS ACCESS DENIED: Access to the device has been denied due to insuffici
 or invalid authentication.
 #endif
 	struct bro2_device *dev = h;
+	SANE_Status r;
+	bool full;
 
-	DBG(1, "reading...\n");
-	ssize_t r = read(dev->fd, dev->line_buffer + dev->line_buffer_pos, sizeof(dev->line_buffer) - dev->line_buffer_pos);
-	DBG(1, "done reading, got %zd bytes\n", r);
-
-	if (r == -1) {
-		switch (errno) {
-		case EAGAIN:
-			/* apparently we are non-blocking */
-			*len = 0;
-			return SANE_STATUS_GOOD;
-		default:
-			DBG(1, "sane_read fail: %d %s\n", errno, strerror(errno));
-			return SANE_STATUS_IO_ERROR;
-		}
-	} else if (r == 0) {
-		/* we've been disconnected, probably */
-		close(dev->fd);
-		dev->fd = -1;
-		return SANE_STATUS_IO_ERROR;
-	}
-
-	dev->line_buffer_pos += r;
-	print_hex_dump(dev->line_buffer, dev->line_buffer_pos, stdout);
-	putchar('\n');
-
-	if (dev->line_buffer_pos < 3) {
-		/* not enough data */
-		*len = 0;
-		return SANE_STATUS_GOOD;
-	}
-
-	/* Determine the type */
-	DBG(1, "line type: %d\n", dev->line_buffer[0]);
-	uint16_t line_len = dev->line_buffer[1] + (dev->line_buffer[2] << 8);
-	DBG(1, "line length: %d\n", line_len);
-
-	if (dev->line_buffer_pos - 3 < line_len) {
-		/* not enough data */
+	if (dev->file.fd != -1) {
 		*len = 0;
-		return SANE_STATUS_GOOD;
-	}
-
-	/* enough data, write it out */
-
-	if (dev->line_buffer_pos - 3 > maxlen) {
-		/* not enough space */
-		*len = 0;
-		return SANE_STATUS_NO_MEM;
+		r = bro2_read_file(dev, &full);
+	} else {
+		r = bro2_read(dev, buf, maxlen, len);
+		full = *len == maxlen;
 	}
 
-	memcpy(buf, dev->line_buffer + 3, dev->line_buffer_pos - 3);
+	bro2_evlog_add(&dev->trace, BRO2_EV_READ, r, *len, maxlen);
+	/* keep the lead up to a failure */
+	if (r == SANE_STATUS_IO_ERROR)
+		bro2_trace_dump(dev);
 
-	*len = dev->line_buffer_pos - 3;
-	return SANE_STATUS_GOOD;
+	/* stopping short of a full buffer means we're waiting on the
+	 * scanner, otherwise there may be more to hand out right away */
+	bro2_select_update(dev, dev->scan_done || full);
+	return r;
 }
 
 void sane_cancel(SANE_Handle h)
 {
 	/* TODO: close & reopen? */
 	struct bro2_device *dev = h;
+	dev->batch = BRO2_BATCH_NONE;
+	dev->start_pending = false;
+	bro2_file_abort(&dev->file);
 	if (dev->fd != -1) {
-		bro2_send_R(dev);
-		close(dev->fd);
-		dev->fd = -1;
+		if (dev->sess == BRO2_SESS_SCAN)
+			bro2_send_R(dev);
+		bro2_hangup(dev);
+		bro2_spare_start(dev);
+	} else if (dev->sess == BRO2_SESS_CONNECTING) {
+		/* keep it, it's as good as a fresh spare */
+		dev->sess = BRO2_SESS_IDLE;
 	}
+	bro2_select_update(dev, false);
 }
 
 SANE_Status sane_set_io_mode(SANE_Handle h, SANE_Bool m)
@@ -993,13 +3139,11 @@ SANE STATUS INVAL: No image acquisition is pending.
 SANE STATUS UNSUPPORTED: The backend does not support the requested I/O mode.
 #endif
 	struct bro2_device *dev = h;
-	if (dev->fd == -1)
+	if (dev->fd == -1 && !dev->start_pending)
 		return SANE_STATUS_INVAL;
 
-	if (m == SANE_FALSE)
-		return SANE_STATUS_GOOD;
-
-	return SANE_STATUS_UNSUPPORTED;
+	dev->nonblock = m;
+	return SANE_STATUS_GOOD;
 }
 
 SANE_Status sane_get_select_fd(SANE_Handle h, SANE_Int *fd)
@@ -1009,11 +3153,11 @@ SANE STATUS INVAL: No image acquisition is pending.
 SANE STATUS UNSUPPORTED: The backend does not support this operation.
 #endif
 	struct bro2_device *dev = h;
-	if (dev->fd == -1) {
+	if (dev->fd == -1 && !dev->spare_live && !dev->start_pending) {
 		return SANE_STATUS_INVAL;
 	}
 
-	*fd = dev->fd;
+	*fd = dev->sel_fd;
 	return SANE_STATUS_GOOD;
 }
 
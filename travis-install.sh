@@ -11,7 +11,7 @@ sudo add-apt-repository -y ppa:xorg-edgers/ppa
 sudo add-apt-repository -y ppa:dns/gnu
 
 sudo apt-get update
-sudo apt-get install libsane-dev libev-dev clang-3.3 binutils
+sudo apt-get install libsane-dev libev-dev libjpeg-dev clang-3.3 binutils
 
 ## We need a newer version of net-snmp than ubuntu 12.04 has.
 ## Ubuntu has 5.4.3, we need at v5.5+ release for